@@ -0,0 +1,35 @@
+#ifndef CLUSTER_CACHE_H
+#define CLUSTER_CACHE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// File name: ClusterCache.h
+// Description: Disk-backed data region. Clusters stay in the image file and are served through
+//              a fixed number of frames with CLOCK eviction. Dirty frames are written back when
+//              they are evicted or flushed, sequential misses read ahead. Safe to use from
+//              several threads, one mutex guards the frames. Evicted clusters reach the file
+//              before the next commit, so the file is only consistent right after one.
+
+#define CACHE_MIN_FRAMES 64              // Floor of the budget, every thread may pin a cluster or two
+#define CACHE_IO_BYTES (1024 * 1024)     // Largest single read ahead or coalesced write back
+
+typedef struct ClusterCache ClusterCache;
+
+// Takes over fd, the data region starts at data_offset. NULL if out of memory.
+ClusterCache *cache_open(int fd, off_t data_offset, int32_t cluster_size, int32_t cluster_count, size_t budget);
+void cache_close(ClusterCache *cache);   // Drops dirty frames unwritten and closes the file
+
+// Contents of a cluster, valid until cache_unpin(). With load false the caller overwrites the
+// whole cluster and nothing is read. NULL on a read error or when every frame is pinned.
+char *cache_pin(ClusterCache *cache, int32_t cluster, bool load);
+void cache_unpin(ClusterCache *cache, int32_t cluster, bool dirty);
+
+bool cache_flush(ClusterCache *cache);                  // Write back every dirty frame, false on I/O errors
+bool cache_zero(ClusterCache *cache, int32_t cluster, int32_t count); // Zero a run of clusters in the file, their frames are dropped
+bool cache_relocate(ClusterCache *cache, off_t data_offset, off_t data_size); // Move the data region in the file
+off_t cache_data_offset(const ClusterCache *cache);
+int cache_fd(const ClusterCache *cache);
+
+#endif // CLUSTER_CACHE_H
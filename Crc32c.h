@@ -0,0 +1,15 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// File name: Crc32c.h
+// Description: CRC32C (Castagnoli) used for the per-cluster checksums. Uses the SSE4.2 crc32
+//              instruction when the CPU has it, slicing-by-8 tables otherwise.
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t size); // Continue crc (0 to start) over data
+uint32_t crc32c_zeros(uint32_t crc, size_t size);              // Continue crc over size zero bytes
+const char *crc32c_implementation();                          // "sse4.2" or "slicing-by-8"
+
+#endif // CRC32C_H
@@ -1,8 +1,11 @@
 #ifndef FAT_TABLE_H
 #define FAT_TABLE_H
 
+#include <pthread.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
 
 // File name: FatTable.h
 // Description: Header file for a pseudo-FAT filesystem
@@ -14,6 +17,15 @@
 #define FAT_BAD_CLUSTER  (INT32_MAX - 3) // Marks a bad cluster
 #define MAX_ITEM_NAME_SIZE 256           // Maximum size for item names
 #define MAX_CHILDREN 128                 // Maximum number of children per directory
+#define INLINE_LIMIT_DEFAULT 128         // Files up to this size are stored in their directory record
+
+// Room for inline file contents behind the name (and its terminating zero) in a record
+#define INLINE_CAPACITY(name) (MAX_ITEM_NAME_SIZE - (int32_t)strlen(name) - 1)
+
+// Optional features of an image (FSDescription.features)
+#define FS_FEATURE_CHECKSUMS 0x1         // A CRC32C per cluster follows the FAT tables
+#define FS_FEATURE_DIRECTORY_CLUSTERS 0x2 // Directories are records in their cluster chains (older
+                                          // images serialize the tree between the FATs and the data)
 
 // Structure describing the filesystem properties
 typedef struct FSDescription {
@@ -25,8 +37,16 @@ typedef struct FSDescription {
     int32_t *fat1_start_address;    // Starting address of the FAT1 table
     int32_t *fat2_start_address;    // Starting address of the FAT2 table (if present)
     int32_t data_start_address;     // Starting address of the data blocks (root directory)
+    int32_t features;               // FS_FEATURE_* bits, fits in the former tail padding (0 in old images)
 } FSDescription;
 
+// Aggregate of a subtree, kept up to date by every mutation
+typedef struct SubtreeTotals {
+    int64_t bytes;                       // Sizes of all files
+    int64_t files;                       // Number of files
+    int64_t clusters;                    // File chains plus directory chains, shared clusters once per item
+} SubtreeTotals;
+
 // Structure representing a directory or file item
 typedef struct DirectoryItem {
     char item_name[MAX_ITEM_NAME_SIZE];  // Name of the item
@@ -36,43 +56,134 @@ typedef struct DirectoryItem {
     struct DirectoryItem *parent;        // Parent directory of the item
     struct DirectoryItem *children[MAX_CHILDREN];  // Array of child items (for directories)
     int child_count;                     // Number of child items
+    bool is_inline;                      // File contents are in inline_data, the file owns no cluster
+    char inline_data[MAX_ITEM_NAME_SIZE]; // Contents of an inline file
+    SubtreeTotals totals;                // Directories: everything below, their own chain included
+    struct DirectoryItem *name_next;     // Next item in the same name index bucket
+    struct DirectoryItem *extension_next; // Next item in the same extension index bucket
+    struct DirectoryVersion *version;    // Directories: published version, server mode only (TreeVersions.h)
 } DirectoryItem;
 
-// Global variables representing the filesystem state
-extern FSDescription fs_description; // Filesystem descriptor
-extern int32_t *fat_table1;          // Pointer to the first FAT table
-extern int32_t *fat_table2;          // Pointer to the second FAT table (if present)
-extern DirectoryItem root_directory; // Root directory of the filesystem
-extern DirectoryItem *current_directory; // Current working directory
-extern char *fs_data;                // Pointer to the filesystem's data blocks (memory or disk)
+// One entry of a directory as stored in the cluster chain of the directory. Records are packed
+// back to back through the chain, the first record with an empty name ends the list.
+typedef struct DirectoryRecord {
+    char item_name[MAX_ITEM_NAME_SIZE];  // Name of the item, empty for the end of the list
+    int32_t size;                        // Size of the item (for files)
+    int32_t start_cluster;               // First cluster of the file data or of the directory's records
+    uint8_t is_file;                     // 1 for files, 0 for directories
+    uint8_t flags;                       // RECORD_* bits
+    uint8_t reserved[6];
+} DirectoryRecord;
+
+#define RECORD_INLINE 0x1                // The file contents follow the name inside item_name
+
+#define FAT_MIRROR_PAGE 1024             // FAT entries per dirty flag of the fat_table2 mirror (4 KB)
+
+// One filesystem instance. Everything an operation touches lives here, so several
+// filesystems can be open in one process and operations need no global state.
+typedef struct FileSystem {
+    FSDescription description;       // Filesystem descriptor
+    int32_t *fat_table1;             // First FAT table, NULL until formatted or loaded
+    int32_t *fat_table2;             // Second FAT table, a mirror of the first synced at every save
+    uint8_t *fat_dirty;              // Per FAT_MIRROR_PAGE entries: changed in fat_table1 since the last sync
+    int32_t fat_dirty_count;         // Number of dirty pages
+    int32_t fat_mismatches;          // Entries the two FAT copies disagreed on at load
+    bool fat_failover;               // fat_table1 of the image was damaged, it was loaded from fat_table2
+    DirectoryItem root_directory;    // Root directory of the filesystem
+    char *data;                      // Data blocks, NULL when the image is disk-backed
+    struct ClusterCache *cache;      // Disk-backed data region in the image file, NULL when data holds it
+    size_t cache_budget;             // Cache bytes for disk-backed images, 0 keeps the whole disk in memory
+    uint8_t *fat_unsaved;            // Disk-backed: per FAT_MIRROR_PAGE entries, not written to the image yet
+    char *record_buffer;             // One cluster, store_directory() assembles records in it (it runs exclusively)
+    bool read_only;                  // Mounted read-only: the image is mapped shared, nothing is modified or saved
+    void *mapping;                   // Read-only: the whole image file, data points into it
+    size_t mapping_size;
+    int mapping_fd;                  // Read-only: the image file holding the shared flock(), -1 when not mapped
+    int32_t *cluster_references;     // Number of items starting at each cluster
+    uint8_t *zero_pending;           // Per-cluster flag: freed, stale contents not cleared yet (reads as zeros)
+    int32_t zero_pending_count;      // Number of clusters waiting to be zeroed
+    uint32_t *cluster_checksums;     // CRC32C of every cluster, NULL unless FS_FEATURE_CHECKSUMS is on
+    uint32_t zero_checksum;          // CRC32C of an all-zero cluster (free and zero_pending clusters)
+    uint64_t checksum_mismatches;    // Failed verifications since format or load
+    const char *image_path;          // Image file written by format, load and the final save
+    pthread_rwlock_t lock;           // Commands that only read share it, mutations hold it exclusively
+    struct Scrubber *scrubber;       // Background scrub thread, NULL unless started
+    struct Reclaimer *reclaimer;     // Background reclamation of removed subtrees, NULL unless used
+    struct IoQueue *io;              // Host I/O threads of save, load, incp and outcp, NULL until first used
+    int io_depth;                    // Host requests in flight at once
+    struct NameIndex *name_index;    // Items by name and extension, NULL if out of memory
+    struct TreeVersions *versions;   // Published tree for readers without the lock, NULL unless started
+    int32_t inline_limit;            // Largest file stored inline in its directory record, 0 = none
+    bool defer_save;                 // True when the caller commits the image (batch mode), format does not save
+} FileSystem;
 
+// One user of a filesystem: working directory, output stream and error state
+typedef struct Session {
+    FileSystem *fs;                  // Filesystem the session works on
+    DirectoryItem *current_directory; // Current working directory
+    FILE *out;                       // Output of the session, NULL for stdout/stderr
+    bool process_error;              // Set when the last processed command failed
+    const struct DirectoryVersion *published_root; // Set while a command reads the published tree without fs->lock
+    const char *published_cwd;       // Working directory of that command, current_directory is not used
+} Session;
+
+// Streams the output of a session goes to (session may be NULL)
+#define SESSION_OUT(session) ((session) && (session)->out ? (session)->out : stdout)
+#define SESSION_ERR(session) ((session) && (session)->out ? (session)->out : stderr)
+
+// Context and session setup
+void fs_init(FileSystem *fs, const char *image_path);      // Empty, unformatted filesystem backed by image_path
+void fs_release(FileSystem *fs);                            // Free everything the filesystem owns
+void session_init(Session *session, FileSystem *fs);        // Session at the root of fs writing to stdout
+void scrub_release(FileSystem *fs);                         // Stop the background scrubber and free it
+void reclaim_release(FileSystem *fs);                       // Finish pending reclamation, stop its thread and free it
+struct IoQueue *fs_io_queue(FileSystem *fs);                // The host I/O queue, started on first use (NULL if out of memory)
 
 // Filesystem initialization and state management
-void initialize_filesystem(int32_t disk_size, int32_t cluster_size); // Initialize a new filesystem
-void format_filesystem(const char *filename, int32_t disk_size, int32_t cluster_size); // Format the filesystem
-void save_system_state(const char *filename);    // Save the current filesystem state to a file
-void load_system_state(const char *filename);    // Load a saved filesystem state from a file
-void process_command(const char *filename, char *command); // Process a command for the filesystem
+void save_system_state(FileSystem *fs, Session *session, const char *filename); // Save the filesystem state to a file
+void load_system_state(FileSystem *fs, Session *session, const char *filename); // Load a saved filesystem state from a file
+void process_command(FileSystem *fs, Session *session, char *command); // Process a command for the filesystem
+void execute_command(FileSystem *fs, Session *session, char *command); // process_command() holding fs->lock
+
+// How a command line may run concurrently in server mode
+typedef enum CommandAccess {
+    COMMAND_READ,   // Only reads the filesystem, runs in parallel with other readers
+    COMMAND_WRITE,  // Modifies the filesystem, runs exclusively
+    COMMAND_PUBLISHED, // Only reads names and the shape of the tree, runs without the lock on the published tree (server)
+} CommandAccess;
+
+void init_command_table();                           // Build the command lookup table (before starting threads)
+CommandAccess command_access(const char *command);   // Classify a command line without executing it
+
+// Server sessions keep their working directory as a path between commands
+bool get_item_path(const DirectoryItem *item, char *out, size_t size); // Absolute path of an item
+void session_enter(Session *session, const char *cwd_path);         // Set the current directory from a path
+void session_leave(Session *session, char *cwd_path, size_t size);  // Store the current directory as a path
 
 // Cluster management
-void allocate_clusters_for_directory(DirectoryItem *dir, int clusters_needed); // Allocate clusters for a directory
-int32_t allocate_cluster();   // Allocate a single free cluster
-
-// Filesystem operations
-void mkdir(const char *path);   // Create a new directory
-void rmdir(const char *path);   // Remove a directory
-void rm(const char *name);      // Remove a file or directory
-void cd(const char *path);      // Change the current working directory
-void cp(const char *src_path, const char *dest_path); // Copy files or directories
-void mv(const char *src_path, const char *dest_path); // Move or rename files/directories
-void ls(const char *name);      // List the contents of a directory
-void info(const char *name);    // Display information about a file or directory
-void pwd();                     // Print the current working directory path
-void check();                   // Check the filesystem's integrity
-void bug(const char *name);     // Simulate a bug for testing
-void incp(const char *source, const char *destination); // Copy data from an external file into the filesystem
-void outcp(const char *source, const char *destination); // Copy data from the filesystem to an external file
-void cat(const char *source);   // Display the contents of a file
-void load(const char *filename, const char *source); // Load data into the filesystem from an external source
+bool allocate_clusters_for_directory(FileSystem *fs, DirectoryItem *dir, int clusters_needed); // Grow a directory chain, false if no space
+int32_t allocate_cluster(FileSystem *fs);               // Allocate a single free cluster
+void set_fat_entry(FileSystem *fs, int32_t cluster, int32_t value); // Write an entry of fat_table1, the mirror follows at the next sync
+void sync_fat_mirror(FileSystem *fs);                   // Copy the dirty ranges of fat_table1 to fat_table2
+void free_cluster(FileSystem *fs, int32_t cluster);     // Release a cluster, its contents are zeroed lazily
+void init_cluster_state(FileSystem *fs);                // Rebuild per-cluster bookkeeping after format or load
+bool enable_cluster_checksums(FileSystem *fs);          // Allocate and compute the checksum table, false if out of memory
+bool verify_cluster_checksum(FileSystem *fs, int32_t cluster); // True if the cluster matches its checksum (or checksums are off)
+
+// Directory tree and cluster helpers
+DirectoryItem* find_item_by_path(FileSystem *fs, const char *path, DirectoryItem *start_directory); // Resolve a path, NULL if it does not exist
+void rm_recursive(FileSystem *fs, DirectoryItem *target); // Free a detached subtree and its clusters
+bool reclaim_later(FileSystem *fs, DirectoryItem *target); // Hand rm_recursive() to the background thread, false if it cannot take it
+void reclaim_finish(FileSystem *fs); // Complete every pending reclamation (caller has exclusive access)
+void free_directory_tree(DirectoryItem *dir); // Free the items below dir (clusters are kept)
+SubtreeTotals item_totals(FileSystem *fs, const DirectoryItem *item); // What an item adds to the totals of its ancestors
+void propagate_totals(DirectoryItem *dir, SubtreeTotals delta, int sign); // Add (sign 1) or remove (-1) delta from dir and every directory above
+void store_directory(FileSystem *fs, DirectoryItem *dir); // Write the records of dir's children into its chain
+int32_t chain_length(FileSystem *fs, int32_t cluster); // Length of a chain, -1 if it leaves the data region or loops
+void* read_cluster_data(FileSystem *fs, int32_t cluster, size_t size); // Read a cluster into a new buffer
+bool read_cluster_into(FileSystem *fs, int32_t cluster, size_t offset, void *buffer, size_t size); // Read part of a cluster without allocating
+void write_cluster_data(FileSystem *fs, int32_t cluster, const void *data, size_t size); // Write data into a cluster
+char *cluster_pin(FileSystem *fs, int32_t cluster, bool load); // Contents of a cluster in place, NULL on I/O errors (load false: about to be overwritten)
+void cluster_unpin(FileSystem *fs, int32_t cluster, bool dirty); // Done with cluster_pin(), dirty if it was written
 
 #endif // FAT_TABLE_H
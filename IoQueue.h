@@ -0,0 +1,37 @@
+#ifndef IO_QUEUE_H
+#define IO_QUEUE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+// File name: IoQueue.h
+// Description: Asynchronous positional I/O on host files. Requests go to a pool of I/O threads
+//              doing pread()/pwrite(), up to the queue depth of them are in flight at once. A
+//              caller groups its requests in an IoBatch and waits for the whole batch.
+
+#define IO_QUEUE_DEPTH 32                // Requests in flight unless --io-depth says otherwise
+#define IO_MAX_THREADS 16                // I/O threads at most, whatever the depth
+#define IO_REQUEST_BYTES (1024 * 1024)   // Largest single request of save and load
+
+typedef struct IoQueue IoQueue;
+
+// Requests submitted together, lives with the caller
+typedef struct IoBatch {
+    int pending;                         // Submitted and not completed yet
+    bool failed;                         // A request failed or reached the end of the file
+} IoBatch;
+
+// NULL if out of memory. Without any thread the requests run in the submitting thread.
+IoQueue *io_queue_create(int depth);
+void io_queue_release(IoQueue *queue);
+
+// Queue a read or write of size bytes at offset, blocks while the queue is full. The buffer
+// must stay valid until io_wait() on the batch returns.
+void io_read(IoQueue *queue, IoBatch *batch, int fd, void *buffer, size_t size, off_t offset);
+void io_write(IoQueue *queue, IoBatch *batch, int fd, const void *buffer, size_t size, off_t offset);
+
+// Waits for every request of the batch, true if all of them succeeded. The batch is empty again.
+bool io_wait(IoQueue *queue, IoBatch *batch);
+
+#endif // IO_QUEUE_H
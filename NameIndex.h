@@ -0,0 +1,27 @@
+#ifndef NAME_INDEX_H
+#define NAME_INDEX_H
+
+#include "FatTable.h"
+
+// File name: NameIndex.h
+// Description: Global index of every item by name and by extension, used by `find`. Items are
+//              chained through their name_next and extension_next links, nothing is copied.
+//              Rebuilt on format and load, kept up to date by every mutation after that.
+
+#define NAME_INDEX_BUCKETS 1024          // Initial bucket count, doubled when the chains get long
+
+typedef struct NameIndex NameIndex;
+
+void name_index_rebuild(FileSystem *fs);                          // Index the whole tree from scratch
+void name_index_release(FileSystem *fs);                          // Drop the index (before the tree is freed)
+void name_index_add(FileSystem *fs, DirectoryItem *item);         // After item got its name and parent
+void name_index_remove(FileSystem *fs, DirectoryItem *item);      // Before item is renamed or freed
+void name_index_remove_subtree(FileSystem *fs, DirectoryItem *dir); // Everything below dir, dir stays
+
+// First candidate of a bucket, NULL without an index. Follow name_next (extension_next) and
+// compare, other names share the bucket.
+DirectoryItem *name_index_names(FileSystem *fs, const char *name);
+DirectoryItem *name_index_extensions(FileSystem *fs, const char *extension);
+const char *name_extension(const char *name);                     // Text after the last '.', NULL if none
+
+#endif // NAME_INDEX_H
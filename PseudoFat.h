@@ -0,0 +1,203 @@
+#ifndef PSEUDO_FAT_H
+#define PSEUDO_FAT_H
+
+#include <stddef.h>
+#include "FatTable.h"
+
+// File name: PseudoFat.h
+// Description: Programmatic interface of libpseudofat. Every call returns a PfResult and prints
+//              nothing, results come back through stat structs, iterators and caller buffers.
+//              Paths are resolved against the session's current directory unless absolute.
+
+// Result of every library call
+typedef enum PfResult {
+    PF_OK = 0,
+    PF_END,                  // Iterator or file exhausted, not an error
+    PF_ERR_NOT_FORMATTED,    // No image loaded or formatted
+    PF_ERR_INVALID_ARGUMENT, // Bad parameter (size, cluster size, NULL pointer, ...)
+    PF_ERR_INVALID_PATH,     // Empty path, component too long, ".." above the root
+    PF_ERR_NOT_FOUND,        // The item itself does not exist
+    PF_ERR_PATH_NOT_FOUND,   // A directory on the way does not exist
+    PF_ERR_NOT_A_DIRECTORY,  // A directory was expected
+    PF_ERR_NOT_A_FILE,       // A file was expected
+    PF_ERR_EXISTS,           // The name is already taken
+    PF_ERR_NOT_EMPTY,        // The directory still has children
+    PF_ERR_DIRECTORY_FULL,   // MAX_CHILDREN reached
+    PF_ERR_NO_SPACE,         // No free cluster left
+    PF_ERR_NO_MEMORY,        // Host allocation failed
+    PF_ERR_IO,               // Host file could not be read or written
+    PF_ERR_CORRUPTED,        // Image or cluster chain is damaged
+    PF_ERR_READ_ONLY,        // The image is mounted read-only
+    PF_ERR_BUSY,             // Another process holds the image (read-only mounts against a writer)
+} PfResult;
+
+// Metadata of one item
+typedef struct PfStat {
+    char name[MAX_ITEM_NAME_SIZE];
+    bool is_file;
+    int32_t size;             // Bytes (files only)
+    int32_t start_cluster;
+    int32_t cluster_count;    // Length of the cluster chain, -1 if the chain is broken
+    bool is_inline;           // Contents stored in the directory record, no clusters
+} PfStat;
+
+// Iterator over the children of a directory, valid until the next mutation (or, on the
+// published tree, until the command ends)
+typedef struct PfDir {
+    FileSystem *fs;
+    const DirectoryItem *directory;
+    const struct DirectoryVersion *version; // Set instead of directory on the published tree
+    int index;
+} PfDir;
+
+// Sequential reader of one file, valid until the next mutation
+typedef struct PfFile {
+    FileSystem *fs;
+    const DirectoryItem *item;
+    int32_t cluster;          // Cluster holding the current position
+    int32_t position;         // Bytes already read
+} PfFile;
+
+// One finding of pf_check()
+typedef enum PfCheckStatus {
+    PF_CHECK_INTACT,
+    PF_CHECK_BAD_CLUSTER,     // Chain leaves the data region, cluster holds the bad value
+    PF_CHECK_BAD_SIZE,        // File is larger than its chain, expected_size holds the chain capacity
+    PF_CHECK_BAD_CHECKSUM,    // Cluster contents do not match their CRC32C, cluster holds the cluster
+} PfCheckStatus;
+
+typedef struct PfCheckEntry {
+    const char *name;
+    bool is_file;
+    PfCheckStatus status;
+    int32_t cluster;
+    int32_t size;
+    int32_t expected_size;
+} PfCheckEntry;
+
+typedef void (*PfCheckCallback)(const PfCheckEntry *entry, void *context);
+
+// One line of pf_du(): a directory (or the file pf_du() was called on) and its subtree totals
+typedef struct PfDuEntry {
+    const char *path;             // Absolute path
+    int depth;                    // 0 for the item pf_du() was called on
+    bool is_file;
+    int64_t bytes;
+    int64_t files;
+    int64_t clusters;
+} PfDuEntry;
+
+typedef void (*PfDuCallback)(const PfDuEntry *entry, void *context);
+
+typedef void (*PfGrepCallback)(const char *path, int64_t offset, void *context);
+typedef void (*PfFindCallback)(const char *path, bool is_file, void *context);
+
+#define PF_SCRUB_LOG_SIZE 32      // Most recent scrub findings kept for pf_scrub_status()
+
+// Problems the background scrubber looks for
+typedef enum PfScrubIssue {
+    PF_SCRUB_CHECKSUM,            // Cluster contents do not match their CRC32C
+    PF_SCRUB_FAT_MISMATCH,        // fat_table1 and fat_table2 disagree
+    PF_SCRUB_BAD_LINK,            // FAT entry points outside the data region
+} PfScrubIssue;
+
+typedef struct PfScrubFinding {
+    int64_t time;                 // Unix time of the finding
+    int32_t cluster;
+    PfScrubIssue issue;
+    int32_t fat1, fat2;           // FAT entries of the cluster at that time
+} PfScrubFinding;
+
+typedef struct PfScrubStatus {
+    bool running;
+    double rate_mb_s;             // Throttle of the running (or last) scrub
+    int32_t cursor;               // Next cluster to check, persisted next to the image
+    int32_t cluster_count;
+    uint64_t passes;              // Completed passes over the whole FAT, persisted
+    uint64_t clusters_checked;    // Allocated clusters checked since the scrubber started
+    uint64_t bytes_checked;       // Cluster bytes verified since the scrubber started
+    uint64_t findings;            // All findings, persisted
+    int log_count;                // Valid entries of log, oldest first
+    PfScrubFinding log[PF_SCRUB_LOG_SIZE];
+} PfScrubStatus;
+
+#define PF_CLUSTER_SIZE_MIN 512                 // Smallest cluster size pf_format() accepts
+#define PF_CLUSTER_SIZE_MAX (1024 * 1024)       // Largest one, cluster sizes are powers of two in between
+#define PF_CLUSTER_SIZE_DEFAULT 4096            // Used by `format` without cluster=
+#define PF_ADVICE_CANDIDATES 12                 // Cluster sizes PF_CLUSTER_SIZE_MIN .. PF_CLUSTER_SIZE_MAX
+
+// Modeled cost of one cluster size for a sampled host tree
+typedef struct PfClusterEstimate {
+    int32_t cluster_size;
+    int64_t clusters;             // Data and directory clusters the tree would occupy
+    int64_t slack_bytes;          // Unused tail of the last cluster of every chain
+    int64_t fat_bytes;            // FAT1 and FAT2 entries for those clusters
+    double average_chain;         // Clusters per file stored in a chain
+    int64_t longest_chain;
+} PfClusterEstimate;
+
+typedef struct PfClusterAdvice {
+    int64_t files;
+    int64_t inline_files;         // Small enough to stay in their directory records
+    int64_t directories;
+    int64_t bytes;                // Sum of the file sizes
+    PfClusterEstimate estimates[PF_ADVICE_CANDIDATES];
+    int recommended;              // Index of the least slack plus FAT overhead
+} PfClusterAdvice;
+
+const char *pf_strerror(PfResult result);   // Short upper-case description ("FILE NOT FOUND", ...)
+
+// Lifecycle
+PfResult pf_open(FileSystem *fs, const char *image_path);   // fs_init() and load the image if it exists
+PfResult pf_open_read_only(FileSystem *fs, const char *image_path); // Map an existing image shared and read-only, writers get PF_ERR_BUSY while it is mapped
+PfResult pf_format(FileSystem *fs, int32_t disk_size, int32_t cluster_size); // Fresh empty filesystem in memory
+PfResult pf_advise_cluster_size(FileSystem *fs, const char *host_dir, PfClusterAdvice *advice); // Model a host tree, nothing is formatted
+PfResult pf_load(FileSystem *fs, const char *path);         // Replace the filesystem by an image file
+PfResult pf_save(FileSystem *fs, const char *path);         // Write the filesystem to an image file, PF_ERR_BUSY while read-only mounts map it
+PfResult pf_commit(FileSystem *fs);                         // pf_save() to the image the filesystem belongs to
+void pf_close(FileSystem *fs);                              // Release everything, does not save
+
+// Namespace
+PfResult pf_mkdir(FileSystem *fs, Session *session, const char *path);   // Creates missing parents too
+PfResult pf_rmdir(FileSystem *fs, Session *session, const char *path);
+PfResult pf_unlink(FileSystem *fs, Session *session, const char *path);  // Remove a file
+PfResult pf_remove_tree(FileSystem *fs, Session *session, const char *path, bool background); // rm -r, background: clusters are freed later
+PfResult pf_chdir(FileSystem *fs, Session *session, const char *path);
+PfResult pf_getcwd(FileSystem *fs, Session *session, char *buffer, size_t size);
+PfResult pf_copy(FileSystem *fs, Session *session, const char *src_path, const char *dest_path); // Files only, clusters are shared
+PfResult pf_move(FileSystem *fs, Session *session, const char *src_path, const char *dest_path); // Into an existing directory, otherwise rename
+PfResult pf_stat(FileSystem *fs, Session *session, const char *path, PfStat *stat);
+PfResult pf_chain(FileSystem *fs, Session *session, const char *path, int32_t *clusters, int32_t capacity, int32_t *count);
+PfResult pf_find(FileSystem *fs, Session *session, const char *dir_path, const char *pattern, PfFindCallback callback, void *context); // Items below dir_path whose name matches the glob, sorted by path
+
+PfResult pf_grep(FileSystem *fs, Session *session, const char *pattern, const char *path, bool recursive,
+                 PfGrepCallback callback, void *context); // Offsets of pattern in the file, the files of a directory or (recursive) all below
+
+// Directory iteration
+PfResult pf_opendir(FileSystem *fs, Session *session, const char *path, PfDir *dir);
+PfResult pf_readdir(PfDir *dir, PfStat *entry);             // PF_END after the last child
+
+// File data
+PfResult pf_open_file(FileSystem *fs, Session *session, const char *path, PfFile *file);
+PfResult pf_read(PfFile *file, void *buffer, size_t size, size_t *bytes_read); // PF_END at the end of the file
+PfResult pf_read_file(FileSystem *fs, Session *session, const char *path, void *buffer, size_t size, size_t *bytes_read);
+PfResult pf_write_file(FileSystem *fs, Session *session, const char *path, const void *data, size_t size); // Create a new file
+PfResult pf_import(FileSystem *fs, Session *session, const char *host_path, const char *path);  // incp
+PfResult pf_export(FileSystem *fs, Session *session, const char *path, const char *host_path);  // outcp
+
+// Maintenance
+PfResult pf_check(FileSystem *fs, Session *session, PfCheckCallback callback, void *context, int *problems); // Subtree of the current directory
+PfResult pf_du(FileSystem *fs, Session *session, const char *path, int max_depth, PfDuCallback callback, void *context); // Directories down to max_depth (-1 = all), deepest first
+PfResult pf_trim(FileSystem *fs, int32_t *trimmed);          // Zero all clusters of the zero_pending set
+PfResult pf_set_checksums(FileSystem *fs, bool enabled);    // Turn the per-cluster CRC32C table on or off
+PfResult pf_checksum_status(FileSystem *fs, bool *enabled, uint64_t *mismatches); // Mismatches since format or load
+PfResult pf_set_inline_limit(FileSystem *fs, int32_t limit); // Largest new file kept in its directory record, 0 = never
+PfResult pf_corrupt(FileSystem *fs, Session *session, const char *name, bool *is_file, int32_t *original); // Testing hook behind `bug`
+
+// Background scrubbing. Callers that run operations while the scrubber is active must hold
+// fs->lock (shared for reads, exclusive for mutations), the scrubber takes it shared.
+PfResult pf_scrub_start(FileSystem *fs, double rate_mb_s);  // Start the thread, resumes from the persisted cursor
+PfResult pf_scrub_stop(FileSystem *fs);                     // Stop and join it, the cursor is persisted
+PfResult pf_scrub_status(FileSystem *fs, PfScrubStatus *status);
+
+#endif // PSEUDO_FAT_H
@@ -0,0 +1,18 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include "FatTable.h"
+
+// File name: Server.h
+// Description: Daemon mode. One process owns the image and serves many clients over a local
+//              Unix domain socket. Every client has its own session with its own working
+//              directory. Read commands run in parallel, mutations are serialized. ls and pwd
+//              do not wait for mutations, they read the published tree (TreeVersions.h).
+//
+// Protocol: the client sends one command per line. The server answers every line with
+// "<length>\n" followed by exactly length bytes of command output.
+
+int run_server(FileSystem *fs, const char *socket_path, long commit_every); // Serve fs until SIGINT/SIGTERM
+int run_client(const char *socket_path);  // Interactive client reading commands from stdin
+
+#endif // SERVER_H
@@ -0,0 +1,83 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+// File name: Stats.h
+// Description: Operation counters and latency histograms of the pseudo-FAT filesystem.
+//              Everything below compiles to nothing unless FS_STATS is defined.
+
+#define STATS_HISTOGRAM_BUCKETS 24  // log2 buckets of microseconds, the last one is open ended
+#define STATS_MAX_COMMANDS 48       // Number of command table entries tracked
+
+// Event counters
+typedef enum StatCounter {
+    STAT_CLUSTERS_ALLOCATED,  // Clusters handed out by allocate_cluster()
+    STAT_CLUSTERS_FREED,      // Clusters returned by free_cluster()
+    STAT_ALLOCATOR_SCANNED,   // FAT entries inspected while searching for a free cluster
+    STAT_FAT_LINKS,           // FAT links followed in cluster chains
+    STAT_BYTES_READ,          // Bytes read by read_cluster_data()
+    STAT_BYTES_WRITTEN,       // Bytes written by write_cluster_data()
+    STAT_READ_BUFFERS,        // Buffers malloc'ed by read_cluster_data()
+    STAT_PATH_LOOKUPS,        // Path resolutions (find_item_by_path() and the pf_* calls)
+    STAT_PATH_COMPONENTS,     // Path components resolved by path lookups
+    STAT_CACHE_HITS,          // Cluster cache hits (cached backends only)
+    STAT_CACHE_MISSES,        // Cluster cache misses (cached backends only)
+    STAT_CACHE_READAHEAD,     // Clusters read ahead of a sequential miss
+    STAT_CACHE_WRITEBACKS,    // Dirty clusters written back to the image
+    STAT_CHECKSUMS_VERIFIED,  // Clusters verified against their CRC32C
+    STAT_CHECKSUM_MISMATCHES, // Verifications that failed
+    STAT_FAT_MIRRORED,        // FAT entries copied to fat_table2 by sync_fat_mirror()
+    STAT_RECLAIM_DEFERRED,    // Removed subtrees handed to the background reclaimer
+    STAT_IO_REQUESTS,         // Host reads and writes queued to the I/O threads
+    STAT_VERSIONS_PUBLISHED,  // Directory versions built for readers without the lock
+    STAT_LOCK_FREE_READS,     // Server commands run on the published tree without the lock
+    STAT_SAVE_COUNT,          // pf_save() calls
+    STAT_SAVE_NS,             // Time spent in pf_save()
+    STAT_LOAD_COUNT,          // pf_load() calls
+    STAT_LOAD_NS,             // Time spent in pf_load()
+    STAT_COUNTER_COUNT
+} StatCounter;
+
+// Latency histogram of one command
+typedef struct CommandStats {
+    const char *name;
+    uint64_t count;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t buckets[STATS_HISTOGRAM_BUCKETS];
+} CommandStats;
+
+typedef struct FsStats {
+    uint64_t counters[STAT_COUNTER_COUNT];
+    CommandStats commands[STATS_MAX_COMMANDS];
+} FsStats;
+
+#ifdef FS_STATS
+
+extern FsStats fs_stats;
+
+// Relaxed atomics: server sessions update the counters from several threads
+#define STAT_INC(counter)        __atomic_fetch_add(&fs_stats.counters[counter], 1, __ATOMIC_RELAXED)
+#define STAT_ADD(counter, n)     __atomic_fetch_add(&fs_stats.counters[counter], (uint64_t)(n), __ATOMIC_RELAXED)
+#define STAT_TIMER(var)          uint64_t var = stats_now_ns()
+#define STAT_ELAPSED(counter, var) STAT_ADD(counter, stats_now_ns() - (var))
+
+uint64_t stats_now_ns();
+void stats_record_command(int index, const char *name, uint64_t elapsed_ns);
+
+#else
+
+#define STAT_INC(counter)        ((void)0)
+#define STAT_ADD(counter, n)     ((void)0)
+#define STAT_TIMER(var)          ((void)0)
+#define STAT_ELAPSED(counter, var) ((void)0)
+
+#endif // FS_STATS
+
+void stats_print(FILE *out);             // Print all counters and histograms
+void stats_reset();                      // Zero all counters and histograms
+int stats_dump_file(const char *path);   // Write the report to a file, returns 0 on success
+
+#endif // STATS_H
@@ -0,0 +1,28 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// File name: Trace.h
+// Description: Optional event tracing of command execution. Spans are kept in a compact ring
+//              buffer and converted to Chrome trace-event JSON (chrome://tracing, Perfetto) when
+//              tracing stops. When tracing is off every macro costs a single branch.
+
+#define TRACE_DEFAULT_CAPACITY (1 << 18) // Spans kept in the ring buffer, older ones are overwritten
+
+extern bool trace_enabled; // True while spans are being recorded
+
+// Opens a span, the variable holds its start time (0 when tracing is off)
+#define TRACE_BEGIN(var) uint64_t var = trace_enabled ? trace_now_ns() : 0
+// Closes a span opened by TRACE_BEGIN
+#define TRACE_END(var, category, name) \
+    do { if (var) trace_span((category), (name), (var)); } while (0)
+
+uint64_t trace_now_ns();
+void trace_span(const char *category, const char *name, uint64_t start_ns); // Record a finished span
+
+int trace_start(int32_t capacity);       // Start recording, returns 0 on success
+int trace_stop(const char *path);        // Stop recording and write the JSON trace, returns 0 on success
+
+#endif // TRACE_H
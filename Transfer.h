@@ -0,0 +1,29 @@
+#ifndef TRANSFER_H
+#define TRANSFER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// File name: Transfer.h
+// Description: Pipelined copying between the filesystem and a host file (incp and outcp). The
+//              calling thread works on the filesystem while the I/O queue reads or writes the
+//              other end through a ring of large buffers, every buffer in flight at once.
+
+#define TRANSFER_BUFFER_SIZE (1024 * 1024) // Bytes per ring buffer, rounded down to whole clusters
+#define TRANSFER_SLOTS 8                   // Buffers in the ring
+
+typedef struct Transfer Transfer;
+
+// Both take ownership of nothing, fd stays open. Buffers hold whole multiples of unit (the
+// cluster size) except the last one, so every request is cluster aligned. Transfers that fit
+// one buffer, host files that are not regular files and a NULL io run in the calling thread.
+Transfer *transfer_to_host(struct IoQueue *io, int fd, size_t unit, uint64_t size);   // The caller fills, the queue writes
+Transfer *transfer_from_host(struct IoQueue *io, int fd, size_t unit, uint64_t size); // The queue reads, the caller drains
+
+char *transfer_fill(Transfer *transfer, size_t *capacity);        // Next empty buffer, NULL after a write error
+bool transfer_push(Transfer *transfer, size_t length);            // Queue the filled buffer for writing
+const char *transfer_pull(Transfer *transfer, size_t *length);    // Next buffer read, NULL at the end or on error
+bool transfer_finish(Transfer *transfer);                         // Flush or cancel, join and free; false on host I/O error
+
+#endif // TRANSFER_H
@@ -0,0 +1,36 @@
+#ifndef TRAVERSE_H
+#define TRAVERSE_H
+
+#include "FatTable.h"
+#include "PseudoFat.h"
+
+// File name: Traverse.h
+// Description: Iterative depth-first walk over a directory tree. The pending directories live
+//              in a heap-allocated stack instead of C stack frames, so trees of any depth can be
+//              loaded, freed, copied and checked. The next siblings are prefetched while the
+//              current item is visited.
+
+#define TREE_PREFETCH_DISTANCE 2         // Siblings ahead of the current item that are prefetched
+
+typedef enum TreeAction {
+    TREE_CONTINUE,                       // Go on, descend into a directory
+    TREE_SKIP,                           // Do not descend into this directory (pre only)
+    TREE_STOP,                           // Abort the walk, tree_walk() returns PF_END
+} TreeAction;
+
+// What a callback gets for one item
+typedef struct TreeVisit {
+    DirectoryItem *item;
+    int depth;                           // 0 for the root of the walk
+    void *parent_data;                   // data of the parent directory, NULL for the root
+    void *data;                          // Set by pre for a directory, handed to its children and its post
+} TreeVisit;
+
+typedef TreeAction (*TreeCallback)(TreeVisit *visit, void *context);
+
+// Visits root and everything below it. pre runs before the children of a directory (and may
+// fill them in), post after them, so post may free the item. Either callback may be NULL.
+// Returns PF_OK, PF_END when a callback stopped the walk or PF_ERR_NO_MEMORY.
+PfResult tree_walk(DirectoryItem *root, TreeCallback pre, TreeCallback post, void *context);
+
+#endif // TRAVERSE_H
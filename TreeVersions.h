@@ -0,0 +1,39 @@
+#ifndef TREE_VERSIONS_H
+#define TREE_VERSIONS_H
+
+#include "FatTable.h"
+#include "PseudoFat.h"
+
+// File name: TreeVersions.h
+// Description: Published copy of the directory tree for commands that run without the lock
+//              (server mode). Every directory has an immutable version holding its entries and
+//              the versions of its subdirectories. A writer copies the changed directory and the
+//              directories above it, then swaps the published root in a single atomic store.
+//              Replaced versions are freed once every reader that could still see them has left.
+
+typedef struct TreeVersions TreeVersions;
+typedef struct DirectoryVersion DirectoryVersion;
+
+// Writer side, the caller holds fs->lock exclusively
+void versions_start(FileSystem *fs);                              // Publish the tree and keep publishing every change
+void versions_release(FileSystem *fs);                            // Free every version, no reader may be left
+void versions_rebuild(FileSystem *fs);                            // Publish the whole tree from scratch (format, load)
+void versions_unpublish(FileSystem *fs);                          // Readers take the lock until the next rebuild
+void versions_publish(FileSystem *fs, DirectoryItem *dir);        // dir changed, copy it and the path above it
+void versions_retire_subtree(FileSystem *fs, DirectoryItem *dir); // dir left the tree, after its parent was published
+
+// Frees what was replaced once the readers that may see it are gone. Needs no lock, writers
+// call it after they released fs->lock.
+void versions_reclaim(FileSystem *fs);
+
+// Reader side, no lock. The root stays valid until versions_leave(), NULL when nothing is
+// published (not formatted, or out of memory while publishing).
+const DirectoryVersion *versions_enter(FileSystem *fs, int *slot);
+void versions_leave(FileSystem *fs, int slot);
+
+// Path lookups in a published tree, relative paths start at the absolute path cwd
+PfResult versions_stat(const DirectoryVersion *root, const char *cwd, const char *path, PfStat *stat);
+PfResult versions_opendir(const DirectoryVersion *root, const char *cwd, const char *path, const DirectoryVersion **dir);
+PfResult versions_readdir(const DirectoryVersion *dir, int *index, PfStat *entry);
+
+#endif // TREE_VERSIONS_H
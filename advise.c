@@ -0,0 +1,105 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <dirent.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "FatTable.h"
+#include "PseudoFat.h"
+
+// File name: advise.c
+// Description: Cluster size advisor behind `format --advise`. Walks a host tree once and models,
+//              for every allowed cluster size, the slack and FAT space the tree would cost.
+
+#define ADVISE_PATH_SIZE 4096
+
+// Adds the clusters of one file or directory listing of used bytes to every estimate
+static void account(PfClusterAdvice *advice, int64_t used, bool is_file) {
+    for (int i = 0; i < PF_ADVICE_CANDIDATES; i++) {
+        PfClusterEstimate *estimate = &advice->estimates[i];
+        int64_t cluster_size = estimate->cluster_size;
+        int64_t clusters = used > 0 ? (used + cluster_size - 1) / cluster_size : 1;
+
+        estimate->clusters += clusters;
+        estimate->slack_bytes += clusters * cluster_size - used;
+        if (is_file) {
+            estimate->average_chain += (double)clusters;  // Sum for now, divided at the end
+            if (clusters > estimate->longest_chain) {
+                estimate->longest_chain = clusters;
+            }
+        }
+    }
+}
+
+static PfResult walk(FileSystem *fs, PfClusterAdvice *advice, char *path, size_t length) {
+    DIR *dir = opendir(path);
+    if (!dir) {
+        return PF_ERR_NOT_FOUND;
+    }
+
+    int64_t children = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+        size_t name_length = strlen(entry->d_name);
+        if (length + 1 + name_length >= ADVISE_PATH_SIZE || name_length >= MAX_ITEM_NAME_SIZE) continue;
+
+        path[length] = '/';
+        memcpy(path + length + 1, entry->d_name, name_length + 1);
+
+        struct stat st;
+        if (lstat(path, &st) != 0) {
+            // Vanished or unreadable, not part of the sample
+        } else if (S_ISDIR(st.st_mode)) {
+            children++;
+            walk(fs, advice, path, length + 1 + name_length);  // Unreadable subdirectories are skipped
+        } else if (S_ISREG(st.st_mode)) {
+            children++;
+            advice->files++;
+            advice->bytes += st.st_size;
+            if (fs->inline_limit > 0 && st.st_size <= fs->inline_limit && st.st_size <= INLINE_CAPACITY(entry->d_name)) {
+                advice->inline_files++;  // Lives in its directory record whatever the cluster size
+            } else {
+                account(advice, st.st_size, true);
+            }
+        }
+        path[length] = '\0';
+    }
+    closedir(dir);
+
+    advice->directories++;
+    account(advice, children * (int64_t)sizeof(DirectoryRecord), false);
+    return PF_OK;
+}
+
+// Models every cluster size from PF_CLUSTER_SIZE_MIN to PF_CLUSTER_SIZE_MAX for the files below
+// host_dir and picks the one with the least slack plus FAT space. The inline limit of fs applies.
+PfResult pf_advise_cluster_size(FileSystem *fs, const char *host_dir, PfClusterAdvice *advice) {
+    memset(advice, 0, sizeof(*advice));
+    for (int i = 0; i < PF_ADVICE_CANDIDATES; i++) {
+        advice->estimates[i].cluster_size = PF_CLUSTER_SIZE_MIN << i;
+    }
+
+    char path[ADVISE_PATH_SIZE];
+    if (strlen(host_dir) >= sizeof(path)) {
+        return PF_ERR_INVALID_PATH;
+    }
+    strcpy(path, host_dir);
+    PfResult result = walk(fs, advice, path, strlen(path));
+    if (result != PF_OK) {
+        return result;
+    }
+
+    int64_t chained_files = advice->files - advice->inline_files;
+    for (int i = 0; i < PF_ADVICE_CANDIDATES; i++) {
+        PfClusterEstimate *estimate = &advice->estimates[i];
+        estimate->fat_bytes = estimate->clusters * 2 * (int64_t)sizeof(int32_t);  // FAT1 and FAT2
+        estimate->average_chain = chained_files > 0 ? estimate->average_chain / chained_files : 0.0;
+
+        const PfClusterEstimate *best = &advice->estimates[advice->recommended];
+        if (estimate->slack_bytes + estimate->fat_bytes < best->slack_bytes + best->fat_bytes) {
+            advice->recommended = i;
+        }
+    }
+    return PF_OK;
+}
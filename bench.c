@@ -0,0 +1,385 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "FatTable.h"
+#include "PseudoFat.h"
+
+// File name: bench.c
+// Description: Benchmark harness for the core pseudo-FAT operations. Builds synthetic images,
+//              times each operation with warmup and repetitions and reports percentiles and MB/s.
+
+#define BENCH_MAX_SAMPLES 1024
+#define BENCH_MAX_PATHS 4096
+#define BENCH_PATH_SIZE 512
+
+// Shape of one synthetic image
+typedef struct BenchConfig {
+    const char *name;
+    int32_t disk_mb;
+    int32_t cluster_size;
+    int depth;               // Directory levels below root
+    int fanout;              // Subdirectories per directory
+    const int32_t *file_sizes; // File size distribution, sizes picked round-robin
+    int file_size_count;
+    double fill_ratio;       // Fraction of the disk filled with files
+} BenchConfig;
+
+// Aggregated timings of one operation on one configuration
+typedef struct BenchResult {
+    const char *config;
+    const char *operation;
+    int reps;
+    double min_us, mean_us, p50_us, p90_us, p99_us, max_us;
+    double mb_per_s;         // 0 when the operation moves no data
+} BenchResult;
+
+static const int32_t small_files[] = { 100, 700, 2000, 3900 };
+static const int32_t mixed_files[] = { 512, 4096, 32768, 262144 };
+static const int32_t large_files[] = { 1048576, 4194304 };
+
+static const BenchConfig full_configs[] = {
+    { "small-1k",  16,  1024,  3, 4,  small_files, 4, 0.5 },
+    { "small-4k",  16,  4096,  3, 4,  small_files, 4, 0.5 },
+    { "wide-4k",   64,  4096,  2, 32, small_files, 4, 0.3 },
+    { "mixed-4k",  64,  4096,  4, 4,  mixed_files, 4, 0.5 },
+    { "large-4k",  256, 4096,  3, 4,  large_files, 2, 0.5 },
+    { "large-16k", 256, 16384, 3, 4,  large_files, 2, 0.5 },
+};
+
+static const BenchConfig quick_configs[] = {
+    { "small-4k",  16,  4096,  3, 4,  small_files, 4, 0.5 },
+    { "mixed-4k",  64,  4096,  3, 4,  mixed_files, 4, 0.5 },
+};
+
+static FileSystem bench_fs;       // Image the operations run on
+static Session bench_session;     // Session at its root
+static const char *work_dir = "/tmp";
+static int warmup = 3;
+static int reps = 20;
+
+static char file_paths[BENCH_MAX_PATHS][BENCH_PATH_SIZE]; // Files created in the current image
+static int file_path_count = 0;
+
+static double now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile(const double *sorted, int count, double p) {
+    int index = (int)(p * (count - 1) + 0.5);
+    return sorted[index];
+}
+
+static void summarize(BenchResult *result, const char *config, const char *operation,
+                      double *samples, int count, double bytes_per_op) {
+    qsort(samples, count, sizeof(double), compare_doubles);
+
+    double sum = 0;
+    for (int i = 0; i < count; i++) sum += samples[i];
+
+    result->config = config;
+    result->operation = operation;
+    result->reps = count;
+    result->min_us = samples[0];
+    result->max_us = samples[count - 1];
+    result->mean_us = sum / count;
+    result->p50_us = percentile(samples, count, 0.50);
+    result->p90_us = percentile(samples, count, 0.90);
+    result->p99_us = percentile(samples, count, 0.99);
+    result->mb_per_s = bytes_per_op > 0 && result->p50_us > 0
+                     ? bytes_per_op / (1024.0 * 1024.0) / (result->p50_us / 1e6) : 0;
+}
+
+static void host_path(char *out, const char *name) {
+    snprintf(out, BENCH_PATH_SIZE, "%s/fs_bench_%s", work_dir, name);
+}
+
+// Creates a host file of the given size filled with a repeating pattern
+static void make_host_file(const char *path, int32_t size) {
+    FILE *file = fopen(path, "wb");
+    if (!file) {
+        perror("fs_bench: cannot create host file");
+        exit(EXIT_FAILURE);
+    }
+    char block[4096];
+    for (size_t i = 0; i < sizeof(block); i++) block[i] = (char)('a' + i % 26);
+    for (int32_t written = 0; written < size; written += sizeof(block)) {
+        int32_t chunk = size - written < (int32_t)sizeof(block) ? size - written : (int32_t)sizeof(block);
+        fwrite(block, 1, chunk, file);
+    }
+    fclose(file);
+}
+
+static void size_file_path(char *out, int32_t size) {
+    char name[64];
+    snprintf(name, sizeof(name), "src_%d.bin", size);
+    host_path(out, name);
+}
+
+// Recursively creates the directory tree and fills the leaves with files
+static void build_tree(const BenchConfig *config, const char *path, int level, int64_t *bytes_left, int *file_index) {
+    if (level == config->depth) {
+        for (int i = 0; i < MAX_CHILDREN / 2 && *bytes_left > 0 && file_path_count < BENCH_MAX_PATHS; i++) {
+            int32_t size = config->file_sizes[(*file_index)++ % config->file_size_count];
+            char source[BENCH_PATH_SIZE];
+            size_file_path(source, size);
+            snprintf(file_paths[file_path_count], BENCH_PATH_SIZE, "%s/f%d", path, i);
+            pf_import(&bench_fs, &bench_session, source, file_paths[file_path_count]);
+            file_path_count++;
+            // Every file occupies whole clusters, the fill ratio is about the disk, not the payload
+            *bytes_left -= (int64_t)(size + config->cluster_size - 1) / config->cluster_size * config->cluster_size;
+        }
+        return;
+    }
+
+    for (int i = 0; i < config->fanout && *bytes_left > 0; i++) {
+        char child[BENCH_PATH_SIZE];
+        snprintf(child, sizeof(child), "%s/L%d_%d", path, level, i);
+        pf_mkdir(&bench_fs, &bench_session, child);
+        build_tree(config, child, level + 1, bytes_left, file_index);
+    }
+}
+
+static void populate(const BenchConfig *config) {
+    PfResult result = pf_format(&bench_fs, config->disk_mb * 1024 * 1024, config->cluster_size);
+    if (result != PF_OK) {
+        fprintf(stderr, "fs_bench: cannot format %s: %s\n", config->name, pf_strerror(result));
+        exit(EXIT_FAILURE);
+    }
+    session_init(&bench_session, &bench_fs);
+    file_path_count = 0;
+
+    for (int i = 0; i < config->file_size_count; i++) {
+        char source[BENCH_PATH_SIZE];
+        size_file_path(source, config->file_sizes[i]);
+        make_host_file(source, config->file_sizes[i]);
+    }
+
+    int64_t bytes_left = (int64_t)(config->disk_mb * 1024.0 * 1024.0 * config->fill_ratio);
+    int file_index = 0;
+    build_tree(config, "", 0, &bytes_left, &file_index);
+}
+
+static void unlink_from_parent(DirectoryItem *item) {
+    DirectoryItem *parent = item->parent;
+    for (int i = 0; i < parent->child_count; i++) {
+        if (parent->children[i] == item) {
+            parent->children[i] = parent->children[--parent->child_count];
+            parent->children[parent->child_count] = NULL;
+            propagate_totals(parent, item->totals, -1);
+            return;
+        }
+    }
+}
+
+// Runs all operations on one configuration and appends the results
+static int bench_config(const BenchConfig *config, BenchResult *results, int result_count) {
+    static double samples[BENCH_MAX_SAMPLES];
+    int total = warmup + reps;
+    char path[BENCH_PATH_SIZE];
+    char host[BENCH_PATH_SIZE];
+
+    fprintf(stderr, "fs_bench: %s (%d MB, cluster %d B, depth %d, fan-out %d)\n",
+            config->name, config->disk_mb, config->cluster_size, config->depth, config->fanout);
+    populate(config);
+
+    // allocate_cluster() on a partly filled image, the cluster is returned outside the timed region
+    for (int i = 0; i < total; i++) {
+        double start = now_us();
+        int32_t cluster = allocate_cluster(&bench_fs);
+        double elapsed = now_us() - start;
+        if (cluster != FAT_UNUSED) free_cluster(&bench_fs, cluster);
+        if (i >= warmup) samples[i - warmup] = elapsed;
+    }
+    summarize(&results[result_count++], config->name, "allocate_cluster", samples, reps, 0);
+
+    // find_item_by_path() on the created files
+    for (int i = 0; i < total; i++) {
+        const char *target = file_paths[(i * 7919) % file_path_count];
+        double start = now_us();
+        find_item_by_path(&bench_fs, target, &bench_fs.root_directory);
+        double elapsed = now_us() - start;
+        if (i >= warmup) samples[i - warmup] = elapsed;
+    }
+    summarize(&results[result_count++], config->name, "find_item_by_path", samples, reps, 0);
+
+    // incp/outcp throughput with the largest file of the distribution
+    int32_t transfer_size = config->file_sizes[config->file_size_count - 1];
+    char source[BENCH_PATH_SIZE];
+    size_file_path(source, transfer_size);
+    host_path(host, "out.bin");
+
+    for (int i = 0; i < total; i++) {
+        snprintf(path, sizeof(path), "/bench_in_%d", i);
+        double start = now_us();
+        pf_import(&bench_fs, &bench_session, source, path);
+        double elapsed = now_us() - start;
+        pf_unlink(&bench_fs, &bench_session, path);
+        if (i >= warmup) samples[i - warmup] = elapsed;
+    }
+    summarize(&results[result_count++], config->name, "incp", samples, reps, transfer_size);
+
+    pf_import(&bench_fs, &bench_session, source, "/bench_out");
+    for (int i = 0; i < total; i++) {
+        double start = now_us();
+        pf_export(&bench_fs, &bench_session, "/bench_out", host);
+        double elapsed = now_us() - start;
+        if (i >= warmup) samples[i - warmup] = elapsed;
+    }
+    summarize(&results[result_count++], config->name, "outcp", samples, reps, transfer_size);
+
+    // cp of the same file
+    for (int i = 0; i < total; i++) {
+        snprintf(path, sizeof(path), "/bench_cp_%d", i);
+        double start = now_us();
+        pf_copy(&bench_fs, &bench_session, "/bench_out", path);
+        double elapsed = now_us() - start;
+        pf_unlink(&bench_fs, &bench_session, path);
+        if (i >= warmup) samples[i - warmup] = elapsed;
+    }
+    summarize(&results[result_count++], config->name, "cp", samples, reps, 0);
+    pf_unlink(&bench_fs, &bench_session, "/bench_out");
+
+    // rm_recursive() of a freshly built subtree
+    char small_source[BENCH_PATH_SIZE];
+    size_file_path(small_source, config->file_sizes[0]);
+    for (int i = 0; i < total; i++) {
+        pf_mkdir(&bench_fs, &bench_session, "/bench_rm");
+        for (int d = 0; d < 8; d++) {
+            snprintf(path, sizeof(path), "/bench_rm/d%d", d);
+            pf_mkdir(&bench_fs, &bench_session, path);
+            for (int f = 0; f < 8; f++) {
+                snprintf(path, sizeof(path), "/bench_rm/d%d/f%d", d, f);
+                pf_import(&bench_fs, &bench_session, small_source, path);
+            }
+        }
+        DirectoryItem *subtree = find_item_by_path(&bench_fs, "/bench_rm", &bench_fs.root_directory);
+        unlink_from_parent(subtree);
+
+        double start = now_us();
+        rm_recursive(&bench_fs, subtree);
+        double elapsed = now_us() - start;
+        if (i >= warmup) samples[i - warmup] = elapsed;
+    }
+    summarize(&results[result_count++], config->name, "rm_recursive", samples, reps, 0);
+
+    // pf_save() and pf_load() of the whole image
+    host_path(host, "image.bin");
+    int io_reps = reps < 5 ? reps : 5;
+    for (int i = 0; i < warmup + io_reps; i++) {
+        double start = now_us();
+        pf_save(&bench_fs, host);
+        double elapsed = now_us() - start;
+        if (i >= warmup) samples[i - warmup] = elapsed;
+    }
+    summarize(&results[result_count++], config->name, "save", samples, io_reps, bench_fs.description.disk_size);
+
+    for (int i = 0; i < warmup + io_reps; i++) {
+        double start = now_us();
+        pf_load(&bench_fs, host);
+        double elapsed = now_us() - start;
+        if (i >= warmup) samples[i - warmup] = elapsed;
+    }
+    summarize(&results[result_count++], config->name, "load", samples, io_reps, bench_fs.description.disk_size);
+
+    remove(host);
+    host_path(host, "out.bin");
+    remove(host);
+    for (int i = 0; i < config->file_size_count; i++) {
+        size_file_path(host, config->file_sizes[i]);
+        remove(host);
+    }
+
+    return result_count;
+}
+
+static void write_csv(FILE *out, const BenchResult *results, int count) {
+    fprintf(out, "config,operation,reps,min_us,mean_us,p50_us,p90_us,p99_us,max_us,mb_per_s\n");
+    for (int i = 0; i < count; i++) {
+        const BenchResult *r = &results[i];
+        fprintf(out, "%s,%s,%d,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%.2f\n", r->config, r->operation, r->reps,
+                r->min_us, r->mean_us, r->p50_us, r->p90_us, r->p99_us, r->max_us, r->mb_per_s);
+    }
+}
+
+static void write_json(FILE *out, const BenchResult *results, int count) {
+    fprintf(out, "[\n");
+    for (int i = 0; i < count; i++) {
+        const BenchResult *r = &results[i];
+        fprintf(out, "  {\"config\": \"%s\", \"operation\": \"%s\", \"reps\": %d, \"min_us\": %.3f, "
+                "\"mean_us\": %.3f, \"p50_us\": %.3f, \"p90_us\": %.3f, \"p99_us\": %.3f, "
+                "\"max_us\": %.3f, \"mb_per_s\": %.2f}%s\n", r->config, r->operation, r->reps,
+                r->min_us, r->mean_us, r->p50_us, r->p90_us, r->p99_us, r->max_us, r->mb_per_s,
+                i + 1 < count ? "," : "");
+    }
+    fprintf(out, "]\n");
+}
+
+int main(int argc, char *argv[]) {
+    const char *output_path = NULL;
+    bool json = false;
+    bool quick = false;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            output_path = argv[++i];
+        } else if (strcmp(argv[i], "--format") == 0 && i + 1 < argc) {
+            json = strcmp(argv[++i], "json") == 0;
+        } else if (strcmp(argv[i], "--reps") == 0 && i + 1 < argc) {
+            reps = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--warmup") == 0 && i + 1 < argc) {
+            warmup = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--workdir") == 0 && i + 1 < argc) {
+            work_dir = argv[++i];
+        } else if (strcmp(argv[i], "--quick") == 0) {
+            quick = true;
+        } else {
+            fprintf(stderr, "Usage: %s [-o file] [--format csv|json] [--reps N] [--warmup N] [--workdir dir] [--quick]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (reps < 1 || reps + warmup > BENCH_MAX_SAMPLES || warmup < 0) {
+        fprintf(stderr, "fs_bench: reps must be 1..%d including warmup.\n", BENCH_MAX_SAMPLES);
+        return 1;
+    }
+
+    FILE *out = stderr;
+    if (output_path && !(out = fopen(output_path, "w"))) {
+        perror("fs_bench: cannot open output file");
+        return 1;
+    }
+
+    fs_init(&bench_fs, NULL);
+    session_init(&bench_session, &bench_fs);
+
+    const BenchConfig *configs = quick ? quick_configs : full_configs;
+    int config_count = quick ? (int)(sizeof(quick_configs) / sizeof(quick_configs[0]))
+                             : (int)(sizeof(full_configs) / sizeof(full_configs[0]));
+
+    BenchResult *results = calloc(config_count * 8, sizeof(BenchResult));
+    int result_count = 0;
+    for (int i = 0; i < config_count; i++) {
+        result_count = bench_config(&configs[i], results, result_count);
+    }
+
+    if (json) {
+        write_json(out, results, result_count);
+    } else {
+        write_csv(out, results, result_count);
+    }
+
+    if (out != stderr) fclose(out);
+    fs_release(&bench_fs);
+    free(results);
+    return 0;
+}
@@ -0,0 +1,345 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "ClusterCache.h"
+#include "Stats.h"
+
+// File name: cache.c
+// Description: Buffer cache of a disk-backed image. A CLOCK hand sweeps the frames: a frame
+//              used since the last sweep gets a second chance, pinned frames are skipped and a
+//              dirty victim is written back together with the dirty frames of the clusters
+//              that follow it. A miss right behind the previous one reads ahead a window that
+//              doubles up to CACHE_IO_BYTES.
+
+typedef struct CacheFrame {
+    int32_t cluster;                     // -1 when the frame is empty
+    int32_t pins;
+    bool dirty;
+    bool referenced;                     // CLOCK bit
+} CacheFrame;
+
+struct ClusterCache {
+    int fd;
+    off_t data_offset;                   // Offset of cluster 0 in the file
+    size_t cluster_size;
+    int32_t cluster_count;
+    int32_t frame_count;
+    CacheFrame *frames;
+    char *memory;                        // frame_count clusters
+    int32_t *frame_of;                   // Per cluster: its frame, -1 if not cached
+    char *scratch;                       // io_clusters clusters for read ahead, write back and moves
+    int32_t *claimed;                    // Frames claimed for one read ahead
+    int32_t io_clusters;                 // Clusters per read ahead or coalesced write at most
+    int32_t hand;
+    int32_t next_expected;               // Cluster after the last one read, a miss there is sequential
+    int32_t window;                      // Clusters read ahead at the next sequential miss
+    pthread_mutex_t mutex;               // Protects everything above
+};
+
+static char *frame_data(ClusterCache *cache, int32_t frame) {
+    return cache->memory + (size_t)frame * cache->cluster_size;
+}
+
+static bool write_at(int fd, const char *buffer, size_t size, off_t offset) {
+    while (size > 0) {
+        ssize_t written = pwrite(fd, buffer, size, offset);
+        if (written <= 0) return false;
+        buffer += written;
+        size -= (size_t)written;
+        offset += written;
+    }
+    return true;
+}
+
+// Reads size bytes, what lies past the end of the file reads as zeros
+static bool read_at(int fd, char *buffer, size_t size, off_t offset) {
+    while (size > 0) {
+        ssize_t got = pread(fd, buffer, size, offset);
+        if (got < 0) return false;
+        if (got == 0) {
+            memset(buffer, 0, size);
+            return true;
+        }
+        buffer += got;
+        size -= (size_t)got;
+        offset += got;
+    }
+    return true;
+}
+
+static off_t cluster_offset(const ClusterCache *cache, int32_t cluster) {
+    return cache->data_offset + (off_t)cluster * (off_t)cache->cluster_size;
+}
+
+// Writes back a dirty frame and the dirty cached clusters right after it in one write
+static bool write_back(ClusterCache *cache, int32_t frame) {
+    int32_t first = cache->frames[frame].cluster;
+    int32_t count = 0;
+    while (count < cache->io_clusters && first + count < cache->cluster_count) {
+        int32_t f = cache->frame_of[first + count];
+        if (f < 0 || !cache->frames[f].dirty) break;
+        memcpy(cache->scratch + (size_t)count * cache->cluster_size, frame_data(cache, f), cache->cluster_size);
+        count++;
+    }
+    if (!write_at(cache->fd, cache->scratch, (size_t)count * cache->cluster_size, cluster_offset(cache, first))) {
+        return false;
+    }
+    for (int32_t i = 0; i < count; i++) {
+        cache->frames[cache->frame_of[first + i]].dirty = false;
+    }
+    STAT_ADD(STAT_CACHE_WRITEBACKS, count);
+    return true;
+}
+
+// Empties a frame for reuse and pins it, -1 if every frame is pinned (or cannot be written back)
+static int32_t claim_frame(ClusterCache *cache) {
+    for (int32_t steps = 0; steps < 2 * cache->frame_count + 1; steps++) {
+        int32_t f = cache->hand;
+        cache->hand = (f + 1) % cache->frame_count;
+        CacheFrame *frame = &cache->frames[f];
+        if (frame->pins > 0) continue;
+        if (frame->cluster >= 0 && frame->referenced) {
+            frame->referenced = false;  // Second chance
+            continue;
+        }
+        if (frame->dirty && !write_back(cache, f)) {
+            continue;  // Stays dirty, a later flush reports the error
+        }
+        if (frame->cluster >= 0) {
+            cache->frame_of[frame->cluster] = -1;
+        }
+        frame->cluster = -1;
+        frame->pins = 1;
+        return f;
+    }
+    return -1;
+}
+
+static void install(ClusterCache *cache, int32_t frame, int32_t cluster, bool referenced) {
+    CacheFrame *entry = &cache->frames[frame];
+    entry->cluster = cluster;
+    entry->dirty = false;
+    entry->referenced = referenced;
+    cache->frame_of[cluster] = frame;
+}
+
+ClusterCache *cache_open(int fd, off_t data_offset, int32_t cluster_size, int32_t cluster_count, size_t budget) {
+    ClusterCache *cache = calloc(1, sizeof(ClusterCache));
+    if (!cache) return NULL;
+
+    size_t frames = budget / (size_t)cluster_size;
+    if (frames < CACHE_MIN_FRAMES) frames = CACHE_MIN_FRAMES;
+    if (frames > (size_t)cluster_count) frames = (size_t)cluster_count;
+    if (frames < 1) frames = 1;
+    cache->frame_count = (int32_t)frames;
+
+    int32_t io_clusters = CACHE_IO_BYTES / cluster_size;
+    if (io_clusters > cache->frame_count / 4) io_clusters = cache->frame_count / 4;
+    cache->io_clusters = io_clusters > 0 ? io_clusters : 1;
+
+    cache->fd = fd;
+    cache->data_offset = data_offset;
+    cache->cluster_size = (size_t)cluster_size;
+    cache->cluster_count = cluster_count;
+    cache->frames = calloc(frames, sizeof(CacheFrame));
+    cache->memory = malloc(frames * (size_t)cluster_size);
+    cache->frame_of = malloc((size_t)cluster_count * sizeof(int32_t));
+    cache->scratch = malloc((size_t)cache->io_clusters * (size_t)cluster_size);
+    cache->claimed = malloc((size_t)cache->io_clusters * sizeof(int32_t));
+    if (!cache->frames || !cache->memory || !cache->frame_of || !cache->scratch || !cache->claimed) {
+        free(cache->frames);
+        free(cache->memory);
+        free(cache->frame_of);
+        free(cache->scratch);
+        free(cache->claimed);
+        free(cache);
+        return NULL;
+    }
+    for (size_t i = 0; i < frames; i++) {
+        cache->frames[i].cluster = -1;
+    }
+    for (int32_t i = 0; i < cluster_count; i++) {
+        cache->frame_of[i] = -1;
+    }
+    cache->next_expected = -1;
+    pthread_mutex_init(&cache->mutex, NULL);
+    return cache;
+}
+
+void cache_close(ClusterCache *cache) {
+    if (!cache) return;
+
+    close(cache->fd);
+    pthread_mutex_destroy(&cache->mutex);
+    free(cache->frames);
+    free(cache->memory);
+    free(cache->frame_of);
+    free(cache->scratch);
+    free(cache->claimed);
+    free(cache);
+}
+
+char *cache_pin(ClusterCache *cache, int32_t cluster, bool load) {
+    if (cluster < 0 || cluster >= cache->cluster_count) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&cache->mutex);
+    int32_t frame = cache->frame_of[cluster];
+    if (frame >= 0) {
+        STAT_INC(STAT_CACHE_HITS);
+        cache->frames[frame].pins++;
+        cache->frames[frame].referenced = true;
+        pthread_mutex_unlock(&cache->mutex);
+        return frame_data(cache, frame);
+    }
+
+    STAT_INC(STAT_CACHE_MISSES);
+    frame = claim_frame(cache);
+    if (frame < 0) {
+        pthread_mutex_unlock(&cache->mutex);
+        return NULL;
+    }
+
+    if (load) {
+        // A miss right behind the last read continues a scan, read ahead of it
+        if (cluster == cache->next_expected) {
+            int32_t window = cache->window ? cache->window * 2 : 1;
+            cache->window = window < cache->io_clusters - 1 ? window : cache->io_clusters - 1;
+        } else {
+            cache->window = 0;
+        }
+
+        int32_t ahead = 0;
+        while (ahead < cache->window && cluster + ahead + 1 < cache->cluster_count &&
+               cache->frame_of[cluster + ahead + 1] < 0) {
+            int32_t extra = claim_frame(cache);
+            if (extra < 0) break;
+            cache->claimed[ahead++] = extra;
+        }
+
+        bool read = ahead == 0
+            ? read_at(cache->fd, frame_data(cache, frame), cache->cluster_size, cluster_offset(cache, cluster))
+            : read_at(cache->fd, cache->scratch, (size_t)(ahead + 1) * cache->cluster_size, cluster_offset(cache, cluster));
+        if (!read) {
+            cache->frames[frame].pins = 0;
+            for (int32_t i = 0; i < ahead; i++) {
+                cache->frames[cache->claimed[i]].pins = 0;
+            }
+            pthread_mutex_unlock(&cache->mutex);
+            return NULL;
+        }
+        if (ahead > 0) {
+            memcpy(frame_data(cache, frame), cache->scratch, cache->cluster_size);
+            for (int32_t i = 0; i < ahead; i++) {
+                int32_t extra = cache->claimed[i];
+                memcpy(frame_data(cache, extra), cache->scratch + (size_t)(i + 1) * cache->cluster_size, cache->cluster_size);
+                install(cache, extra, cluster + i + 1, false);
+                cache->frames[extra].pins = 0;
+            }
+            STAT_ADD(STAT_CACHE_READAHEAD, ahead);
+        }
+        cache->next_expected = cluster + ahead + 1;
+    }
+
+    install(cache, frame, cluster, true);
+    pthread_mutex_unlock(&cache->mutex);
+    return frame_data(cache, frame);
+}
+
+void cache_unpin(ClusterCache *cache, int32_t cluster, bool dirty) {
+    pthread_mutex_lock(&cache->mutex);
+    int32_t frame = cluster >= 0 && cluster < cache->cluster_count ? cache->frame_of[cluster] : -1;
+    if (frame >= 0) {
+        cache->frames[frame].pins--;
+        cache->frames[frame].dirty |= dirty;
+    }
+    pthread_mutex_unlock(&cache->mutex);
+}
+
+static bool flush_locked(ClusterCache *cache) {
+    // In cluster order, so runs of dirty clusters go out as single writes
+    bool written = true;
+    for (int32_t cluster = 0; cluster < cache->cluster_count; cluster++) {
+        int32_t frame = cache->frame_of[cluster];
+        if (frame >= 0 && cache->frames[frame].dirty && !write_back(cache, frame)) {
+            written = false;
+        }
+    }
+    return written;
+}
+
+bool cache_flush(ClusterCache *cache) {
+    pthread_mutex_lock(&cache->mutex);
+    bool written = flush_locked(cache);
+    pthread_mutex_unlock(&cache->mutex);
+    return written;
+}
+
+bool cache_zero(ClusterCache *cache, int32_t cluster, int32_t count) {
+    pthread_mutex_lock(&cache->mutex);
+    for (int32_t i = cluster; i < cluster + count; i++) {
+        int32_t frame = cache->frame_of[i];
+        if (frame < 0) continue;
+        if (cache->frames[frame].pins > 0) {
+            memset(frame_data(cache, frame), 0, cache->cluster_size);
+            cache->frames[frame].dirty = false;
+            continue;
+        }
+        cache->frame_of[i] = -1;
+        cache->frames[frame].cluster = -1;
+        cache->frames[frame].dirty = false;
+    }
+
+    bool written = true;
+    memset(cache->scratch, 0, (size_t)cache->io_clusters * cache->cluster_size);
+    for (int32_t done = 0; done < count && written; ) {
+        int32_t run = count - done < cache->io_clusters ? count - done : cache->io_clusters;
+        written = write_at(cache->fd, cache->scratch, (size_t)run * cache->cluster_size, cluster_offset(cache, cluster + done));
+        done += run;
+    }
+    pthread_mutex_unlock(&cache->mutex);
+    return written;
+}
+
+bool cache_relocate(ClusterCache *cache, off_t data_offset, off_t data_size) {
+    pthread_mutex_lock(&cache->mutex);
+    bool moved = flush_locked(cache);
+    off_t old_offset = cache->data_offset;
+    size_t chunk = (size_t)cache->io_clusters * cache->cluster_size;
+
+    if (moved && data_offset > old_offset) {
+        // Growing header: the file gets longer, copy from the end so nothing is overwritten unread
+        moved = ftruncate(cache->fd, data_offset + data_size) == 0;
+        for (off_t end = data_size; moved && end > 0; ) {
+            off_t start = end > (off_t)chunk ? end - (off_t)chunk : 0;
+            size_t size = (size_t)(end - start);
+            moved = read_at(cache->fd, cache->scratch, size, old_offset + start) &&
+                    write_at(cache->fd, cache->scratch, size, data_offset + start);
+            end = start;
+        }
+    } else if (moved && data_offset < old_offset) {
+        for (off_t start = 0; moved && start < data_size; start += (off_t)chunk) {
+            size_t size = data_size - start < (off_t)chunk ? (size_t)(data_size - start) : chunk;
+            moved = read_at(cache->fd, cache->scratch, size, old_offset + start) &&
+                    write_at(cache->fd, cache->scratch, size, data_offset + start);
+        }
+        moved = moved && ftruncate(cache->fd, data_offset + data_size) == 0;
+    }
+    if (moved) {
+        cache->data_offset = data_offset;
+    }
+    pthread_mutex_unlock(&cache->mutex);
+    return moved;
+}
+
+off_t cache_data_offset(const ClusterCache *cache) {
+    return cache->data_offset;
+}
+
+int cache_fd(const ClusterCache *cache) {
+    return cache->fd;
+}
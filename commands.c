@@ -1,242 +1,893 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include "Crc32c.h"
 #include "FatTable.h"
+#include "PseudoFat.h"
+#include "Stats.h"
+#include "Trace.h"
 
-void handle_format_command(const char *filename, const char *size_str) {
-    int32_t size_in_mb;
-    if (sscanf(size_str, "%dMB", &size_in_mb) != 1 || size_in_mb <= 0) {
-        printf("INVALID SIZE FORMAT\n");
+#define MAX_COMMAND_ARGS 8   // Maximum number of arguments after the command name
+#define COMMAND_SLOTS 64     // Size of the perfect hash table, power of two
+#define SCRUB_DEFAULT_RATE 8.0 // MB/s of `scrub start` without a rate
+
+typedef void (*CommandHandler)(FileSystem *fs, Session *session, int argc, char **argv);
+
+// One entry of the command table
+typedef struct Command {
+    const char *name;       // Command name as typed by the user
+    int min_args;           // Minimum number of arguments
+    int max_args;           // Maximum number of arguments
+    bool needs_fs;          // The command requires a formatted filesystem
+    bool mutating;          // The command modifies the filesystem (exclusive in server mode)
+    CommandHandler handler; // Function executing the command
+    const char *usage;      // Message printed on a wrong argument count (NULL = "INVALID COMMAND")
+} Command;
+
+// Prints the canonical message of a failed library call and marks the command as failed
+static void report(Session *session, PfResult result) {
+    fprintf(SESSION_OUT(session), "%s\n", pf_strerror(result));
+    session->process_error = true;
+}
+
+// Prints the modeled cost of every cluster size for a host tree and the recommended one
+static void print_cluster_advice(FileSystem *fs, Session *session, const char *host_dir) {
+    PfClusterAdvice advice;
+    PfResult result = pf_advise_cluster_size(fs, host_dir, &advice);
+    if (result != PF_OK) {
+        report(session, result);
         return;
     }
 
-    int32_t disk_size = size_in_mb * 1024 * 1024;
-    int32_t cluster_size = 4096; 
+    FILE *out = SESSION_OUT(session);
+    fprintf(out, "Sampled %s: %lld files (%lld inline), %lld directories, %.1f KB\n", host_dir,
+            (long long)advice.files, (long long)advice.inline_files, (long long)advice.directories, advice.bytes / 1024.0);
+    fprintf(out, "%10s %12s %12s %12s %12s %10s %10s\n",
+            "Cluster", "Clusters", "Slack KB", "FAT KB", "Overhead KB", "Avg chain", "Max chain");
+    for (int i = 0; i < PF_ADVICE_CANDIDATES; i++) {
+        const PfClusterEstimate *estimate = &advice.estimates[i];
+        fprintf(out, "%10d %12lld %12.1f %12.1f %12.1f %10.2f %10lld%s\n", estimate->cluster_size,
+                (long long)estimate->clusters, estimate->slack_bytes / 1024.0, estimate->fat_bytes / 1024.0,
+                (estimate->slack_bytes + estimate->fat_bytes) / 1024.0, estimate->average_chain,
+                (long long)estimate->longest_chain, i == advice.recommended ? "  <" : "");
+    }
 
-    format_filesystem(filename, disk_size, cluster_size);
+    const PfClusterEstimate *best = &advice.estimates[advice.recommended];
+    fprintf(out, "Recommended: cluster=%d (projected FAT %.1f KB for %lld clusters, chains %.2f on average, %lld at most)\n",
+            best->cluster_size, best->fat_bytes / 1024.0, (long long)best->clusters,
+            best->average_chain, (long long)best->longest_chain);
 }
 
-void process_command(const char *filename, char *command) {
-    if (strncmp(command, "format", 6) == 0) {
-        char size_str[20];
-        if (sscanf(command + 7, "%s", size_str) == 1) {
-            handle_format_command(filename, size_str);
-        } else {
-            printf("INVALID COMMAND\n");
-        }
-    } else if (strncmp(command, "ls", 2) == 0) {
-        if (!fat_table1) {
-            printf("Filesystem not formatted. Use 'format' first.\n");
+void handle_format_command(FileSystem *fs, Session *session, const char *size_str, const char *cluster_str) {
+    if (strcmp(size_str, "--advise") == 0) {
+        if (!cluster_str) {
+            fprintf(SESSION_OUT(session), "Invalid command syntax. Usage: format <size>MB [cluster=<bytes>] | format --advise <hostdir>\n");
+            session->process_error = true;
             return;
         }
+        print_cluster_advice(fs, session, cluster_str);
+        return;
+    }
 
-        char dir_name[MAX_ITEM_NAME_SIZE];
-        if (sscanf(command + 3, "%s", dir_name) == 1) {
-            ls(dir_name); 
-        } else {
-            ls(NULL); 
-        }
-    } else if (strncmp(command, "mkdir", 5) == 0) {
-        if (!fat_table1) {
-            printf("Filesystem not formatted. Use 'format' first.\n");
-            return;
-        }
-        char dir_name[MAX_ITEM_NAME_SIZE];
-        if (sscanf(command + 6, "%s", dir_name) == 1) {
-            mkdir(dir_name);
-        } else {
-            printf("INVALID COMMAND\n");
-        }
-    } else if (strncmp(command, "cd", 2) == 0) {
-        if (!fat_table1) {
-            printf("Filesystem not formatted. Use 'format' first.\n");
-            return;
-        }
-        char path[MAX_ITEM_NAME_SIZE];
-        if (sscanf(command + 3, "%s", path) == 1) {
-            cd(path);
-        } else {
-            printf("INVALID COMMAND\n");
-        }
-    } else if (strcmp(command, "pwd") == 0) {
-        if (!fat_table1) {
-            printf("Filesystem not formatted. Use 'format' first.\n");
-            return;
-        }
-        pwd();
-    } else if (strncmp(command, "rmdir", 5) == 0) {
-        if (!fat_table1) {
-            printf("Filesystem not formatted. Use 'format' first.\n");
-            return;
-        }
-        char dir_name[MAX_ITEM_NAME_SIZE];
-        if (sscanf(command + 6, "%s", dir_name) == 1) {
-            rmdir(dir_name);
-        } else {
-            printf("INVALID COMMAND\n");
-        }
-    } else if (strncmp(command, "rm", 2) == 0) {
-        if (!fat_table1) {
-            printf("Filesystem not formatted. Use 'format' first.\n");
+    int32_t size_in_mb;
+    if (sscanf(size_str, "%dMB", &size_in_mb) != 1 || size_in_mb <= 0) {
+        fprintf(SESSION_OUT(session), "INVALID SIZE FORMAT\n");
+        session->process_error = true;
+        return;
+    }
+
+    int32_t disk_size = size_in_mb * 1024 * 1024;
+    int32_t cluster_size = PF_CLUSTER_SIZE_DEFAULT;
+    if (cluster_str) {
+        char *end;
+        long value = strncmp(cluster_str, "cluster=", 8) == 0 ? strtol(cluster_str + 8, &end, 10) : 0;
+        if (value < PF_CLUSTER_SIZE_MIN || value > PF_CLUSTER_SIZE_MAX || (value & (value - 1)) != 0 || *end != '\0') {
+            fprintf(SESSION_OUT(session), "INVALID CLUSTER SIZE (power of two from %d B to %d B)\n",
+                    PF_CLUSTER_SIZE_MIN, PF_CLUSTER_SIZE_MAX);
+            session->process_error = true;
             return;
         }
-        char dir_name[MAX_ITEM_NAME_SIZE];
-        if (sscanf(command + 3, "%s", dir_name) == 1) {
-            rm(dir_name);
+        cluster_size = (int32_t)value;
+    }
+
+    PfResult result = pf_format(fs, disk_size, cluster_size);
+    if (result != PF_OK) {
+        report(session, result);
+        return;
+    }
+
+    // Set the current directory to root
+    session->current_directory = &fs->root_directory;
+
+    fprintf(SESSION_OUT(session), "Filesystem initialized:\n");
+    fprintf(SESSION_OUT(session), "  Disk size: %d MB\n", disk_size / (1024 * 1024));
+    fprintf(SESSION_OUT(session), "  Cluster size: %d B\n", cluster_size);
+    fprintf(SESSION_OUT(session), "  Cluster count: %d\n", fs->description.cluster_count);
+
+    if (!fs->defer_save) {
+        save_system_state(fs, session, fs->image_path); // Save the initialized state
+    }
+    fprintf(SESSION_OUT(session), "FORMAT COMPLETE\n");
+}
+
+static void cmd_format(FileSystem *fs, Session *session, int argc, char **argv) {
+    handle_format_command(fs, session, argv[0], argc > 1 ? argv[1] : NULL);
+}
+
+static void cmd_ls(FileSystem *fs, Session *session, int argc, char **argv) {
+    const char *path = argc > 0 ? argv[0] : ".";
+    PfStat directory;
+    PfDir dir;
+    PfResult result = pf_stat(fs, session, path, &directory);
+    if (result == PF_OK) {
+        result = pf_opendir(fs, session, path, &dir);
+    }
+    if (result != PF_OK) {
+        fprintf(SESSION_OUT(session), "Error: Directory '%s' not found.\n", path);
+        session->process_error = true;
+        return;
+    }
+
+    fprintf(SESSION_OUT(session), "Contents of directory '%s':\n", directory.name);
+    fprintf(SESSION_OUT(session), "%-13s %-5s %-10s\n", "Name", "Type", "Start Cluster");
+    fprintf(SESSION_OUT(session), "---------------------------------------------------\n");
+
+    PfStat entry;
+    int count = 0;
+    while (pf_readdir(&dir, &entry) == PF_OK) {
+        if (entry.is_inline) {
+            fprintf(SESSION_OUT(session), "%-13s %-5s %-10s\n", entry.name, "File", "inline");
         } else {
-            printf("INVALID COMMAND\n");
-        }
-    } else if (strncmp(command, "cp", 2) == 0) {
-        if (!fat_table1) {
-            printf("Filesystem not formatted. Use 'format' first.\n");
-            return;
+            fprintf(SESSION_OUT(session), "%-13s %-5s %-10d\n", entry.name, entry.is_file ? "File" : "Dir", entry.start_cluster);
         }
+        count++;
+    }
+    if (count == 0) {
+        fprintf(SESSION_OUT(session), "Directory is empty.\n");
+    }
+}
 
-        
-        char src_path[MAX_ITEM_NAME_SIZE];
-        char dest_path[MAX_ITEM_NAME_SIZE];
-        int args_parsed = sscanf(command + 3, "%s %s", src_path, dest_path);
+static void cmd_mkdir(FileSystem *fs, Session *session, int argc, char **argv) {
+    (void)argc;
+    PfResult result = pf_mkdir(fs, session, argv[0]);
+    if (result != PF_OK) {
+        report(session, result);
+        return;
+    }
+    fprintf(SESSION_OUT(session), "Directory '%s' created successfully.\n", argv[0]);
+}
 
-        if (args_parsed != 2) {
-            printf("Invalid command syntax. Usage: cp <source> <destination>\n");
-            return;
-        }
+static void cmd_cd(FileSystem *fs, Session *session, int argc, char **argv) {
+    (void)argc;
+    PfResult result = pf_chdir(fs, session, argv[0]);
+    if (result != PF_OK) {
+        report(session, result == PF_ERR_NOT_FOUND ? PF_ERR_PATH_NOT_FOUND : result);
+        return;
+    }
+    fprintf(SESSION_OUT(session), "OK\n");
+}
 
-        
-        cp(src_path, dest_path);
-    } else if (strncmp(command, "mv", 2) == 0) {
-        if (!fat_table1) {
-            printf("Filesystem not formatted. Use 'format' first.\n");
+static void cmd_pwd(FileSystem *fs, Session *session, int argc, char **argv) {
+    (void)argc; (void)argv;
+    char path[4096];
+    PfResult result = pf_getcwd(fs, session, path, sizeof(path));
+    if (result != PF_OK) {
+        report(session, result);
+        return;
+    }
+    fprintf(SESSION_OUT(session), "%s\n", path);
+}
+
+static void cmd_rmdir(FileSystem *fs, Session *session, int argc, char **argv) {
+    (void)argc;
+    PfResult result = pf_rmdir(fs, session, argv[0]);
+    if (result != PF_OK) {
+        report(session, result);
+        return;
+    }
+    fprintf(SESSION_OUT(session), "OK\n");
+}
+
+static void cmd_rm(FileSystem *fs, Session *session, int argc, char **argv) {
+    bool recursive = argc >= 2 && strcmp(argv[0], "-r") == 0;
+    bool background = argc == 3 && strcmp(argv[1], "--background") == 0;
+    if (argc > 1 && (!recursive || (argc == 3 && !background))) {
+        fprintf(SESSION_OUT(session), "Invalid command syntax. Usage: rm <file> | rm -r [--background] <path>\n");
+        session->process_error = true;
+        return;
+    }
+
+    const char *path = argv[argc - 1];
+    PfResult result = recursive ? pf_remove_tree(fs, session, path, background) : pf_unlink(fs, session, path);
+    if (result != PF_OK) {
+        report(session, result);
+        return;
+    }
+    if (recursive) {
+        fprintf(SESSION_OUT(session), "'%s' removed successfully.\n", path);
+    } else {
+        fprintf(SESSION_OUT(session), "File '%s' removed successfully.\n", path);
+    }
+}
+
+static void cmd_cp(FileSystem *fs, Session *session, int argc, char **argv) {
+    (void)argc;
+    PfResult result = pf_copy(fs, session, argv[0], argv[1]);
+    if (result != PF_OK) {
+        report(session, result);
+        return;
+    }
+    fprintf(SESSION_OUT(session), "Successfully created a copy of '%s' at '%s'.\n", argv[0], argv[1]);
+}
+
+static void cmd_mv(FileSystem *fs, Session *session, int argc, char **argv) {
+    (void)argc;
+    PfStat dest;
+    bool into_directory = pf_stat(fs, session, argv[1], &dest) == PF_OK && !dest.is_file;
+
+    PfResult result = pf_move(fs, session, argv[0], argv[1]);
+    if (result != PF_OK) {
+        report(session, result);
+        return;
+    }
+    fprintf(SESSION_OUT(session), "Successfully %s '%s' to '%s'.\n", into_directory ? "moved" : "renamed", argv[0], argv[1]);
+}
+
+static void cmd_info(FileSystem *fs, Session *session, int argc, char **argv) {
+    (void)argc;
+    PfStat item;
+    PfResult result = pf_stat(fs, session, argv[0], &item);
+    if (result != PF_OK) {
+        report(session, result);
+        return;
+    }
+
+    fprintf(SESSION_OUT(session), "Size: %dB\n", item.size);
+    fprintf(SESSION_OUT(session), "%s ", item.name);
+    if (item.is_inline) {
+        fprintf(SESSION_OUT(session), "inline\n");
+        return;
+    }
+    if (item.cluster_count < 0) {
+        fprintf(SESSION_OUT(session), "INVALID START CLUSTER\n");
+        session->process_error = true;
+        return;
+    }
+
+    int32_t *clusters = malloc((item.cluster_count + 1) * sizeof(int32_t));
+    int32_t count = 0;
+    if (!clusters) {
+        report(session, PF_ERR_NO_MEMORY);
+        return;
+    }
+    pf_chain(fs, session, argv[0], clusters, item.cluster_count, &count);
+    for (int32_t i = 0; i < count; i++) {
+        fprintf(SESSION_OUT(session), i > 0 ? ",%d" : "%d", clusters[i]);
+    }
+    fprintf(SESSION_OUT(session), "\n");
+    free(clusters);
+}
+
+static void print_check_entry(const PfCheckEntry *entry, void *context) {
+    FILE *out = context;
+    const char *kind = entry->is_file ? "File" : "Directory";
+
+    switch (entry->status) {
+        case PF_CHECK_INTACT:
+            fprintf(out, "%s '%s' is intact.\n", kind, entry->name);
+            break;
+        case PF_CHECK_BAD_CLUSTER:
+            fprintf(out, "Error: %s '%s' has an invalid %s (%d).\n", kind, entry->name,
+                    entry->is_file ? "cluster" : "start cluster", entry->cluster);
+            break;
+        case PF_CHECK_BAD_SIZE:
+            fprintf(out, "Error: File '%s' has an incorrect size. Actual: %d, Expected: %d.\n",
+                    entry->name, entry->size, entry->expected_size);
+            break;
+        case PF_CHECK_BAD_CHECKSUM:
+            fprintf(out, "Error: %s '%s' has a checksum mismatch in cluster %d.\n", kind, entry->name, entry->cluster);
+            break;
+    }
+}
+
+static void cmd_check(FileSystem *fs, Session *session, int argc, char **argv) {
+    (void)argc; (void)argv;
+    int problems = 0;
+    PfResult result = pf_check(fs, session, print_check_entry, SESSION_OUT(session), &problems);
+    if (result == PF_ERR_CORRUPTED) {
+        fprintf(SESSION_OUT(session), "Filesystem check completed, %d problem%s found.\n", problems, problems == 1 ? "" : "s");
+        session->process_error = true;
+        return;
+    }
+    if (result != PF_OK) {
+        report(session, result);
+        return;
+    }
+    fprintf(SESSION_OUT(session), "Filesystem check completed.\n");
+}
+
+static void print_found(const char *path, bool is_file, void *context) {
+    fprintf((FILE *)context, "%s%s\n", path, is_file ? "" : "/");
+}
+
+static void cmd_find(FileSystem *fs, Session *session, int argc, char **argv) {
+    (void)argc;
+    PfResult result = pf_find(fs, session, argv[0], argv[1], print_found, SESSION_OUT(session));
+    if (result != PF_OK) {
+        report(session, result);
+    }
+}
+
+static void print_grep_match(const char *path, int64_t offset, void *context) {
+    fprintf((FILE *)context, "%s:%lld\n", path, (long long)offset);
+}
+
+static void cmd_grep(FileSystem *fs, Session *session, int argc, char **argv) {
+    bool recursive = argc == 3 && strcmp(argv[0], "-r") == 0;
+    if (argc == 3 && !recursive) {
+        fprintf(SESSION_OUT(session), "Invalid command syntax. Usage: grep [-r] <pattern> <path>\n");
+        session->process_error = true;
+        return;
+    }
+
+    PfResult result = pf_grep(fs, session, argv[argc - 2], argv[argc - 1], recursive, print_grep_match, SESSION_OUT(session));
+    if (result != PF_OK) {
+        report(session, result);
+    }
+}
+
+static void print_du_entry(const PfDuEntry *entry, void *context) {
+    fprintf((FILE *)context, "%12lld B %8lld files %8lld clusters  %s\n", (long long)entry->bytes,
+            (long long)entry->files, (long long)entry->clusters, entry->path);
+}
+
+static void cmd_du(FileSystem *fs, Session *session, int argc, char **argv) {
+    int max_depth = -1;
+    const char *path = ".";
+    if (argc > 0 && strcmp(argv[0], "-d") == 0) {
+        char *end = "";
+        long depth = argc > 1 ? strtol(argv[1], &end, 10) : -1;
+        if (depth < 0 || *end != '\0') {
+            fprintf(SESSION_OUT(session), "Invalid command syntax. Usage: du [-d depth] [path]\n");
+            session->process_error = true;
             return;
         }
+        max_depth = (int)depth;
+        argc -= 2;
+        argv += 2;
+    }
+    if (argc > 1) {
+        fprintf(SESSION_OUT(session), "Invalid command syntax. Usage: du [-d depth] [path]\n");
+        session->process_error = true;
+        return;
+    }
+    if (argc == 1) {
+        path = argv[0];
+    }
 
-        
-        char src_path[MAX_ITEM_NAME_SIZE];
-        char dest_path[MAX_ITEM_NAME_SIZE];
-        int args_parsed = sscanf(command + 3, "%s %s", src_path, dest_path);
+    PfResult result = pf_du(fs, session, path, max_depth, print_du_entry, SESSION_OUT(session));
+    if (result != PF_OK) {
+        report(session, result);
+    }
+}
 
-        if (args_parsed != 2) {
-            printf("Invalid command syntax. Usage: cp <source> <destination>\n");
+static void cmd_trim(FileSystem *fs, Session *session, int argc, char **argv) {
+    (void)argc; (void)argv;
+    int32_t trimmed;
+    PfResult result = pf_trim(fs, &trimmed);
+    if (result != PF_OK) {
+        report(session, result);
+        return;
+    }
+    fprintf(SESSION_OUT(session), "Trimmed %d clusters (%lld B).\n", trimmed, (long long)trimmed * fs->description.cluster_size);
+}
+
+static void cmd_checksums(FileSystem *fs, Session *session, int argc, char **argv) {
+    if (argc == 1 && strcmp(argv[0], "on") != 0 && strcmp(argv[0], "off") != 0) {
+        fprintf(SESSION_OUT(session), "Invalid command syntax. Usage: checksums [on | off]\n");
+        session->process_error = true;
+        return;
+    }
+
+    PfResult result = argc == 1 ? pf_set_checksums(fs, strcmp(argv[0], "on") == 0) : PF_OK;
+    bool enabled;
+    uint64_t mismatches;
+    if (result == PF_OK) {
+        result = pf_checksum_status(fs, &enabled, &mismatches);
+    }
+    if (result != PF_OK) {
+        report(session, result);
+        return;
+    }
+
+    if (enabled) {
+        fprintf(SESSION_OUT(session), "Checksums: on (CRC32C, %s), mismatches: %llu\n",
+                crc32c_implementation(), (unsigned long long)mismatches);
+    } else {
+        fprintf(SESSION_OUT(session), "Checksums: off\n");
+    }
+}
+
+static void cmd_inline(FileSystem *fs, Session *session, int argc, char **argv) {
+    PfResult result = PF_OK;
+    if (argc == 1) {
+        char *end;
+        long limit = strcmp(argv[0], "off") == 0 ? 0 : strtol(argv[0], &end, 10);
+        if (strcmp(argv[0], "off") != 0 && (*end != '\0' || end == argv[0])) {
+            fprintf(SESSION_OUT(session), "Invalid command syntax. Usage: inline [<bytes> | off]\n");
+            session->process_error = true;
             return;
         }
+        result = limit > INT32_MAX ? PF_ERR_INVALID_ARGUMENT : pf_set_inline_limit(fs, (int32_t)limit);
+    }
+    if (result != PF_OK) {
+        report(session, result);
+        return;
+    }
 
-        
-        mv(src_path, dest_path);
-    } else if (strncmp(command, "info", 4) == 0) {
-        if (!fat_table1) {
-            printf("Filesystem not formatted. Use 'format' first.\n");
-            return;
+    if (fs->inline_limit > 0) {
+        fprintf(SESSION_OUT(session), "Inline files: up to %d B\n", fs->inline_limit);
+    } else {
+        fprintf(SESSION_OUT(session), "Inline files: off\n");
+    }
+}
+
+static void print_scrub_status(Session *session, const PfScrubStatus *status) {
+    if (status->running) {
+        fprintf(SESSION_OUT(session), "Scrub: running at %.2f MB/s\n", status->rate_mb_s);
+    } else {
+        fprintf(SESSION_OUT(session), "Scrub: stopped\n");
+    }
+    fprintf(SESSION_OUT(session), "  Cursor: cluster %d of %d, %llu passes completed\n", status->cursor,
+            status->cluster_count, (unsigned long long)status->passes);
+    fprintf(SESSION_OUT(session), "  Checked: %llu clusters, %.2f MB\n", (unsigned long long)status->clusters_checked,
+            status->bytes_checked / (1024.0 * 1024.0));
+    fprintf(SESSION_OUT(session), "  Findings: %llu\n", (unsigned long long)status->findings);
+
+    for (int i = 0; i < status->log_count; i++) {
+        const PfScrubFinding *finding = &status->log[i];
+        time_t when = (time_t)finding->time;
+        struct tm local;
+        char stamp[32];
+        strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", localtime_r(&when, &local));
+        fprintf(SESSION_OUT(session), "  %s cluster %d: ", stamp, finding->cluster);
+        switch (finding->issue) {
+            case PF_SCRUB_CHECKSUM:
+                fprintf(SESSION_OUT(session), "checksum mismatch\n");
+                break;
+            case PF_SCRUB_FAT_MISMATCH:
+                fprintf(SESSION_OUT(session), "FAT copies differ (FAT1 %d, FAT2 %d)\n", finding->fat1, finding->fat2);
+                break;
+            case PF_SCRUB_BAD_LINK:
+                fprintf(SESSION_OUT(session), "invalid FAT link %d\n", finding->fat1);
+                break;
         }
+    }
+}
 
-        
-        if (strlen(command) <= 5 || command[4] != ' ') {
-            printf("INVALID COMMAND\n");
+static void cmd_scrub(FileSystem *fs, Session *session, int argc, char **argv) {
+    PfResult result;
+    if (strcmp(argv[0], "start") == 0 && argc <= 2) {
+        double rate = argc == 2 ? atof(argv[1]) : SCRUB_DEFAULT_RATE;
+        result = pf_scrub_start(fs, rate);
+    } else if (strcmp(argv[0], "stop") == 0 && argc == 1) {
+        result = pf_scrub_stop(fs);
+    } else if (strcmp(argv[0], "status") == 0 && argc == 1) {
+        PfScrubStatus status;
+        result = pf_scrub_status(fs, &status);
+        if (result == PF_OK) {
+            print_scrub_status(session, &status);
             return;
         }
+    } else {
+        fprintf(SESSION_OUT(session), "Invalid command syntax. Usage: scrub start [MB/s] | scrub stop | scrub status\n");
+        session->process_error = true;
+        return;
+    }
+
+    if (result != PF_OK) {
+        report(session, result);
+        return;
+    }
+    fprintf(SESSION_OUT(session), "OK\n");
+}
 
-        
-        char dir_name[MAX_ITEM_NAME_SIZE];
-        strncpy(dir_name, command + 5, MAX_ITEM_NAME_SIZE - 1);
-        dir_name[MAX_ITEM_NAME_SIZE - 1] = '\0'; 
+static void cmd_bug(FileSystem *fs, Session *session, int argc, char **argv) {
+    (void)argc;
+    fprintf(SESSION_OUT(session), "Corrupting filesystem...\n");
 
-        
-        info(dir_name);
-    } else if (strcmp(command, "check") == 0) {
-        if (!fat_table1) {
-            printf("Filesystem not formatted. Use 'format' first.\n");
-            return;
-        }
-        check();
-    } else if (strncmp(command, "bug", 3) == 0) {
-        if (!fat_table1) {
-            printf("Filesystem not formatted. Use 'format' first.\n");
-            return;
+    bool is_file;
+    int32_t original;
+    PfResult result = pf_corrupt(fs, session, argv[0], &is_file, &original);
+    if (result == PF_ERR_NOT_FOUND) {
+        fprintf(SESSION_OUT(session), "Error: File or directory '%s' not found.\n", argv[0]);
+        session->process_error = true;
+    } else if (result != PF_OK) {
+        report(session, result);
+    } else if (is_file) {
+        fprintf(SESSION_OUT(session), "File '%s' has been corrupted. Original value: %d.\n", argv[0], original);
+    } else {
+        fprintf(SESSION_OUT(session), "Directory '%s' has been corrupted. Original cluster value: %d.\n", argv[0], original);
+    }
+}
+
+static void cmd_incp(FileSystem *fs, Session *session, int argc, char **argv) {
+    (void)argc;
+    PfResult result = pf_import(fs, session, argv[0], argv[1]);
+    if (result != PF_OK) {
+        report(session, result);
+        return;
+    }
+    fprintf(SESSION_OUT(session), "File '%s' was successfully copied to '%s'.\n", argv[0], argv[1]);
+}
+
+static void cmd_outcp(FileSystem *fs, Session *session, int argc, char **argv) {
+    (void)argc;
+    PfResult result = pf_export(fs, session, argv[0], argv[1]);
+    if (result != PF_OK) {
+        report(session, result);
+        return;
+    }
+    fprintf(SESSION_OUT(session), "OK\n");
+}
+
+static void cmd_cat(FileSystem *fs, Session *session, int argc, char **argv) {
+    (void)argc;
+    PfFile file;
+    PfResult result = pf_open_file(fs, session, argv[0], &file);
+    if (result != PF_OK) {
+        report(session, result);
+        return;
+    }
+
+    // One cluster per read, on the heap: clusters go up to PF_CLUSTER_SIZE_MAX
+    size_t buffer_size = (size_t)fs->description.cluster_size;
+    char *buffer = malloc(buffer_size);
+    if (!buffer) {
+        report(session, PF_ERR_NO_MEMORY);
+        return;
+    }
+    size_t got;
+    while ((result = pf_read(&file, buffer, buffer_size, &got)) == PF_OK) {
+        fwrite(buffer, 1, got, SESSION_OUT(session));
+    }
+    free(buffer);
+    fprintf(SESSION_OUT(session), "\n");
+    if (result != PF_END) {
+        report(session, result);
+    }
+}
+
+// Runs the commands of a host script, the whole script is one commit
+static void cmd_load(FileSystem *fs, Session *session, int argc, char **argv) {
+    (void)argc;
+    FILE *file = fopen(argv[0], "r");
+    if (!file) {
+        report(session, PF_ERR_NOT_FOUND);
+        return;
+    }
+
+    char *command_buffer = NULL;  // Reused by getline, no limit on the line length
+    size_t command_capacity = 0;
+    int line_number = 0;
+    int error_count = 0;
+
+    // Group the whole script into one commit instead of saving on every format
+    bool was_deferred = fs->defer_save;
+    fs->defer_save = true;
+
+    while (getline(&command_buffer, &command_capacity, file) != -1) {
+        // Remove trailing newline character, CRLF scripts included
+        command_buffer[strcspn(command_buffer, "\r\n")] = '\0';
+
+        line_number++;
+        session->process_error = false; // Reset error flag before each command
+        process_command(fs, session, command_buffer);
+
+        // Check for errors
+        if (session->process_error) {
+            fprintf(SESSION_OUT(session), "Error processing command on line %d: %s\n", line_number, command_buffer);
+            error_count++;
         }
+    }
 
-        
-        char dir_name[MAX_ITEM_NAME_SIZE];
-        if (sscanf(command + 3, "%s", dir_name) == 1) {
-            bug(dir_name); 
-        } 
-    } else if (strncmp(command, "incp", 4) == 0) {
-        if (!fat_table1) {
-            printf("Filesystem not formatted. Use 'format' first.\n");
-            return;
+    free(command_buffer);
+    fclose(file);
+
+    fs->defer_save = was_deferred;
+    if (!fs->defer_save && fs->fat_table1) {
+        save_system_state(fs, session, fs->image_path);
+    }
+
+    session->process_error = error_count > 0;
+    if (error_count > 0) {
+        fprintf(SESSION_OUT(session), "Load completed with %d errors.\n", error_count);
+    } else {
+        fprintf(SESSION_OUT(session), "OK\n");
+    }
+}
+
+static void cmd_stats(FileSystem *fs, Session *session, int argc, char **argv) {
+    (void)fs;
+    if (argc == 0) {
+        stats_print(SESSION_OUT(session));
+    } else if (strcmp(argv[0], "reset") == 0 && argc == 1) {
+        stats_reset();
+        fprintf(SESSION_OUT(session), "OK\n");
+    } else if (strcmp(argv[0], "dump") == 0 && argc == 2) {
+        if (stats_dump_file(argv[1]) == 0) {
+            fprintf(SESSION_OUT(session), "OK\n");
+        } else {
+            session->process_error = true;
         }
+    } else {
+        fprintf(SESSION_OUT(session), "Invalid command syntax. Usage: stats [reset | dump <file>]\n");
+        session->process_error = true;
+    }
+}
 
-        
-        const char *args = command + 5; 
-        while (*args == ' ') args++;   
+static void cmd_trace(FileSystem *fs, Session *session, int argc, char **argv) {
+    (void)fs;
+    int failed;
+    if (strcmp(argv[0], "start") == 0 && argc <= 2) {
+        failed = trace_start(argc == 2 ? atoi(argv[1]) : 0);
+    } else if (strcmp(argv[0], "stop") == 0 && argc == 2) {
+        failed = trace_stop(argv[1]);
+    } else {
+        fprintf(SESSION_OUT(session), "Invalid command syntax. Usage: trace start [capacity] | trace stop <file>\n");
+        session->process_error = true;
+        return;
+    }
 
-        char src_path[MAX_ITEM_NAME_SIZE];
-        char dest_path[MAX_ITEM_NAME_SIZE];
+    if (failed != 0) {
+        session->process_error = true;  // trace_start() and trace_stop() printed why
+        return;
+    }
+    fprintf(SESSION_OUT(session), "OK\n");
+}
 
-        
-        int args_parsed = sscanf(args, "%255s %255s", src_path, dest_path);
+static const Command commands[] = {
+    { "format", 1, 2, false, true,  cmd_format, "Invalid command syntax. Usage: format <size>MB [cluster=<bytes>] | format --advise <hostdir>" },
+    { "ls",     0, 1, true,  false, cmd_ls,     NULL },
+    { "mkdir",  1, 1, true,  true,  cmd_mkdir,  NULL },
+    { "cd",     1, 1, true,  false, cmd_cd,     NULL },
+    { "pwd",    0, 0, true,  false, cmd_pwd,    NULL },
+    { "rmdir",  1, 1, true,  true,  cmd_rmdir,  NULL },
+    { "rm",     1, 3, true,  true,  cmd_rm,     "Invalid command syntax. Usage: rm <file> | rm -r [--background] <path>" },
+    { "cp",     2, 2, true,  true,  cmd_cp,     "Invalid command syntax. Usage: cp <source> <destination>" },
+    { "mv",     2, 2, true,  true,  cmd_mv,     "Invalid command syntax. Usage: mv <source> <destination>" },
+    { "info",   1, 1, true,  false, cmd_info,   NULL },
+    { "check",  0, 0, true,  false, cmd_check,  NULL },
+    { "du",     0, 3, true,  false, cmd_du,     "Invalid command syntax. Usage: du [-d depth] [path]" },
+    { "find",   2, 2, true,  false, cmd_find,   "Invalid command syntax. Usage: find <dir> <glob>" },
+    { "grep",   2, 3, true,  false, cmd_grep,   "Invalid command syntax. Usage: grep [-r] <pattern> <path>" },
+    { "trim",   0, 0, true,  true,  cmd_trim,   NULL },
+    { "bug",    1, 1, true,  true,  cmd_bug,    NULL },
+    { "checksums", 0, 1, true, true, cmd_checksums, "Invalid command syntax. Usage: checksums [on | off]" },
+    { "inline", 0, 1, false, true,  cmd_inline, "Invalid command syntax. Usage: inline [<bytes> | off]" },
+    { "scrub",  1, 2, true,  true,  cmd_scrub,  "Invalid command syntax. Usage: scrub start [MB/s] | scrub stop | scrub status" },
+    { "incp",   2, 2, true,  true,  cmd_incp,   "Invalid command syntax. Usage: incp <source> <destination>" },
+    { "outcp",  2, 2, true,  false, cmd_outcp,  "Invalid command syntax. Usage: outcp <source> <destination>" },
+    { "cat",    1, 1, true,  false, cmd_cat,    NULL },
+    { "load",   1, 1, true,  true,  cmd_load,   "Invalid command syntax. Usage: load <source>" },
+    { "stats",  0, 2, false, false, cmd_stats,  "Invalid command syntax. Usage: stats [reset | dump <file>]" },
+    { "trace",  1, 2, false, true,  cmd_trace,  "Invalid command syntax. Usage: trace start [capacity] | trace stop <file>" },
+};
 
-        if (args_parsed != 2) {
-            printf("Invalid command syntax. Usage: incp <source> <destination>\n");
-            return;
+#define COMMAND_COUNT ((int)(sizeof(commands) / sizeof(commands[0])))
+
+static const Command *command_slots[COMMAND_SLOTS]; // Perfect hash table over commands[]
+static unsigned command_seed = 0;                   // Seed that makes the hash collision free
+static bool command_index_built = false;
+
+// FNV-1a with a seed mixed into the offset basis. The final avalanche step matters: the low
+// bits of a plain FNV hash depend only on the low bits of the input, so few seeds would differ.
+static unsigned command_hash(const char *name, unsigned seed) {
+    uint32_t hash = 2166136261u ^ (seed * 16777619u);
+    while (*name) {
+        hash ^= (unsigned char)*name++;
+        hash *= 16777619u;
+    }
+    hash ^= hash >> 16;
+    hash *= 0x45d9f3bu;
+    hash ^= hash >> 16;
+    return hash & (COMMAND_SLOTS - 1);
+}
+
+// Searches for a seed under which every command name gets its own slot
+static void build_command_index() {
+    for (unsigned seed = 0; seed < 1000000; seed++) {
+        memset(command_slots, 0, sizeof(command_slots));
+
+        bool collision = false;
+        for (int i = 0; i < COMMAND_COUNT && !collision; i++) {
+            unsigned slot = command_hash(commands[i].name, seed);
+            if (command_slots[slot]) {
+                collision = true;
+            } else {
+                command_slots[slot] = &commands[i];
+            }
         }
 
-        
-        incp(src_path, dest_path);
-    } else if (strncmp(command, "outcp", 5) == 0) {
-        if (!fat_table1) {
-            printf("Filesystem not formatted. Use 'format' first.\n");
+        if (!collision) {
+            command_seed = seed;
+            command_index_built = true;
             return;
         }
+    }
 
-        
-        const char *args = command + 6; 
-        while (*args == ' ') args++;   
+    // Only reachable if the table outgrows COMMAND_SLOTS
+    fprintf(stderr, "Error: No collision free hash seed for %d commands.\n", COMMAND_COUNT);
+    exit(EXIT_FAILURE);
+}
 
-        char src_path[MAX_ITEM_NAME_SIZE];
-        char dest_path[MAX_ITEM_NAME_SIZE];
+void init_command_table() {
+    if (!command_index_built) {
+        build_command_index();
+    }
+}
 
-        
-        int args_parsed = sscanf(args, "%255s %255s", src_path, dest_path);
+static const Command *find_command(const char *name) {
+    init_command_table();
 
-        if (args_parsed != 2) {
-            printf("Invalid command syntax. Usage: incp <source> <destination>\n");
-            return;
+    const Command *command = command_slots[command_hash(name, command_seed)];
+    if (command && strcmp(command->name, name) == 0) {
+        return command;
+    }
+    return NULL;
+}
+
+// Splits the line in place into whitespace separated tokens. Single and double quotes group
+// words, a backslash escapes the next character outside single quotes.
+// Returns the number of tokens, or -1 for an unterminated quote or too many tokens.
+static int tokenize(char *line, char **tokens, int max_tokens) {
+    int count = 0;
+    char *read = line;
+
+    while (*read) {
+        while (*read == ' ' || *read == '\t') read++;
+        if (!*read) break;
+
+        if (count == max_tokens) {
+            return -1;
         }
 
-        
-        outcp(src_path, dest_path);
-    } else if (strncmp(command, "cat", 3) == 0) {
-        if (!fat_table1) {
-            printf("Filesystem not formatted. Use 'format' first.\n");
-            return;
+        char *write = read;
+        tokens[count++] = write;
+        char quote = '\0';
+
+        while (*read && (quote || (*read != ' ' && *read != '\t'))) {
+            if (quote && *read == quote) {
+                quote = '\0';
+                read++;
+            } else if (!quote && (*read == '"' || *read == '\'')) {
+                quote = *read++;
+            } else if (*read == '\\' && quote != '\'' && read[1]) {
+                *write++ = read[1];
+                read += 2;
+            } else {
+                *write++ = *read++;
+            }
         }
-        char path[MAX_ITEM_NAME_SIZE];
-        if (sscanf(command + 4, "%s", path) == 1) {
-            cat(path);
-        } else {
-            printf("INVALID COMMAND\n");
+
+        if (quote) {
+            return -1;
         }
-    } else if (strncmp(command, "load", 4) == 0) {
-        if (!fat_table1) {
-            printf("Filesystem not formatted. Use 'format' first.\n");
-            return;
+        if (*read) {
+            read++;
         }
+        *write = '\0';
+    }
 
-        
-        const char *args = command + 5; 
-        while (*args == ' ') args++;   
+    return count;
+}
 
-        char src_path[MAX_ITEM_NAME_SIZE];
+// Commands marked mutating that still work on a read-only mount: the cluster size advice only
+// reads the host, the status forms of checksums, inline and scrub only report, tracing is
+// exclusive just to keep its buffer consistent
+static bool leaves_image_alone(const Command *cmd, int argc, char **argv) {
+    if (cmd->handler == cmd_format) {
+        return argc == 2 && strcmp(argv[0], "--advise") == 0;
+    }
+    if (cmd->handler == cmd_checksums || cmd->handler == cmd_inline) {
+        return argc == 0;
+    }
+    if (cmd->handler == cmd_scrub) {
+        return argc == 1 && strcmp(argv[0], "status") == 0;
+    }
+    return cmd->handler == cmd_trace;
+}
 
-        
-        int args_parsed = sscanf(args, "%255s", src_path);
+// Commands that only need names and the shape of the tree, which the published versions hold.
+// Everything that reads cluster contents, the FAT or the name index takes the lock.
+static bool reads_published_tree(const Command *cmd) {
+    return cmd->handler == cmd_ls || cmd->handler == cmd_pwd;
+}
 
-        if (args_parsed != 1) {
-            printf("Invalid command syntax. Usage: load <source>\n");
-            return;
-        }
+// Looks at the command name only. Unknown commands just print an error and count as reads,
+// a quoted or escaped name is classified as a write rather than tokenizing the whole line.
+CommandAccess command_access(const char *command) {
+    char name[16];
+    while (*command == ' ' || *command == '\t') command++;
+    size_t len = strcspn(command, " \t");
+    if (strcspn(command, "\"'\\") < len) {
+        return COMMAND_WRITE;
+    }
+    if (len >= sizeof(name)) {
+        return COMMAND_READ;
+    }
+    memcpy(name, command, len);
+    name[len] = '\0';
+
+    const Command *cmd = find_command(name);
+    if (!cmd) {
+        return COMMAND_READ;
+    }
+    return cmd->mutating ? COMMAND_WRITE : reads_published_tree(cmd) ? COMMAND_PUBLISHED : COMMAND_READ;
+}
+
+void process_command(FileSystem *fs, Session *session, char *command) {
+    char *tokens[MAX_COMMAND_ARGS + 1];
+    int token_count = tokenize(command, tokens, MAX_COMMAND_ARGS + 1);
+
+    if (token_count < 0) {
+        fprintf(SESSION_OUT(session), "INVALID COMMAND\n");
+        session->process_error = true;
+        return;
+    }
+    if (token_count == 0) {
+        return;
+    }
+
+    const Command *cmd = find_command(tokens[0]);
+    if (!cmd) {
+        fprintf(SESSION_OUT(session), "UNKNOWN COMMAND\n");
+        session->process_error = true;
+        return;
+    }
+
+    if (cmd->needs_fs && !session->published_root && !fs->fat_table1) {
+        fprintf(SESSION_OUT(session), "Filesystem not formatted. Use 'format' first.\n");
+        session->process_error = true;
+        return;
+    }
+
+    int argc = token_count - 1;
+    if (argc < cmd->min_args || argc > cmd->max_args) {
+        fprintf(SESSION_OUT(session), "%s\n", cmd->usage ? cmd->usage : "INVALID COMMAND");
+        session->process_error = true;
+        return;
+    }
+
+    if (fs->read_only && cmd->mutating && !leaves_image_alone(cmd, argc, tokens + 1)) {
+        report(session, PF_ERR_READ_ONLY);
+        return;
+    }
+
+    STAT_TIMER(command_start);
+    if (session->published_root) {
+        // No lock is held, `trace` could swap the span buffer under the command
+        cmd->handler(fs, session, argc, tokens + 1);
+    } else {
+        TRACE_BEGIN(trace_start_ns);
+        cmd->handler(fs, session, argc, tokens + 1);
+        TRACE_END(trace_start_ns, "command", cmd->name);
+    }
+#ifdef FS_STATS
+    stats_record_command((int)(cmd - commands), cmd->name, stats_now_ns() - command_start);
+#endif
+}
 
-        
-        load(filename, src_path);
-    }else {
-        printf("UNKNOWN COMMAND\n");
+// Runs a command line holding fs->lock, shared for commands that only read
+void execute_command(FileSystem *fs, Session *session, char *command) {
+    if (command_access(command) == COMMAND_WRITE) {
+        pthread_rwlock_wrlock(&fs->lock);
+    } else {
+        pthread_rwlock_rdlock(&fs->lock);
     }
+    process_command(fs, session, command);
+    pthread_rwlock_unlock(&fs->lock);
 }
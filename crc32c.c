@@ -0,0 +1,113 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <string.h>
+#include "Crc32c.h"
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <nmmintrin.h>
+#define CRC32C_HAVE_SSE42 1
+#endif
+
+#define CRC32C_POLY 0x82F63B78u // Reflected Castagnoli polynomial
+
+static uint32_t crc_tables[8][256];  // crc_tables[k][b]: CRC of byte b followed by k zero bytes
+static uint32_t (*crc_update)(uint32_t crc, const unsigned char *p, size_t size);
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char *p, size_t size) {
+    // Byte by byte up to an 8 byte boundary, then 8 bytes per step
+    while (size > 0 && ((uintptr_t)p & 7) != 0) {
+        crc = crc_tables[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+        size--;
+    }
+
+    while (size >= 8) {
+        uint32_t low, high;
+        memcpy(&low, p, 4);
+        memcpy(&high, p + 4, 4);
+        low ^= crc;
+        crc = crc_tables[7][low & 0xFF] ^ crc_tables[6][(low >> 8) & 0xFF] ^
+              crc_tables[5][(low >> 16) & 0xFF] ^ crc_tables[4][low >> 24] ^
+              crc_tables[3][high & 0xFF] ^ crc_tables[2][(high >> 8) & 0xFF] ^
+              crc_tables[1][(high >> 16) & 0xFF] ^ crc_tables[0][high >> 24];
+        p += 8;
+        size -= 8;
+    }
+
+    while (size > 0) {
+        crc = crc_tables[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+        size--;
+    }
+    return crc;
+}
+
+#ifdef CRC32C_HAVE_SSE42
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char *p, size_t size) {
+    uint64_t crc64 = crc;
+    while (size > 0 && ((uintptr_t)p & 7) != 0) {
+        crc64 = _mm_crc32_u8((uint32_t)crc64, *p++);
+        size--;
+    }
+
+    while (size >= 8) {
+        uint64_t word;
+        memcpy(&word, p, 8);
+        crc64 = _mm_crc32_u64(crc64, word);
+        p += 8;
+        size -= 8;
+    }
+
+    while (size > 0) {
+        crc64 = _mm_crc32_u8((uint32_t)crc64, *p++);
+        size--;
+    }
+    return (uint32_t)crc64;
+}
+#endif
+
+// Builds the slicing tables and picks the implementation, runs once per process
+static void crc32c_init() {
+    for (uint32_t b = 0; b < 256; b++) {
+        uint32_t crc = b;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc >> 1) ^ (crc & 1 ? CRC32C_POLY : 0);
+        }
+        crc_tables[0][b] = crc;
+    }
+    for (int k = 1; k < 8; k++) {
+        for (int b = 0; b < 256; b++) {
+            uint32_t previous = crc_tables[k - 1][b];
+            crc_tables[k][b] = crc_tables[0][previous & 0xFF] ^ (previous >> 8);
+        }
+    }
+
+    crc_update = crc32c_sw;
+#ifdef CRC32C_HAVE_SSE42
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2")) {
+        crc_update = crc32c_hw;
+    }
+#endif
+}
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t size) {
+    pthread_once(&crc_once, crc32c_init);
+    return ~crc_update(~crc, (const unsigned char *)data, size);
+}
+
+uint32_t crc32c_zeros(uint32_t crc, size_t size) {
+    static const unsigned char zeros[4096];
+    while (size > 0) {
+        size_t chunk = size < sizeof(zeros) ? size : sizeof(zeros);
+        crc = crc32c(crc, zeros, chunk);
+        size -= chunk;
+    }
+    return crc;
+}
+
+const char *crc32c_implementation() {
+    pthread_once(&crc_once, crc32c_init);
+    return crc_update == crc32c_sw ? "slicing-by-8" : "sse4.2";
+}
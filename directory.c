@@ -1,53 +1,130 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "ClusterCache.h"
+#include "Crc32c.h"
 #include "FatTable.h"
+#include "NameIndex.h"
+#include "PseudoFat.h"
+#include "Stats.h"
+#include "Trace.h"
+#include "Transfer.h"
+#include "Traverse.h"
+#include "TreeVersions.h"
 
 /* POMOCNÉ FUNKCE */
 
 
-// Global error flag for process_command
-bool process_error = false;
-static int32_t cluster_references[MAX_CHILDREN]; // Pole pro sledování referencí clusterů
+void increment_cluster_reference(FileSystem *fs, int32_t cluster) {
+    if (cluster < 0 || cluster >= fs->description.cluster_count) return;
+    fs->cluster_references[cluster]++;
+}
+
+void decrement_cluster_reference(FileSystem *fs, int32_t cluster) {
+    if (cluster < 0 || cluster >= fs->description.cluster_count) return;
+    if (fs->cluster_references[cluster] > 0) {
+        fs->cluster_references[cluster]--;
+    }
+}
+
+int get_cluster_reference_count(FileSystem *fs, int32_t cluster) {
+    if (cluster < 0 || cluster >= fs->description.cluster_count) return 0;
+    return fs->cluster_references[cluster];
+}
+
+SubtreeTotals item_totals(FileSystem *fs, const DirectoryItem *item) {
+    if (!item->isFile) {
+        return item->totals;
+    }
+
+    // Chains are as long as the size needs, an empty file still owns one cluster
+    int64_t cluster_size = fs->description.cluster_size;
+    int64_t clusters = item->is_inline ? 0 : item->size > 0 ? (item->size + cluster_size - 1) / cluster_size : 1;
+    return (SubtreeTotals){ item->size, 1, clusters };
+}
 
-char *strdup(const char *str) {
-    if (str == NULL) return NULL;
-    size_t len = strlen(str) + 1;
-    char *copy = malloc(len);
-    if (copy) {
-        memcpy(copy, str, len);
+void propagate_totals(DirectoryItem *dir, SubtreeTotals delta, int sign) {
+    for (; dir; dir = dir->parent) {
+        dir->totals.bytes += sign * delta.bytes;
+        dir->totals.files += sign * delta.files;
+        dir->totals.clusters += sign * delta.clusters;
     }
-    return copy;
 }
 
+// Counts the references of every file cluster and starts each directory at its own chain
+static TreeAction count_item(TreeVisit *visit, void *context) {
+    FileSystem *fs = context;
+    DirectoryItem *item = visit->item;
+    if (!item->isFile) {
+        int32_t own = chain_length(fs, item->start_cluster);
+        item->totals = (SubtreeTotals){ 0, 0, own > 0 ? own : 0 };
+        return TREE_CONTINUE;
+    }
 
-void increment_cluster_reference(int32_t cluster) {
-    cluster_references[cluster]++;
+    int32_t cluster = item->start_cluster;
+    while (cluster >= 0 && cluster < fs->description.cluster_count) {
+        increment_cluster_reference(fs, cluster);
+        STAT_INC(STAT_FAT_LINKS);
+        cluster = fs->fat_table1[cluster];
+    }
+    return TREE_CONTINUE;
 }
 
-void decrement_cluster_reference(int32_t cluster) {
-    if (cluster_references[cluster] > 0) {
-        cluster_references[cluster]--;
+// Adds a finished item to the totals of its parent
+static TreeAction sum_item(TreeVisit *visit, void *context) {
+    DirectoryItem *item = visit->item;
+    if (visit->depth > 0 && item->parent) {
+        SubtreeTotals totals = item_totals(context, item);
+        item->parent->totals.bytes += totals.bytes;
+        item->parent->totals.files += totals.files;
+        item->parent->totals.clusters += totals.clusters;
     }
+    return TREE_CONTINUE;
 }
 
-int get_cluster_reference_count(int32_t cluster) {
-    return cluster_references[cluster];
+// Allocates the per-cluster bookkeeping after format or load and rebuilds the reference counts
+// and subtree totals from the tree
+void init_cluster_state(FileSystem *fs) {
+    free(fs->cluster_references);
+    free(fs->zero_pending);
+
+    fs->cluster_references = (int32_t *)calloc(fs->description.cluster_count, sizeof(int32_t));
+    fs->zero_pending = (uint8_t *)calloc(fs->description.cluster_count, sizeof(uint8_t));
+    fs->zero_pending_count = 0;
+    free(fs->fat_dirty);
+    fs->fat_dirty = (uint8_t *)calloc((fs->description.fat_count + FAT_MIRROR_PAGE - 1) / FAT_MIRROR_PAGE, sizeof(uint8_t));
+    fs->fat_dirty_count = 0;  // Format and load leave both FAT copies identical
+    free(fs->fat_unsaved);
+    fs->fat_unsaved = fs->cache ? (uint8_t *)calloc((fs->description.fat_count + FAT_MIRROR_PAGE - 1) / FAT_MIRROR_PAGE, sizeof(uint8_t)) : NULL;
+    free(fs->record_buffer);
+    fs->record_buffer = malloc(fs->description.cluster_size);
+    if (!fs->cluster_references || !fs->zero_pending || !fs->fat_dirty || (fs->cache && !fs->fat_unsaved) || !fs->record_buffer) {
+        fprintf(stderr, "Error: Insufficient memory for cluster bookkeeping (%d clusters).\n", fs->description.cluster_count);
+        exit(EXIT_FAILURE);
+    }
+
+    tree_walk(&fs->root_directory, count_item, sum_item, fs);
 }
 
-void copy_cluster_data(int32_t src_cluster, int32_t dest_cluster) {
+void copy_cluster_data(FileSystem *fs, int32_t src_cluster, int32_t dest_cluster) {
     // Validace vstupních clusterů
-    if (src_cluster < 0 || src_cluster >= fs_description.cluster_count ||
-        dest_cluster < 0 || dest_cluster >= fs_description.cluster_count) {
+    if (src_cluster < 0 || src_cluster >= fs->description.cluster_count ||
+        dest_cluster < 0 || dest_cluster >= fs->description.cluster_count) {
         fprintf(stderr, "Error: Invalid cluster index.\n");
         return;
     }
 
     // Zvýšení referenčního počtu na cílový cluster
-    increment_cluster_reference(dest_cluster);
+    increment_cluster_reference(fs, dest_cluster);
 
     // Data už jsou shodná, nic není třeba kopírovat
-    printf("Cluster %d is now referenced for destination.\n", dest_cluster);
+    fprintf(stdout, "Cluster %d is now referenced for destination.\n", dest_cluster);
 }
 
 
@@ -82,126 +159,311 @@ void get_parent_path(const char *path, char *parent_path) {
 
 
 
-void free_cluster(int cluster) {
-    fat_table1[cluster] = FAT_UNUSED;
-    if (fat_table2) {
-        fat_table2[cluster] = FAT_UNUSED;
+static void mark_fat_dirty(FileSystem *fs, int32_t cluster) {
+    uint8_t *page = &fs->fat_dirty[cluster / FAT_MIRROR_PAGE];
+    if (!*page) {
+        *page = 1;
+        fs->fat_dirty_count++;
     }
-    memset(&fs_data[cluster * fs_description.cluster_size], 0, fs_description.cluster_size);
 }
 
-void free_directory(DirectoryItem *dir) {
-    // Free any resources associated with the directory itself if needed.
-    free(dir);
+// Writes one FAT entry. Only fat_table1 is touched, fat_table2 catches up in sync_fat_mirror().
+void set_fat_entry(FileSystem *fs, int32_t cluster, int32_t value) {
+    fs->fat_table1[cluster] = value;
+    mark_fat_dirty(fs, cluster);
 }
 
+// Brings fat_table2 up to date before a commit, runs of dirty pages are copied in one go
+void sync_fat_mirror(FileSystem *fs) {
+    int32_t pages = (fs->description.fat_count + FAT_MIRROR_PAGE - 1) / FAT_MIRROR_PAGE;
+    for (int32_t page = 0; page < pages && fs->fat_dirty_count > 0; page++) {
+        if (!fs->fat_dirty[page]) continue;
 
+        int32_t run_end = page;
+        while (run_end < pages && fs->fat_dirty[run_end]) {
+            fs->fat_dirty[run_end++] = 0;
+            fs->fat_dirty_count--;
+        }
+        int32_t first = page * FAT_MIRROR_PAGE;
+        int32_t last = run_end * FAT_MIRROR_PAGE < fs->description.fat_count ? run_end * FAT_MIRROR_PAGE : fs->description.fat_count;
+        memcpy(fs->fat_table2 + first, fs->fat_table1 + first, (size_t)(last - first) * sizeof(int32_t));
+        STAT_ADD(STAT_FAT_MIRRORED, last - first);
+        if (fs->fat_unsaved) {
+            memset(fs->fat_unsaved + page, 1, (size_t)(run_end - page));  // Written to the image at the next commit
+        }
+        page = run_end;
+    }
+}
 
-void update_directory_size(DirectoryItem *dir) {
-    if (dir == NULL) {
-        printf("Error: Directory is NULL.\n");
-        return;
+// Returns a cluster to the free pool. Its contents are not cleared here, the cluster only
+// joins the zero_pending set and is zeroed lazily (on the next write, by trim or on save).
+void free_cluster(FileSystem *fs, int32_t cluster) {
+    STAT_INC(STAT_CLUSTERS_FREED);
+    set_fat_entry(fs, cluster, FAT_UNUSED);
+    if (!fs->zero_pending[cluster]) {
+        fs->zero_pending[cluster] = 1;
+        fs->zero_pending_count++;
+    }
+    if (fs->cluster_checksums) {
+        fs->cluster_checksums[cluster] = fs->zero_checksum; // Reads as zeros from now on
     }
+}
 
-    if (!dir->isFile) {
-        int total_size = 0;
+// Allocates the checksum table and computes it from the current contents
+bool enable_cluster_checksums(FileSystem *fs) {
+    size_t cluster_size = (size_t)fs->description.cluster_size;
+    uint32_t *checksums = malloc((size_t)fs->description.cluster_count * sizeof(uint32_t));
+    if (!checksums) {
+        return false;
+    }
 
-        // Iterate over child items
-        for (int i = 0; i < dir->child_count; i++) {
-            if (i >= MAX_CHILDREN || dir->children[i] == NULL) {
-                printf("Error: Invalid child pointer at index %d\n", i);
-                continue;
-            }
-            DirectoryItem *child = dir->children[i];
-            if (child && child->isFile) {
-                dir->size += child->size;
-            }
+    fs->zero_checksum = crc32c_zeros(0, cluster_size);
+
+    for (int32_t i = 0; i < fs->description.cluster_count; i++) {
+        if (fs->zero_pending[i]) {
+            checksums[i] = fs->zero_checksum;
+            continue;
+        }
+        const char *contents = cluster_pin(fs, i, true);
+        if (!contents) {
+            free(checksums);
+            return false;
         }
+        checksums[i] = crc32c(0, contents, cluster_size);
+        cluster_unpin(fs, i, false);
+    }
 
+    free(fs->cluster_checksums);
+    fs->cluster_checksums = checksums;
+    fs->description.features |= FS_FEATURE_CHECKSUMS;
+    return true;
+}
 
-        // Update directory size
-        dir->size = total_size;
+// Checks a cluster against its CRC32C. Clusters waiting in zero_pending read as zeros whatever
+// their stale bytes are, so they always pass.
+bool verify_cluster_checksum(FileSystem *fs, int32_t cluster) {
+    if (!fs->cluster_checksums || fs->zero_pending[cluster]) {
+        return true;
+    }
 
-        // Check if the directory exceeds the cluster size
-        if (dir->size > fs_description.cluster_size) {
-            int clusters_needed = (dir->size / fs_description.cluster_size) +
-                                  ((dir->size % fs_description.cluster_size) > 0 ? 1 : 0);
-            // Allocate clusters for the directory
-            allocate_clusters_for_directory(dir, clusters_needed);
-        }
+    STAT_INC(STAT_CHECKSUMS_VERIFIED);
+    size_t cluster_size = (size_t)fs->description.cluster_size;
+    const char *contents = cluster_pin(fs, cluster, true);
+    bool intact = contents && crc32c(0, contents, cluster_size) == fs->cluster_checksums[cluster];
+    if (contents) {
+        cluster_unpin(fs, cluster, false);
+    }
+    if (intact) {
+        return true;
     }
+
+    STAT_INC(STAT_CHECKSUM_MISMATCHES);
+    __atomic_fetch_add(&fs->checksum_mismatches, 1, __ATOMIC_RELAXED);
+    return false;
 }
 
+// Clears the stale contents of a cluster from the zero_pending set
+static void zero_cluster(FileSystem *fs, int32_t cluster) {
+    char *contents = cluster_pin(fs, cluster, false);
+    if (!contents) return;  // Stays pending, reads as zeros anyway
+    memset(contents, 0, fs->description.cluster_size);
+    cluster_unpin(fs, cluster, true);
+    fs->zero_pending[cluster] = 0;
+    fs->zero_pending_count--;
+}
 
+void free_directory(DirectoryItem *dir) {
+    // Free any resources associated with the directory itself if needed.
+    free(dir);
+}
 
+static TreeAction free_item(TreeVisit *visit, void *context) {
+    (void)context;
+    DirectoryItem *item = visit->item;
+    if (visit->depth > 0) {
+        free_directory(item);
+        return TREE_CONTINUE;
+    }
+    for (int i = 0; i < item->child_count; i++) {
+        item->children[i] = NULL;
+    }
+    item->child_count = 0;
+    return TREE_CONTINUE;
+}
 
+// Frees all items below dir, used when a loaded or formatted image replaces the current one
+void free_directory_tree(DirectoryItem *dir) {
+    tree_walk(dir, NULL, free_item, NULL);
+}
 
-// This is a helper function that would handle allocating clusters for the directory
-void allocate_clusters_for_directory(DirectoryItem *dir, int clusters_needed) {
-    int current_cluster = dir->start_cluster;
+
+
+// Clusters a directory chain needs for count records, a directory always owns at least one
+static int directory_clusters(FileSystem *fs, int count) {
+    size_t bytes = (size_t)(count > 0 ? count : 0) * sizeof(DirectoryRecord);
+    size_t cluster_size = (size_t)fs->description.cluster_size;
+    return bytes > 0 ? (int)((bytes + cluster_size - 1) / cluster_size) : 1;
+}
+
+// Grows the chain of a directory to at least clusters_needed clusters, false if the chain is
+// broken or the disk is full (clusters allocated so far stay in the chain)
+bool allocate_clusters_for_directory(FileSystem *fs, DirectoryItem *dir, int clusters_needed) {
+    int32_t current_cluster = dir->start_cluster;
     int allocated_clusters = 0;
 
-    // Find the number of clusters already allocated
-    while (current_cluster != FAT_FILE_END) {
+    // Find the end of the chain and the number of clusters already allocated
+    while (true) {
+        if (current_cluster < 0 || current_cluster >= fs->description.cluster_count ||
+            allocated_clusters >= fs->description.cluster_count) {
+            return false;
+        }
         allocated_clusters++;
-        current_cluster = fat_table1[current_cluster];
+        if (fs->fat_table1[current_cluster] == FAT_FILE_END) break;
+        STAT_INC(STAT_FAT_LINKS);
+        current_cluster = fs->fat_table1[current_cluster];
     }
 
-    // Allocate additional clusters if needed
+    // Link additional clusters behind the last one
     while (allocated_clusters < clusters_needed) {
-        int32_t new_cluster = allocate_cluster();
-        if (new_cluster < 0) {
-            printf("Error: Unable to allocate additional cluster for directory '%s'.\n", dir->item_name);
-            return;
-        }
-        
-        // Link the new cluster to the previous one
-        current_cluster = dir->start_cluster;
-        while (fat_table1[current_cluster] != FAT_FILE_END) {
-            current_cluster = fat_table1[current_cluster];
+        int32_t new_cluster = allocate_cluster(fs);
+        if (new_cluster == FAT_UNUSED) {
+            return false;
         }
-        fat_table1[current_cluster] = new_cluster;
+        set_fat_entry(fs, current_cluster, new_cluster);
         current_cluster = new_cluster;
-
         allocated_clusters++;
+        propagate_totals(dir, (SubtreeTotals){ 0, 0, 1 }, 1);
     }
+    return true;
+}
 
-    // Mark the end of the chain with FAT_FILE_END
-    fat_table1[current_cluster] = FAT_FILE_END;
+// Makes sure dir can hold count entries before a child is added to it
+static PfResult reserve_directory(FileSystem *fs, DirectoryItem *dir, int count) {
+    if (dir->start_cluster < 0 || dir->start_cluster >= fs->description.cluster_count) {
+        return PF_ERR_CORRUPTED;
+    }
+    return allocate_clusters_for_directory(fs, dir, directory_clusters(fs, count)) ? PF_OK : PF_ERR_NO_SPACE;
 }
 
+// Rewrites the cluster chain of a directory from its children: one record per child, the rest
+// of the chain zeroed (an empty name ends the list). The chain must already be long enough.
+void store_directory(FileSystem *fs, DirectoryItem *dir) {
+    versions_publish(fs, dir);  // Server mode: readers without the lock see the change from now on
+
+    int32_t cluster = dir->start_cluster;
+    if (cluster < 0 || cluster >= fs->description.cluster_count || dir->child_count < 0) {
+        return;  // Broken by `bug`, check reports it
+    }
+
+    TRACE_BEGIN(trace_start_ns);
+    size_t cluster_size = (size_t)fs->description.cluster_size;
+    char *buffer = fs->record_buffer;
+    size_t record_size = sizeof(DirectoryRecord);
+    size_t position = 0;  // Offset of the cluster in the record stream
+    size_t used = (size_t)dir->child_count * record_size;
+
+    for (int32_t length = 0; cluster >= 0 && cluster < fs->description.cluster_count && length < fs->description.cluster_count; length++) {
+        memset(buffer, 0, cluster_size);
+
+        // Records overlapping [position, position + cluster_size), they may span two clusters
+        for (size_t offset = position / record_size * record_size; offset < used && offset < position + cluster_size; offset += record_size) {
+            const DirectoryItem *child = dir->children[offset / record_size];
+            DirectoryRecord record;
+            memset(&record, 0, sizeof(record));
+            strncpy(record.item_name, child->item_name, MAX_ITEM_NAME_SIZE - 1);
+            record.is_file = child->isFile;
+            record.size = child->size;
+            record.start_cluster = child->start_cluster;
+            if (child->is_inline) {
+                int32_t capacity = INLINE_CAPACITY(child->item_name);
+                record.flags = RECORD_INLINE;
+                memcpy(record.item_name + MAX_ITEM_NAME_SIZE - capacity, child->inline_data,
+                       child->size >= 0 && child->size < capacity ? (size_t)child->size : (size_t)capacity);
+            }
+
+            size_t from = offset < position ? position - offset : 0;
+            size_t to = offset + record_size > position + cluster_size ? position + cluster_size - offset : record_size;
+            memcpy(buffer + (offset + from - position), (const char *)&record + from, to - from);
+        }
+        write_cluster_data(fs, cluster, buffer, cluster_size);
+
+        position += cluster_size;
+        STAT_INC(STAT_FAT_LINKS);
+        cluster = fs->fat_table1[cluster];
+    }
+    TRACE_END(trace_start_ns, "io", "store_directory");
+}
 
-void* read_cluster_data(int32_t cluster, size_t size) {
+void* read_cluster_data(FileSystem *fs, int32_t cluster, size_t size) {
     // Validate the cluster index and size to ensure safe access
-    if (cluster < 0 || cluster >= fs_description.cluster_count) {
+    if (cluster < 0 || cluster >= fs->description.cluster_count) {
         fprintf(stderr, "Error: Invalid cluster index (%d).\n", cluster);
         return NULL;
     }
 
-    if ((size_t)size > (size_t)fs_description.cluster_size) {
+    if ((size_t)size > (size_t)fs->description.cluster_size) {
         fprintf(stderr, "Error: Data size exceeds cluster size.\n");
         return NULL;
     }
 
+    if (!verify_cluster_checksum(fs, cluster)) {
+        fprintf(stderr, "Error: Checksum mismatch in cluster %d.\n", cluster);
+        return NULL;
+    }
+
+    TRACE_BEGIN(trace_start_ns);
     void *buffer = malloc(size); // Allocate memory for the data
+    STAT_INC(STAT_READ_BUFFERS);
     if (!buffer) {
         fprintf(stderr, "Error: Memory allocation failed.\n");
         return NULL;
     }
 
-    size_t offset = (size_t)cluster * fs_description.cluster_size;
-    memcpy(buffer, fs_data + offset, size);  // Copy data from the cluster
+    if (fs->zero_pending[cluster]) {
+        memset(buffer, 0, size);  // Freed and not yet cleared, reads as zeros
+    } else {
+        const char *contents = cluster_pin(fs, cluster, true);
+        if (!contents) {
+            fprintf(stderr, "Error: Cluster %d could not be read from the image.\n", cluster);
+            free(buffer);
+            return NULL;
+        }
+        memcpy(buffer, contents, size);  // Copy data from the cluster
+        cluster_unpin(fs, cluster, false);
+    }
+    STAT_ADD(STAT_BYTES_READ, size);
+    TRACE_END(trace_start_ns, "io", "read_cluster_data");
 
     return buffer;
 }
 
-void write_cluster_data(int32_t cluster, const void *data, size_t size) {
-    if (cluster < 0 || cluster >= fs_description.cluster_count) {
+// Copies part of a verified cluster straight into buffer, false on a checksum mismatch
+bool read_cluster_into(FileSystem *fs, int32_t cluster, size_t offset, void *buffer, size_t size) {
+    if (!verify_cluster_checksum(fs, cluster)) {
+        return false;
+    }
+
+    if (fs->zero_pending[cluster]) {
+        memset(buffer, 0, size);  // Freed and not yet cleared, reads as zeros
+    } else {
+        const char *contents = cluster_pin(fs, cluster, true);
+        if (!contents) {
+            return false;
+        }
+        memcpy(buffer, contents + offset, size);
+        cluster_unpin(fs, cluster, false);
+    }
+    STAT_ADD(STAT_BYTES_READ, size);
+    return true;
+}
+
+void write_cluster_data(FileSystem *fs, int32_t cluster, const void *data, size_t size) {
+    if (cluster < 0 || cluster >= fs->description.cluster_count) {
         fprintf(stderr, "Error: Invalid cluster index (%d).\n", cluster);
         return;
     }
 
-    if ((size_t)size > (size_t)fs_description.cluster_size) {
+    if ((size_t)size > (size_t)fs->description.cluster_size) {
         fprintf(stderr, "Error: Data size exceeds cluster size.\n");
         return;
     }
@@ -211,20 +473,52 @@ void write_cluster_data(int32_t cluster, const void *data, size_t size) {
         return;
     }
 
-    size_t offset = (size_t)cluster * fs_description.cluster_size;
-    memcpy(fs_data + offset, data, size);  // Write data into the cluster
+    TRACE_BEGIN(trace_start_ns);
+    // The old contents only matter when some of them survive the write
+    bool whole = size == (size_t)fs->description.cluster_size || fs->zero_pending[cluster];
+    char *contents = cluster_pin(fs, cluster, !whole);
+    if (!contents) {
+        fprintf(stderr, "Error: Cluster %d could not be read from the image.\n", cluster);
+        return;
+    }
+    memcpy(contents, data, size);  // Write data into the cluster
+    STAT_ADD(STAT_BYTES_WRITTEN, size);
+
+    // A reused cluster only needs clearing behind the bytes just written
+    if (fs->zero_pending[cluster]) {
+        memset(contents + size, 0, fs->description.cluster_size - size);
+        fs->zero_pending[cluster] = 0;
+        fs->zero_pending_count--;
+    }
+    if (fs->cluster_checksums) {
+        fs->cluster_checksums[cluster] = crc32c(0, contents, fs->description.cluster_size);
+    }
+    cluster_unpin(fs, cluster, true);
+    TRACE_END(trace_start_ns, "io", "write_cluster_data");
 }
 
 
 
-DirectoryItem* find_directory_item(const char *name) {
-    if (!current_directory) {
-        printf("Error: Current file and his children are no initialized.\n");
+char *cluster_pin(FileSystem *fs, int32_t cluster, bool load) {
+    if (fs->cache) {
+        return cache_pin(fs->cache, cluster, load);
+    }
+    return fs->data + (size_t)cluster * fs->description.cluster_size;
+}
+
+void cluster_unpin(FileSystem *fs, int32_t cluster, bool dirty) {
+    if (fs->cache) {
+        cache_unpin(fs->cache, cluster, dirty);
+    }
+}
+
+DirectoryItem* find_directory_item(DirectoryItem *dir, const char *name) {
+    if (!dir) {
         return NULL;
     }
 
-    for (int i = 0; i < current_directory->child_count; i++) {
-        DirectoryItem *child = current_directory->children[i];
+    for (int i = 0; i < dir->child_count; i++) {
+        DirectoryItem *child = dir->children[i];
         if (child) {
             if (strcmp(child->item_name, name) == 0) {
                 return child;
@@ -238,36 +532,6 @@ DirectoryItem* find_directory_item(const char *name) {
 
 
 
-int add_directory_item(DirectoryItem *parent, const char *name, bool isFile, int size, int start_cluster) {
-    // Add a new item (file or directory) to the specified parent directory
-    if (parent->child_count >= MAX_CHILDREN) {
-        return -1; // Parent directory is full
-    }
-
-    DirectoryItem *new_item = (DirectoryItem *)malloc(sizeof(DirectoryItem));
-    if (!new_item) {
-        return -1; // Memory allocation failed
-    }
-
-    strncpy(new_item->item_name, name, sizeof(new_item->item_name) - 1);
-    new_item->item_name[sizeof(new_item->item_name) - 1] = '\0';
-    new_item->isFile = isFile;
-    new_item->size = size;
-    new_item->start_cluster = start_cluster;
-    new_item->parent = parent;
-
-    parent->children[parent->child_count++] = new_item; // Add to the parent's child list
-
-    // Update the size of the parent directory
-    parent->size += size;
-
-    // If the new item is a directory, initialize its size and allocate clusters
-    if (!isFile) {
-        parent->size += new_item->size;
-    }
-
-    return 0;
-}
 
 bool split_path(const char *path, char parts[MAX_CHILDREN][MAX_ITEM_NAME_SIZE], int *part_count) {
     if (!path || !parts || !part_count) {
@@ -284,9 +548,8 @@ bool split_path(const char *path, char parts[MAX_CHILDREN][MAX_ITEM_NAME_SIZE],
         if (!end) end = start + strlen(start);
 
         size_t len = end - start;
-        if (len >= MAX_ITEM_NAME_SIZE) {
-            printf("ERROR: Path part too long.\n");
-            return false;
+        if (len >= MAX_ITEM_NAME_SIZE || *part_count >= MAX_CHILDREN) {
+            return false; // Path part too long or too many parts
         }
 
         strncpy(parts[*part_count], start, len);
@@ -299,256 +562,381 @@ bool split_path(const char *path, char parts[MAX_CHILDREN][MAX_ITEM_NAME_SIZE],
     return true;
 }
 
-DirectoryItem* find_item_by_path(const char *path, DirectoryItem *start_directory) {
+// Walks path from start_directory (or the root for absolute paths). A missing last component
+// gives PF_ERR_NOT_FOUND, a missing directory on the way PF_ERR_PATH_NOT_FOUND.
+static PfResult resolve_path(FileSystem *fs, const char *path, DirectoryItem *start_directory, DirectoryItem **item) {
+    *item = NULL;
     if (!path || !start_directory) {
-        printf("ERROR: Invalid path or start directory.\n");
-        return NULL;
+        return PF_ERR_INVALID_ARGUMENT;
     }
 
+    STAT_INC(STAT_PATH_LOOKUPS);
     if (strcmp(path, "/") == 0) {
-        return &root_directory;
+        *item = &fs->root_directory;
+        return PF_OK;
     }
 
     char parts[MAX_CHILDREN][MAX_ITEM_NAME_SIZE];
     int part_count = 0;
 
     if (!split_path(path, parts, &part_count)) {
-        printf("ERROR: Failed to split path '%s'.\n", path);
-        return NULL;
+        return PF_ERR_INVALID_PATH;
     }
 
-    DirectoryItem *current = (path[0] == '/') ? &root_directory : start_directory;
+    DirectoryItem *current = (path[0] == '/') ? &fs->root_directory : start_directory;
 
     for (int i = 0; i < part_count; i++) {
+        STAT_INC(STAT_PATH_COMPONENTS);
         if (strcmp(parts[i], ".") == 0) {
             continue;
         }
         if (strcmp(parts[i], "..") == 0) {
-            if (current->parent) {
-                current = current->parent;
-            } else {
-                printf("ERROR: No parent directory available.\n");
-                return NULL;
+            if (!current->parent) {
+                return PF_ERR_INVALID_PATH; // No parent directory available
             }
+            current = current->parent;
             continue;
         }
 
-        bool found = false;
-        for (int j = 0; j < current->child_count; j++) {
-            if (strcmp(current->children[j]->item_name, parts[i]) == 0) {
-                current = current->children[j];
-                found = true;
-                break;
-            }
+        DirectoryItem *next = current->isFile ? NULL : find_directory_item(current, parts[i]);
+        if (!next) {
+            return i == part_count - 1 ? PF_ERR_NOT_FOUND : PF_ERR_PATH_NOT_FOUND;
         }
+        current = next;
+    }
 
-        if (!found) {
-            printf("ERROR: Part '%s' not found in directory '%s'.\n", parts[i], current->item_name);
-            return NULL;
-        }
+    *item = current;
+    return PF_OK;
+}
+
+DirectoryItem* find_item_by_path(FileSystem *fs, const char *path, DirectoryItem *start_directory) {
+    TRACE_BEGIN(trace_start_ns);
+    DirectoryItem *item = NULL;
+    resolve_path(fs, path, start_directory, &item);
+    TRACE_END(trace_start_ns, "path", "find_item_by_path");
+    return item;
+}
+
+// Resolves a path against the session's current directory
+static PfResult lookup(FileSystem *fs, Session *session, const char *path, DirectoryItem **item) {
+    *item = NULL;
+    if (!fs->fat_table1) {
+        return PF_ERR_NOT_FORMATTED;
+    }
+    if (!path || !*path) {
+        return PF_ERR_INVALID_PATH;
+    }
+
+    DirectoryItem *start = session && session->current_directory ? session->current_directory : &fs->root_directory;
+    TRACE_BEGIN(trace_start_ns);
+    PfResult result = resolve_path(fs, path, start, item);
+    TRACE_END(trace_start_ns, "path", "find_item_by_path");
+    return result;
+}
+
+// Resolves the directory that is to hold the last component of path and copies that component to name
+static PfResult lookup_parent(FileSystem *fs, Session *session, const char *path, DirectoryItem **parent, char *name) {
+    *parent = NULL;
+    if (!fs->fat_table1) {
+        return PF_ERR_NOT_FORMATTED;
+    }
+    if (!path || !*path) {
+        return PF_ERR_INVALID_PATH;
+    }
+
+    const char *last_slash = strrchr(path, '/');
+    const char *base = last_slash ? last_slash + 1 : path;
+    size_t len = strlen(base);
+    if (len == 0 || len >= MAX_ITEM_NAME_SIZE || strcmp(base, ".") == 0 || strcmp(base, "..") == 0) {
+        return PF_ERR_INVALID_PATH;
     }
+    memcpy(name, base, len + 1);
 
-    return current;
+    size_t dir_len = last_slash ? (size_t)(last_slash - path) : 0;
+    char dir_path[dir_len + 2];
+    if (!last_slash) {
+        strcpy(dir_path, ".");
+    } else if (dir_len == 0) {
+        strcpy(dir_path, "/");
+    } else {
+        memcpy(dir_path, path, dir_len);
+        dir_path[dir_len] = '\0';
+    }
+
+    PfResult result = lookup(fs, session, dir_path, parent);
+    if (result == PF_ERR_NOT_FOUND) {
+        return PF_ERR_PATH_NOT_FOUND;
+    }
+    if (result == PF_OK && (*parent)->isFile) {
+        return PF_ERR_NOT_A_DIRECTORY;
+    }
+    return result;
 }
 
 
 
 
 // Allocate a cluster
-int32_t allocate_cluster() {
-    for (int32_t i = 0; i < fs_description.fat_count; i++) {
-        if (fat_table1[i] == FAT_UNUSED) {
-            fat_table1[i] = FAT_FILE_END; // Mark the cluster as the end of the file
-            fat_table2[i] = FAT_FILE_END; // If a second FAT table is used
+int32_t allocate_cluster(FileSystem *fs) {
+    TRACE_BEGIN(trace_start_ns);
+    for (int32_t i = 0; i < fs->description.fat_count; i++) {
+        if (fs->fat_table1[i] == FAT_UNUSED) {
+            set_fat_entry(fs, i, FAT_FILE_END); // Mark the cluster as the end of the file
+            STAT_ADD(STAT_ALLOCATOR_SCANNED, i + 1);
+            STAT_INC(STAT_CLUSTERS_ALLOCATED);
+            TRACE_END(trace_start_ns, "alloc", "allocate_cluster");
             return i; // Return the cluster index
         }
     }
+    STAT_ADD(STAT_ALLOCATOR_SCANNED, fs->description.fat_count);
+    TRACE_END(trace_start_ns, "alloc", "allocate_cluster");
     return FAT_UNUSED; // No free clusters available
 }
 
-// Helper function for rm (remove)
-void rm_recursive(DirectoryItem *target) {
-    if (!target) return;
-
-    if (!target->isFile) {
-        for (int i = 0; i < target->child_count; i++) {
-            rm_recursive(target->children[i]);
-        }
+// True if item lies somewhere below dir
+static bool is_below(const DirectoryItem *item, const DirectoryItem *dir) {
+    for (const DirectoryItem *current = item->parent; current; current = current->parent) {
+        if (current == dir) return true;
     }
+    return false;
+}
 
-    int32_t cluster = target->start_cluster;
-    while (cluster != FAT_FILE_END) {
-        decrement_cluster_reference(cluster);
-
-        if (get_cluster_reference_count(cluster) == 0) {
-            // Uvolníme cluster, pokud žádná reference nezůstává
-            int32_t next_cluster = fat_table1[cluster];
-            fat_table1[cluster] = FAT_UNUSED;
-            fat_table2[cluster] = FAT_UNUSED;
-            cluster = next_cluster;
-        } else {
-            cluster = fat_table1[cluster];
+// Removes item from its parent's child list, keeping the order of the other children
+static void detach_item(DirectoryItem *item) {
+    DirectoryItem *parent = item->parent;
+    if (!parent) return;
+
+    for (int i = 0; i < parent->child_count; i++) {
+        if (parent->children[i] == item) {
+            for (int j = i; j < parent->child_count - 1; j++) {
+                parent->children[j] = parent->children[j + 1];
+            }
+            parent->children[--parent->child_count] = NULL;
+            return;
         }
     }
-
-    free(target);
 }
 
+// Drops one reference from every cluster of a file chain, clusters nobody uses any more are freed
+static void release_chain(FileSystem *fs, int32_t cluster) {
+    while (cluster >= 0 && cluster < fs->description.cluster_count) {
+        STAT_INC(STAT_FAT_LINKS);
+        int32_t next_cluster = fs->fat_table1[cluster];
 
-// Copy a file
-void copy_file(int32_t src_cluster, int32_t *dest_cluster, DirectoryItem *new_item) {
-    int32_t current_src = src_cluster;
-    int32_t prev_dest = FAT_UNUSED;
-    *dest_cluster = allocate_cluster();
-    size_t copied_size = 0; // Number of bytes copied
+        decrement_cluster_reference(fs, cluster);
+        if (get_cluster_reference_count(fs, cluster) == 0) {
+            free_cluster(fs, cluster);
+        }
 
-    if (*dest_cluster == FAT_UNUSED) {
-        fprintf(stderr, "Error: No free clusters available for copying the file.\n");
-        return;
+        cluster = next_cluster;
     }
+}
+
+// Length of a chain, -1 if it leaves the data region or loops
+int32_t chain_length(FileSystem *fs, int32_t cluster) {
+    int32_t length = 0;
+    while (cluster != FAT_FILE_END) {
+        if (cluster < 0 || cluster >= fs->description.cluster_count || length >= fs->description.cluster_count) {
+            return -1;
+        }
+        length++;
+        STAT_INC(STAT_FAT_LINKS);
+        cluster = fs->fat_table1[cluster];
+    }
+    return length;
+}
+
+static void fill_stat(FileSystem *fs, const DirectoryItem *item, PfStat *stat) {
+    strncpy(stat->name, item->item_name, MAX_ITEM_NAME_SIZE - 1);
+    stat->name[MAX_ITEM_NAME_SIZE - 1] = '\0';
+    stat->is_file = item->isFile;
+    stat->size = item->size;
+    stat->start_cluster = item->start_cluster;
+    stat->is_inline = item->is_inline;
+    stat->cluster_count = item->is_inline ? 0 : chain_length(fs, item->start_cluster);
+}
 
-    while (current_src != FAT_FILE_END) {
-        // Copy data from the source cluster to the destination cluster
-        void *data = read_cluster_data(current_src, fs_description.cluster_size);
-        write_cluster_data(*dest_cluster, data, fs_description.cluster_size);
-        free(data);
 
-        copied_size += fs_description.cluster_size;
+// Stores size bytes from a host file transfer or from a buffer (source == NULL) in a fresh chain.
+// Even an empty file owns one cluster, chains always end with FAT_FILE_END.
+static PfResult write_chain(FileSystem *fs, const char *data, Transfer *source, size_t size, int32_t *start_cluster) {
+    PfResult result = PF_OK;
+    int32_t previous_cluster = FAT_UNUSED;
+    size_t size_remaining = size;
+    size_t cluster_size = (size_t)fs->description.cluster_size;
+    const char *block = NULL;   // Part of the current transfer buffer not stored yet
+    size_t block_left = 0;
+
+    *start_cluster = FAT_UNUSED;
+    do {
+        int32_t cluster = allocate_cluster(fs);
+        if (cluster == FAT_UNUSED) {
+            result = PF_ERR_NO_SPACE;
+            break;
+        }
 
-        // Link the cluster to the FAT
-        if (prev_dest != FAT_UNUSED) {
-            fat_table1[prev_dest] = *dest_cluster;
+        if (previous_cluster != FAT_UNUSED) {
+            set_fat_entry(fs, previous_cluster, cluster);
+        } else {
+            *start_cluster = cluster;
         }
-        prev_dest = *dest_cluster;
-
-        // Move to the next cluster
-        current_src = fat_table1[current_src];
-        if (current_src != FAT_FILE_END) {
-            *dest_cluster = allocate_cluster();
-            if (*dest_cluster == FAT_UNUSED) {
-                fprintf(stderr, "Error: No free clusters available during copying.\n");
-                fat_table1[prev_dest] = FAT_FILE_END; // Properly terminate the FAT
+        previous_cluster = cluster;
+        set_fat_entry(fs, cluster, FAT_FILE_END);
+        increment_cluster_reference(fs, cluster); // Zvýšení reference na cluster
+
+        size_t bytes_to_copy = size_remaining < cluster_size ? size_remaining : cluster_size;
+        const void *chunk = data ? data + (size - size_remaining) : "";  // Empty files write nothing
+        if (source && bytes_to_copy > 0) {
+            // Transfer buffers hold whole clusters, only a changed host file can split one
+            if (block_left == 0) {
+                block = transfer_pull(source, &block_left);
+            }
+            if (!block || block_left < bytes_to_copy) {
+                result = PF_ERR_IO;
                 break;
             }
+            chunk = block;
+            block += bytes_to_copy;
+            block_left -= bytes_to_copy;
         }
-    }
 
-    // Terminate the FAT for the new file
-    fat_table1[prev_dest] = FAT_FILE_END;
+        write_cluster_data(fs, cluster, chunk, bytes_to_copy);
+        size_remaining -= bytes_to_copy;
+    } while (size_remaining > 0);
 
-    // Update the size of the destination file
-    if (new_item != NULL) {
-        new_item->size = copied_size;
+    if (result != PF_OK) {
+        release_chain(fs, *start_cluster);
+        *start_cluster = FAT_UNUSED;
     }
+    return result;
 }
 
-// Recursive directory copying
-void copy_directory(DirectoryItem *src, DirectoryItem *dest) {
-    for (int i = 0; i < src->child_count; i++) {
-        if (dest->child_count >= MAX_CHILDREN) {
-            fprintf(stderr, "Error: Destination directory has reached the maximum number of items.\n");
-            return;
-        }
-
-        DirectoryItem *src_child = src->children[i];
-        DirectoryItem *new_item = (DirectoryItem *)malloc(sizeof(DirectoryItem));
-        if (!new_item) {
-            fprintf(stderr, "Error: Memory allocation failed for new directory item.\n");
-            continue;
-        }
+// Adds a new file named file_name to dest_dir. Files up to inline_limit that fit behind their
+// name go into the directory record, everything else gets a cluster chain.
+static PfResult add_file(FileSystem *fs, DirectoryItem *dest_dir, const char *file_name, const char *data, Transfer *source, size_t size) {
+    if (find_directory_item(dest_dir, file_name)) {
+        return PF_ERR_EXISTS;
+    }
+    if (dest_dir->child_count >= MAX_CHILDREN) {
+        return PF_ERR_DIRECTORY_FULL;
+    }
+    if (size > INT32_MAX) {
+        return PF_ERR_NO_SPACE;
+    }
+    PfResult result = reserve_directory(fs, dest_dir, dest_dir->child_count + 1);
+    if (result != PF_OK) {
+        return result;
+    }
 
-        strncpy(new_item->item_name, src_child->item_name, MAX_ITEM_NAME_SIZE);
-        new_item->isFile = src_child->isFile;
-        new_item->size = src_child->size;
-        new_item->parent = dest;
-        new_item->child_count = 0;
+    DirectoryItem *new_item = calloc(1, sizeof(DirectoryItem));
+    if (!new_item) {
+        return PF_ERR_NO_MEMORY;
+    }
 
-        if (src_child->isFile) {
-            // Copy the file
-            copy_file(src_child->start_cluster, &new_item->start_cluster, new_item);
-        } else {
-            // Allocate a cluster for the new directory
-            new_item->start_cluster = allocate_cluster();
-            if (new_item->start_cluster == FAT_UNUSED) {
-                fprintf(stderr, "Error: No free clusters available for directory '%s'.\n", src_child->item_name);
-                free(new_item);
-                continue;
-            }
-            // Recursively copy the contents of the directory
-            copy_directory(src_child, new_item);
+    if (fs->inline_limit > 0 && size <= (size_t)fs->inline_limit && size <= (size_t)INLINE_CAPACITY(file_name)) {
+        const char *contents = data;
+        size_t length = size;
+        if (source && size > 0) {
+            contents = transfer_pull(source, &length);
         }
-
-        // Add the new item to the destination directory
-        dest->children[dest->child_count++] = new_item;
+        if (size > 0 && (!contents || length < size)) {
+            free(new_item);
+            return PF_ERR_IO;
+        }
+        if (size > 0) {
+            memcpy(new_item->inline_data, contents, size);
+        }
+        new_item->is_inline = true;
+        new_item->start_cluster = FAT_UNUSED;
+        STAT_ADD(STAT_BYTES_WRITTEN, size);
+    } else if ((result = write_chain(fs, data, source, size, &new_item->start_cluster)) != PF_OK) {
+        free(new_item);
+        return result;
     }
-}
 
+    strcpy(new_item->item_name, file_name);
+    new_item->isFile = true;
+    new_item->size = (int32_t)size;
+    new_item->parent = dest_dir;
+    new_item->child_count = 0;
+
+    dest_dir->children[dest_dir->child_count++] = new_item;
+    propagate_totals(dest_dir, item_totals(fs, new_item), 1);
+    name_index_add(fs, new_item);
+    store_directory(fs, dest_dir);
+    return PF_OK;
+}
 
 //////////////////////////////////////////////////////////////////////////////////////////////////
 
 
 /* PŘÍKAZY */
 
-// Hlavní funkce cp
-
-
-void cp(const char *src_path, const char *dest_path) {
-    DirectoryItem *src = find_item_by_path(src_path, current_directory);
-    if (!src || !src->isFile) {
-        fprintf(stderr, "Error: Source '%s' not found or is not a file.\n", src_path);
-        return;
+// Copies a file. The copy shares the clusters of the source, only the reference counts grow.
+PfResult pf_copy(FileSystem *fs, Session *session, const char *src_path, const char *dest_path) {
+    DirectoryItem *src;
+    PfResult result = lookup(fs, session, src_path, &src);
+    if (result != PF_OK) {
+        return result;
+    }
+    if (!src->isFile) {
+        return PF_ERR_NOT_A_FILE;
     }
 
-    // Rozdělení dest_path na adresář a název
-    char dest_dir_path[MAX_ITEM_NAME_SIZE];
-    char new_name[MAX_ITEM_NAME_SIZE] = "";
-
-    const char *last_slash = strrchr(dest_path, '/');
-    if (last_slash) {
-        strncpy(dest_dir_path, dest_path, last_slash - dest_path);
-        dest_dir_path[last_slash - dest_path] = '\0';
-        strncpy(new_name, last_slash + 1, MAX_ITEM_NAME_SIZE - 1);
-    } else {
-        strncpy(dest_dir_path, "", MAX_ITEM_NAME_SIZE - 1);
-        strncpy(new_name, dest_path, MAX_ITEM_NAME_SIZE - 1);
+    // An existing directory receives the copy under the source name
+    DirectoryItem *parent_dir;
+    char new_name[MAX_ITEM_NAME_SIZE];
+    DirectoryItem *existing;
+    if (lookup(fs, session, dest_path, &existing) == PF_OK) {
+        if (existing->isFile) {
+            return PF_ERR_EXISTS;
+        }
+        parent_dir = existing;
+        strcpy(new_name, src->item_name);
+    } else if ((result = lookup_parent(fs, session, dest_path, &parent_dir, new_name)) != PF_OK) {
+        return result;
     }
 
-    DirectoryItem *parent_dir = find_item_by_path(dest_dir_path, current_directory);
-    if (!parent_dir || parent_dir->isFile) {
-        fprintf(stderr, "Error: Destination directory '%s' not found or is not a directory.\n", dest_dir_path);
-        return;
+    // Inline contents cannot be shared, the copy gets its own
+    if (src->is_inline) {
+        return add_file(fs, parent_dir, new_name, src->inline_data, NULL, (size_t)src->size);
     }
 
+    if (find_directory_item(parent_dir, new_name)) {
+        return PF_ERR_EXISTS;
+    }
     if (parent_dir->child_count >= MAX_CHILDREN) {
-        fprintf(stderr, "Error: Destination directory '%s' is full.\n", dest_dir_path);
-        return;
+        return PF_ERR_DIRECTORY_FULL;
+    }
+    if ((result = reserve_directory(fs, parent_dir, parent_dir->child_count + 1)) != PF_OK) {
+        return result;
     }
 
-    DirectoryItem *new_item = (DirectoryItem *)malloc(sizeof(DirectoryItem));
+    DirectoryItem *new_item = (DirectoryItem *)calloc(1, sizeof(DirectoryItem));
     if (!new_item) {
-        fprintf(stderr, "Error: Memory allocation failed.\n");
-        return;
+        return PF_ERR_NO_MEMORY;
     }
 
-    strncpy(new_item->item_name, new_name[0] ? new_name : src->item_name, MAX_ITEM_NAME_SIZE - 1);
-    new_item->item_name[MAX_ITEM_NAME_SIZE - 1] = '\0';
-    new_item->isFile = src->isFile;
+    strcpy(new_item->item_name, new_name);
+    new_item->isFile = true;
     new_item->size = src->size;
     new_item->start_cluster = src->start_cluster;
     new_item->parent = parent_dir;
+    new_item->child_count = 0;
 
     // Zvýšení referencí clusterů
     int32_t current_cluster = src->start_cluster;
-    while (current_cluster != FAT_FILE_END) {
-        increment_cluster_reference(current_cluster);
-        current_cluster = fat_table1[current_cluster];
+    while (current_cluster >= 0 && current_cluster < fs->description.cluster_count) {
+        increment_cluster_reference(fs, current_cluster);
+        STAT_INC(STAT_FAT_LINKS);
+        current_cluster = fs->fat_table1[current_cluster];
     }
 
     parent_dir->children[parent_dir->child_count++] = new_item;
-
-    
-
-    printf("Successfully created a copy of '%s' at '%s'.\n", src_path, dest_path);
+    propagate_totals(parent_dir, item_totals(fs, new_item), 1);
+    name_index_add(fs, new_item);
+    store_directory(fs, parent_dir);
+    return PF_OK;
 }
 
 /*
@@ -589,281 +977,267 @@ Segmentation fault (core dumped)
 
 */
 
-void mv(const char *src_path, const char *dest_path) {
-    // Find the source item
-    DirectoryItem *src = find_item_by_path(src_path, current_directory);
-    if (!src) {
-        fprintf(stderr, "Error: Source item '%s' not found.\n", src_path);
-        return;
+// Moves an item into an existing directory, otherwise moves and renames it to dest_path
+PfResult pf_move(FileSystem *fs, Session *session, const char *src_path, const char *dest_path) {
+    DirectoryItem *src;
+    PfResult result = lookup(fs, session, src_path, &src);
+    if (result != PF_OK) {
+        return result;
+    }
+    if (!src->parent) {
+        return PF_ERR_INVALID_ARGUMENT; // The root cannot be moved
     }
 
-    // Find the destination directory
-    DirectoryItem *dest = find_item_by_path(dest_path, current_directory);
-
-    if (dest) {
-        // Destination exists: check if it's a directory
+    DirectoryItem *dest;
+    char new_name[MAX_ITEM_NAME_SIZE];
+    result = lookup(fs, session, dest_path, &dest);
+    if (result == PF_OK) {
         if (dest->isFile) {
-            fprintf(stderr, "Error: Destination '%s' is a file, not a directory.\n", dest_path);
-            return;
+            return PF_ERR_EXISTS;
         }
-
-        // Check if the destination directory can accommodate more items
-        if (dest->child_count >= MAX_CHILDREN) {
-            fprintf(stderr, "Error: Destination directory '%s' has too many items.\n", dest_path);
-            return;
+        strcpy(new_name, src->item_name);
+    } else if (result == PF_ERR_NOT_FOUND) {
+        if ((result = lookup_parent(fs, session, dest_path, &dest, new_name)) != PF_OK) {
+            return result;
         }
+    } else {
+        return result;
+    }
 
-        // Prevent moving into its own subtree
-        DirectoryItem *current = dest;
-        while (current) {
-            if (current == src) {
-                fprintf(stderr, "Error: Cannot move '%s' into its own subtree.\n", src_path);
-                return;
-            }
-            current = current->parent;
+    // Prevent moving into its own subtree
+    for (DirectoryItem *current = dest; current; current = current->parent) {
+        if (current == src) {
+            return PF_ERR_INVALID_ARGUMENT;
         }
+    }
 
-        // Remove the source from its parent's children list
-        if (src->parent) {
-            DirectoryItem *src_parent = src->parent;
-            for (int i = 0; i < src_parent->child_count; i++) {
-                if (src_parent->children[i] == src) {
-                    // Shift remaining children
-                    for (int j = i; j < src_parent->child_count - 1; j++) {
-                        src_parent->children[j] = src_parent->children[j + 1];
-                    }
-                    src_parent->children[--src_parent->child_count] = NULL;
-                    src_parent->size -= sizeof(DirectoryItem);
-                    break;
-                }
-            }
+    DirectoryItem *existing = find_directory_item(dest, new_name);
+    if (existing) {
+        return existing == src ? PF_OK : PF_ERR_EXISTS;
+    }
+    if (dest != src->parent && dest->child_count >= MAX_CHILDREN) {
+        return PF_ERR_DIRECTORY_FULL;
+    }
+    if (dest != src->parent && (result = reserve_directory(fs, dest, dest->child_count + 1)) != PF_OK) {
+        return result;
+    }
+
+    // A longer name leaves less room behind it, inline contents that no longer fit move to clusters
+    SubtreeTotals moved = item_totals(fs, src);
+    if (src->is_inline && src->size > INLINE_CAPACITY(new_name)) {
+        if ((result = write_chain(fs, src->inline_data, NULL, (size_t)src->size, &src->start_cluster)) != PF_OK) {
+            src->start_cluster = FAT_UNUSED;
+            return result;
         }
+        src->is_inline = false;
+    }
 
-        // Add the source to the destination directory
+    DirectoryItem *old_parent = src->parent;
+    propagate_totals(old_parent, moved, -1);
+    if (dest != old_parent) {
+        detach_item(src);
         src->parent = dest;
         dest->children[dest->child_count++] = src;
+        store_directory(fs, old_parent);
+    }
+    propagate_totals(dest, item_totals(fs, src), 1);
+    name_index_remove(fs, src);
+    strcpy(src->item_name, new_name);
+    name_index_add(fs, src);
+    store_directory(fs, dest);
+    return PF_OK;
+}
 
-        printf("Successfully moved '%s' to '%s'.\n", src_path, dest_path);
-
-    } else {
-        // Destination does not exist: rename the source
-        const char *new_name = strrchr(dest_path, '/');
-        if (new_name) {
-            new_name++; // Move past the '/'
-        } else {
-            new_name = dest_path;
-        }
-
-        // Ensure the new name does not conflict in the same directory
-        DirectoryItem *src_parent = src->parent;
-        for (int i = 0; i < src_parent->child_count; i++) {
-            if (strcmp(src_parent->children[i]->item_name, new_name) == 0) {
-                fprintf(stderr, "Error: A file or directory with the name '%s' already exists in the target location.\n", new_name);
-                return;
-            }
-        }
-
-        // Rename the item
-        strncpy(src->item_name, new_name, MAX_ITEM_NAME_SIZE - 1);
-        src->item_name[MAX_ITEM_NAME_SIZE - 1] = '\0';
+PfResult pf_stat(FileSystem *fs, Session *session, const char *path, PfStat *stat) {
+    if (session && session->published_root) {
+        return versions_stat(session->published_root, session->published_cwd, path, stat);
+    }
 
-        printf("Successfully renamed '%s' to '%s'.\n", src_path, dest_path);
+    DirectoryItem *item;
+    PfResult result = lookup(fs, session, path, &item);
+    if (result == PF_OK) {
+        fill_stat(fs, item, stat);
     }
+    return result;
 }
 
-
-
-void info(const char *path) {
-    // Předpokládejme, že current_directory ukazuje na aktuální adresář
-    DirectoryItem *item = find_item_by_path(path, current_directory);
-
-    if (item == NULL) {
-        printf("FILE NOT FOUND\n");
-        return;
+// Copies up to capacity cluster numbers of the item's chain, count receives the full length
+PfResult pf_chain(FileSystem *fs, Session *session, const char *path, int32_t *clusters, int32_t capacity, int32_t *count) {
+    DirectoryItem *item;
+    PfResult result = lookup(fs, session, path, &item);
+    if (result != PF_OK) {
+        return result;
     }
-    printf("Size: %dB\n",item->size);
-    printf("%s ", item->item_name);
-    int cluster = item->start_cluster;
 
-    // Validace clusteru
-    if (cluster < 0 || cluster >= fs_description.cluster_count) {
-        printf("INVALID START CLUSTER\n");
-        return;
+    *count = 0;
+    if (item->is_inline) {
+        return PF_OK;  // No clusters at all
     }
-
-    // Výpis clusterů
+    int32_t cluster = item->start_cluster;
     while (cluster != FAT_FILE_END) {
-        printf("%d", cluster);
-        cluster = fat_table1[cluster];
-        if (cluster != FAT_FILE_END) {
-            printf(",");
+        if (cluster < 0 || cluster >= fs->description.cluster_count || *count >= fs->description.cluster_count) {
+            return PF_ERR_CORRUPTED;
         }
+        if (*count < capacity) {
+            clusters[*count] = cluster;
+        }
+        (*count)++;
+        STAT_INC(STAT_FAT_LINKS);
+        cluster = fs->fat_table1[cluster];
     }
-
-    printf("\n");
+    return PF_OK;
 }
 
-
-
-
-void rm(const char *path) {
-    DirectoryItem *target = find_item_by_path(path, current_directory);
-    if (!target || !target->isFile) {
-        fprintf(stderr, "Error: File '%s' not found or is not a file.\n", path);
-        return;
+PfResult pf_unlink(FileSystem *fs, Session *session, const char *path) {
+    DirectoryItem *target;
+    PfResult result = lookup(fs, session, path, &target);
+    if (result != PF_OK) {
+        return result;
     }
-
-    int current_cluster = target->start_cluster;
-    while (current_cluster != FAT_FILE_END) {
-        int next_cluster = fat_table1[current_cluster];
-        
-        // Decrement reference count for the cluster
-        decrement_cluster_reference(current_cluster);
-
-        // If no references remain, free the cluster
-        if (get_cluster_reference_count(current_cluster) == 0) {
-            fat_table1[current_cluster] = FAT_UNUSED;
-            if (fat_table2) fat_table2[current_cluster] = FAT_UNUSED;
-            memset(&fs_data[current_cluster * fs_description.cluster_size], 0, fs_description.cluster_size);
-        }
-
-        current_cluster = next_cluster;
+    if (!target->isFile) {
+        return PF_ERR_NOT_A_FILE;
     }
 
-    // Update the size of the parent directory
-    DirectoryItem *parent = target->parent;
-    if (parent) {
-        for (int i = 0; i < parent->child_count; i++) {
-            if (parent->children[i] == target) {
-                parent->children[i] = parent->children[parent->child_count - 1];
-                parent->children[parent->child_count - 1] = NULL;
-                parent->child_count--;
-                break;
-            }
-        }
-
-        // Adjust the size of the parent directory
-        parent->size -= target->size;
-        if (parent->size < 0) {
-            parent->size = 0;  // Ensure size doesn't go negative
-        }
+    release_chain(fs, target->start_cluster);
+    detach_item(target);
 
-        
-    }
+    DirectoryItem *parent = target->parent;
+    propagate_totals(parent, item_totals(fs, target), -1);
+    name_index_remove(fs, target);
+    store_directory(fs, parent);
 
     free(target);
-    printf("File '%s' removed successfully.\n", path);
+    return PF_OK;
 }
 
-
-
-void rmdir(const char *path) {
-    if (!path || strlen(path) == 0) {
-        printf("INVALID PATH\n");
-        return;
+PfResult pf_rmdir(FileSystem *fs, Session *session, const char *path) {
+    DirectoryItem *target;
+    PfResult result = lookup(fs, session, path, &target);
+    if (result != PF_OK) {
+        return result;
     }
-
-    char *path_copy = strdup(path);
-    if (!path_copy) {
-        printf("MEMORY ALLOCATION ERROR\n");
-        return;
+    if (target->isFile) {
+        return PF_ERR_NOT_A_DIRECTORY;
     }
-
-    DirectoryItem *target = current_directory;
-    char *token = strtok(path_copy, "/");
-    while (token) {
-        DirectoryItem *next_dir = NULL;
-
-        // Find the child directory
-        for (int i = 0; i < target->child_count; i++) {
-            if (target->children[i] && !target->children[i]->isFile &&
-                strcmp(target->children[i]->item_name, token) == 0) {
-                next_dir = target->children[i];
-                break;
-            }
-        }
-
-        if (!next_dir) {
-            printf("FILE NOT FOUND\n");
-            free(path_copy);
-            return;
-        }
-
-        target = next_dir;
-        token = strtok(NULL, "/");
+    if (!target->parent) {
+        return PF_ERR_INVALID_ARGUMENT; // The root cannot be removed
     }
 
     // Ensure directory is empty
     if (target->child_count > 0) {
-        printf("NOT EMPTY\n");
-        free(path_copy);
-        return;
+        return PF_ERR_NOT_EMPTY;
     }
 
     // Free associated clusters
-    int cluster = target->start_cluster;
-    while (cluster != FAT_FILE_END) {
-        int next_cluster = fat_table1[cluster];
-        free_cluster(cluster);
+    int32_t cluster = target->start_cluster;
+    while (cluster >= 0 && cluster < fs->description.cluster_count) {
+        STAT_INC(STAT_FAT_LINKS);
+        int32_t next_cluster = fs->fat_table1[cluster];
+        free_cluster(fs, cluster);
         cluster = next_cluster;
     }
 
-    // Remove directory from parent's child list
+    if (session && session->current_directory == target) {
+        session->current_directory = target->parent;
+    }
+    detach_item(target);
+    propagate_totals(target->parent, target->totals, -1);
+    name_index_remove(fs, target);
+    store_directory(fs, target->parent);
+    versions_retire_subtree(fs, target);
+    free(target);
+    return PF_OK;
+}
+
+// Unlinks the subtree at once, its chains are released in one batch now or by the background
+// reclaimer. Detached items lose their parent, so index lookups no longer find them below any directory.
+PfResult pf_remove_tree(FileSystem *fs, Session *session, const char *path, bool background) {
+    DirectoryItem *target;
+    PfResult result = lookup(fs, session, path, &target);
+    if (result != PF_OK) {
+        return result;
+    }
+    if (!target->parent) {
+        return PF_ERR_INVALID_ARGUMENT; // The root cannot be removed
+    }
+
     DirectoryItem *parent = target->parent;
-    if (parent) {
-        for (int i = 0; i < parent->child_count; i++) {
-            if (parent->children[i] == target) {
-                parent->children[i] = parent->children[parent->child_count - 1];
-                parent->children[parent->child_count - 1] = NULL;
-                parent->child_count--;
-                break;
-            }
-        }
+    if (session && (session->current_directory == target || is_below(session->current_directory, target))) {
+        session->current_directory = parent;
     }
+    detach_item(target);
+    propagate_totals(parent, item_totals(fs, target), -1);
+    store_directory(fs, parent);
+    versions_retire_subtree(fs, target);
+    target->parent = NULL;
 
-    free(target);
-    free(path_copy);
-    printf("OK\n");
+    if (!background || !reclaim_later(fs, target)) {
+        rm_recursive(fs, target);
+    }
+    return PF_OK;
 }
-void mkdir(const char *path) {
-    if (!path || strlen(path) == 0 || strlen(path) >= MAX_ITEM_NAME_SIZE * MAX_CHILDREN) {
-        printf("INVALID PATH\n");
-        return;
+
+// Creates the directory and every missing directory on the way to it
+PfResult pf_mkdir(FileSystem *fs, Session *session, const char *path) {
+    if (!fs->fat_table1) {
+        return PF_ERR_NOT_FORMATTED;
+    }
+    if (!path || strlen(path) == 0) {
+        return PF_ERR_INVALID_PATH;
     }
 
     char parts[MAX_CHILDREN][MAX_ITEM_NAME_SIZE];
     int part_count = 0;
 
-    if (!split_path(path, parts, &part_count)) {
-        printf("INVALID PATH\n");
-        return;
+    if (!split_path(path, parts, &part_count) || part_count == 0) {
+        return PF_ERR_INVALID_PATH;
     }
 
-    DirectoryItem *current = (path[0] == '/') ? &root_directory : current_directory;
+    DirectoryItem *current = (path[0] == '/' || !session) ? &fs->root_directory : session->current_directory;
 
     for (int i = 0; i < part_count; i++) {
-        DirectoryItem *existing_item = find_directory_item(parts[i]);
+        if (strcmp(parts[i], ".") == 0 || strcmp(parts[i], "..") == 0) {
+            if (i == part_count - 1) {
+                return PF_ERR_EXISTS;
+            }
+            if (parts[i][1] == '.') {
+                if (!current->parent) {
+                    return PF_ERR_INVALID_PATH;
+                }
+                current = current->parent;
+            }
+            continue;
+        }
+
+        DirectoryItem *existing_item = find_directory_item(current, parts[i]);
         if (existing_item) {
             if (i == part_count - 1) {
-                printf("DIRECTORY OR FILE WITH NAME '%s' ALREADY EXISTS\n", parts[i]);
-                return;
-            } else {
-                current = existing_item;
-                continue;
+                return PF_ERR_EXISTS;
+            }
+            if (existing_item->isFile) {
+                return PF_ERR_NOT_A_DIRECTORY;
             }
+            current = existing_item;
+            continue;
+        }
+
+        if (current->child_count >= MAX_CHILDREN) {
+            return PF_ERR_DIRECTORY_FULL;
+        }
+        PfResult result = reserve_directory(fs, current, current->child_count + 1);
+        if (result != PF_OK) {
+            return result;
         }
 
         DirectoryItem *new_dir = calloc(1, sizeof(DirectoryItem));
         if (!new_dir) {
-            printf("MEMORY ALLOCATION ERROR\n");
-            return;
+            return PF_ERR_NO_MEMORY;
         }
 
-        int cluster = allocate_cluster();
-        if (cluster < 0) {
-            printf("Error: Unable to allocate cluster for '%s'.\n", parts[i]);
+        int32_t cluster = allocate_cluster(fs);
+        if (cluster == FAT_UNUSED) {
             free(new_dir);
-            return;
+            return PF_ERR_NO_SPACE;
         }
 
         // Initialize new directory
@@ -874,482 +1248,708 @@ void mkdir(const char *path) {
         new_dir->child_count = 0;
         new_dir->parent = current;
 
-        // Add to parent
-        if (current->child_count >= MAX_CHILDREN) {
-            printf("Error: Maximum number of children reached in '%s'.\n", current->item_name);
-            free(new_dir);
-            return;
-        }
         current->children[current->child_count++] = new_dir;
-
+        new_dir->totals = (SubtreeTotals){ 0, 0, 1 };
+        propagate_totals(current, new_dir->totals, 1);
+        name_index_add(fs, new_dir);
+        store_directory(fs, new_dir);  // Empty list in the new cluster
+        store_directory(fs, current);
         current = new_dir;
     }
 
-    printf("Directory '%s' created successfully.\n", path);
+    return PF_OK;
 }
 
-
-
-
-
-
-void ls(const char *name) {
-    if (current_directory == NULL) {
-        printf("Error: Current directory is not initialized.\n");
-        return;
+// Starts iterating over the children of a directory (NULL or "" = current directory)
+PfResult pf_opendir(FileSystem *fs, Session *session, const char *path, PfDir *dir) {
+    dir->fs = fs;
+    dir->directory = NULL;
+    dir->version = NULL;
+    dir->index = 0;
+    if (session && session->published_root) {
+        return versions_opendir(session->published_root, session->published_cwd, path && *path ? path : ".", &dir->version);
     }
 
-    DirectoryItem *target_directory = current_directory;
-
-    // If a directory name is provided, find the target directory
-    if (name != NULL && strlen(name) > 0) {
-        bool found = false;
-        for (int i = 0; i < current_directory->child_count; i++) {
-            DirectoryItem *child = current_directory->children[i];
-            if (child && !child->isFile && strcmp(child->item_name, name) == 0) {
-                target_directory = child;
-                found = true;
-                break;
-            }
-        }
-
-        if (!found) {
-            printf("Error: Directory '%s' not found.\n", name);
-            return;
-        }
+    DirectoryItem *target;
+    PfResult result = lookup(fs, session, path && *path ? path : ".", &target);
+    if (result != PF_OK) {
+        return result;
+    }
+    if (target->isFile) {
+        return PF_ERR_NOT_A_DIRECTORY;
     }
 
-    // Print the contents of the target directory
-    printf("Contents of directory '%s':\n", target_directory->item_name);
-    printf("%-13s %-5s %-10s\n", "Name", "Type", "Start Cluster");
-    printf("---------------------------------------------------\n");
+    dir->directory = target;
+    return PF_OK;
+}
 
-    if (target_directory->child_count == 0) {
-        printf("Directory is empty.\n");
-        return;
+PfResult pf_readdir(PfDir *dir, PfStat *entry) {
+    if (dir->version) {
+        return versions_readdir(dir->version, &dir->index, entry);
     }
-
-    for (int i = 0; i < target_directory->child_count; i++) {
-        DirectoryItem *child = target_directory->children[i];
-        if (child) { // Validate the pointer before accessing
-            printf("%-13s %-5s %-10d\n",
-                   child->item_name,
-                   child->isFile ? "File" : "Dir",
-                   child->start_cluster);
-        } else {
-            printf("Error: Invalid directory entry at index %d.\n", i);
+    while (dir->index < dir->directory->child_count) {
+        const DirectoryItem *child = dir->directory->children[dir->index++];
+        if (child) {
+            fill_stat(dir->fs, child, entry);
+            return PF_OK;
         }
     }
+    return PF_END;
 }
 
+PfResult pf_chdir(FileSystem *fs, Session *session, const char *path) {
+    DirectoryItem *target;
+    PfResult result = lookup(fs, session, path, &target);
+    if (result != PF_OK) {
+        return result;
+    }
+    if (target->isFile) {
+        return PF_ERR_NOT_A_DIRECTORY;
+    }
 
+    session->current_directory = target;
+    return PF_OK;
+}
 
+// Writes the absolute path of an item into out ("/" for the root), returns false if it does not fit
+bool get_item_path(const DirectoryItem *item, char *out, size_t size) {
+    if (size < 2) return false;
 
-void cd(const char *path) {
-    if (path == NULL || strlen(path) == 0) {
-        printf("INVALID PATH\n");
-        return;
+    // Build the path backwards from the end of the buffer, then move it to the front
+    size_t pos = size - 1;
+    out[pos] = '\0';
+    for (; item && item->parent; item = item->parent) {
+        size_t len = strlen(item->item_name);
+        if (pos < len + 1) return false;
+        pos -= len;
+        memcpy(out + pos, item->item_name, len);
+        out[--pos] = '/';
     }
 
-    DirectoryItem *target = (path[0] == '/') ? &root_directory : current_directory;
+    if (pos == size - 1) {
+        strcpy(out, "/");
+    } else {
+        memmove(out, out + pos, size - pos);
+    }
+    return true;
+}
 
-    char temp_path[MAX_ITEM_NAME_SIZE];
-    strncpy(temp_path, path, MAX_ITEM_NAME_SIZE - 1);
-    temp_path[MAX_ITEM_NAME_SIZE - 1] = '\0';
-
-    char *token = strtok(temp_path, "/");
-    while (token != NULL) {
-        if (strcmp(token, ".") == 0) {
-        } else if (strcmp(token, "..") == 0) {
-            if (target->parent != NULL) {
-                target = target->parent;
-            } else {
-                printf("NO PARENT DIRECTORY\n");
-                return;
-            }
-        } else {
-            DirectoryItem *next_dir = NULL;
-            for (int i = 0; i < target->child_count; i++) {
-                if (!target->children[i]->isFile && strcmp(target->children[i]->item_name, token) == 0) {
-                    next_dir = target->children[i];
-                    break;
-                }
-            }
-            if (next_dir == NULL) {
-                printf("DIRECTORY '%s' NOT FOUND\n", token);
-                return;
-            }
-            target = next_dir;
+// Makes the directory at cwd_path the current directory of the session, falls back to the root
+// when another session removed it in the meantime
+void session_enter(Session *session, const char *cwd_path) {
+    FileSystem *fs = session->fs;
+    DirectoryItem *cwd = &fs->root_directory;
+    if (strcmp(cwd_path, "/") != 0) {
+        cwd = find_item_by_path(fs, cwd_path, &fs->root_directory);
+        if (!cwd || cwd->isFile) {
+            fprintf(SESSION_OUT(session), "Working directory '%s' no longer exists, changed to '/'.\n", cwd_path);
+            cwd = &fs->root_directory;
         }
-        token = strtok(NULL, "/");
     }
-
-    current_directory = target;
-    printf("OK\n");
+    session->current_directory = cwd;
 }
 
-
-void pwd() {
-    if (current_directory == NULL) {
-        printf("Current directory is NULL.\n");
-        return;
+// Stores the current directory of the session as a path, sessions keep no pointers between commands
+void session_leave(Session *session, char *cwd_path, size_t size) {
+    if (!get_item_path(session->current_directory, cwd_path, size)) {
+        strcpy(cwd_path, "/");
     }
+}
 
-    char path[1024] = "";
-    DirectoryItem *dir = current_directory;
-
-    while (dir != NULL) {
-        if (dir->item_name[0] == '\0') {  // Check for invalid directory names
-            fprintf(stderr, "Invalid directory name detected.\n");
-            break;
-        }
 
-        char temp[256];
-        if (snprintf(temp, sizeof(temp), "/%s", dir->item_name) >= (int)sizeof(temp)) {
-            fprintf(stderr, "Path segment too long: %s\n", dir->item_name);
-            break;
+PfResult pf_getcwd(FileSystem *fs, Session *session, char *buffer, size_t size) {
+    if (session->published_root) {
+        if (strlen(session->published_cwd) >= size) {
+            return PF_ERR_INVALID_ARGUMENT; // Buffer too small
         }
-
-        char new_path[1024];
-        if (snprintf(new_path, sizeof(new_path), "%s%s", temp, path) >= (int)sizeof(new_path)) {
-            fprintf(stderr, "Path too long.\n");
-            break;
-        }
-
-        strncpy(path, new_path, sizeof(path) - 1);
-        path[sizeof(path) - 1] = '\0';
-
-        dir = dir->parent;  // Move to the parent directory
+        strcpy(buffer, session->published_cwd);
+        return PF_OK;
     }
-
-    printf("%s\n", path[0] ? path : "/");
+    if (!fs->fat_table1) {
+        return PF_ERR_NOT_FORMATTED;
+    }
+    if (!get_item_path(session->current_directory, buffer, size)) {
+        return PF_ERR_INVALID_ARGUMENT; // Buffer too small
+    }
+    return PF_OK;
 }
 
-void check() {
-
-    // File and directory integrity check
-    for (int i = 0; i < current_directory->child_count; i++) {
-        DirectoryItem *item = current_directory->children[i];
+typedef struct CheckWalk {
+    FileSystem *fs;
+    PfCheckCallback callback;
+    void *context;
+    int problems;
+} CheckWalk;
 
-        if (item->isFile) {
-            int cluster = item->start_cluster;
-            int cluster_count = 0;
-            bool corrupted = false;
+// File and directory integrity check, damaged directories are not descended into
+static TreeAction check_item(TreeVisit *visit, void *context) {
+    CheckWalk *check = context;
+    FileSystem *fs = check->fs;
+    DirectoryItem *item = visit->item;
+    if (visit->depth == 0) {
+        return TREE_CONTINUE;  // The starting directory itself is not reported
+    }
 
-            while (cluster != FAT_FILE_END) {
-                if (cluster < 0 || cluster >= fs_description.cluster_count) {
-                    printf("Error: File '%s' has an invalid cluster (%d).\n", item->item_name, cluster);
-                    corrupted = true;
-                    break;
-                }
-                cluster = fat_table1[cluster];
-                cluster_count++;
-            }
+    PfCheckEntry entry = { item->item_name, item->isFile, PF_CHECK_INTACT, item->start_cluster, item->size, 0 };
 
-            int expected_size = cluster_count * fs_description.cluster_size;
-            if (!corrupted && expected_size < item->size) {
-                printf("Error: File '%s' has an incorrect size. Actual: %d, Expected: %d.\n", 
-                       item->item_name, item->size, expected_size);
-                corrupted = true;
+    if (item->isFile && item->is_inline) {
+        entry.expected_size = INLINE_CAPACITY(item->item_name);
+        if (item->size < 0 || item->size > entry.expected_size) {
+            entry.status = PF_CHECK_BAD_SIZE;
+        }
+    } else if (item->isFile) {
+        int32_t cluster = item->start_cluster;
+        int32_t cluster_count = 0;
+
+        while (cluster != FAT_FILE_END) {
+            if (cluster < 0 || cluster >= fs->description.cluster_count || cluster_count >= fs->description.cluster_count) {
+                entry.status = PF_CHECK_BAD_CLUSTER;
+                entry.cluster = cluster;
+                break;
             }
-
-            if (!corrupted) {
-                printf("File '%s' is intact.\n", item->item_name);
+            if (!verify_cluster_checksum(fs, cluster)) {
+                entry.status = PF_CHECK_BAD_CHECKSUM;
+                entry.cluster = cluster;
+                break;
             }
+            STAT_INC(STAT_FAT_LINKS);
+            cluster = fs->fat_table1[cluster];
+            cluster_count++;
+        }
 
-        } else { // Directory check
-            if (item->start_cluster < 0 || item->start_cluster >= fs_description.cluster_count) {
-                printf("Error: Directory '%s' has an invalid start cluster (%d).\n", item->item_name, item->start_cluster);
-            } else {
-                printf("Directory '%s' is intact.\n", item->item_name);
-            }
+        entry.expected_size = cluster_count * fs->description.cluster_size;
+        if (entry.status == PF_CHECK_INTACT && entry.expected_size < item->size) {
+            entry.status = PF_CHECK_BAD_SIZE;
         }
+    } else if (item->start_cluster < 0 || item->start_cluster >= fs->description.cluster_count) {
+        entry.status = PF_CHECK_BAD_CLUSTER;
+    } else if (!verify_cluster_checksum(fs, item->start_cluster)) {
+        entry.status = PF_CHECK_BAD_CHECKSUM;
     }
 
-    printf("Filesystem check completed.\n");
+    if (entry.status != PF_CHECK_INTACT) {
+        check->problems++;
+    }
+    if (check->callback) {
+        check->callback(&entry, check->context);
+    }
+    return entry.status == PF_CHECK_INTACT ? TREE_CONTINUE : TREE_SKIP;
 }
 
-void bug(const char *name) {
-    printf("Corrupting filesystem...\n");
-
-    for (int i = 0; i < current_directory->child_count; i++) {
-        DirectoryItem *item = current_directory->children[i];
-        if (strcmp(item->item_name, name) == 0) {
-            if (item->isFile) {
-                int original_cluster = fat_table1[item->start_cluster];
-                fat_table1[item->start_cluster] = -999; // Corrupt FAT entry
-
-                item->start_cluster = -999; // Corrupt start_cluster
+// Validates the chains of every item below the current directory, the callback sees every item
+PfResult pf_check(FileSystem *fs, Session *session, PfCheckCallback callback, void *context, int *problems) {
+    if (!fs->fat_table1) {
+        return PF_ERR_NOT_FORMATTED;
+    }
 
-                printf("File '%s' has been corrupted. Original value: %d.\n", name, original_cluster);
-            } else {
-                int original_cluster = item->start_cluster;
-                item->start_cluster = -999;
-                item->child_count = -1; // Corrupt child count
+    CheckWalk check = { fs, callback, context, 0 };
+    tree_walk(session ? session->current_directory : &fs->root_directory, check_item, NULL, &check);
+    int found = check.problems;
+    if (problems) {
+        *problems = found;
+    }
+    return found > 0 ? PF_ERR_CORRUPTED : PF_OK;
+}
 
-                printf("Directory '%s' has been corrupted. Original cluster value: %d.\n", name, original_cluster);
-            }
+#define FIND_PATH_SIZE 4096
+#define FIND_MAX_THREADS 8      // Workers of the tree walk behind find patterns the index cannot answer
+
+// Items found by one walk or index lookup
+typedef struct FindMatches {
+    DirectoryItem **items;
+    size_t count;
+    size_t capacity;
+    bool failed;                // Out of memory, some matches are missing
+} FindMatches;
+
+static void add_match(FindMatches *matches, DirectoryItem *item) {
+    if (matches->count == matches->capacity) {
+        size_t capacity = matches->capacity ? matches->capacity * 2 : 64;
+        DirectoryItem **items = realloc(matches->items, capacity * sizeof(DirectoryItem *));
+        if (!items) {
+            matches->failed = true;
             return;
         }
+        matches->items = items;
+        matches->capacity = capacity;
     }
-
-    printf("Error: File or directory '%s' not found.\n", name);
+    matches->items[matches->count++] = item;
 }
 
-void incp(const char *source, const char *destination) {
-    FILE *source_file = fopen(source, "rb");
-    if (!source_file) {
-        printf("FILE NOT FOUND: '%s' cannot be opened or does not exist.\n", source);
-        return;
+typedef struct FindVisit {
+    const char *pattern;
+    FindMatches *matches;
+} FindVisit;
+
+static TreeAction match_item(TreeVisit *visit, void *context) {
+    FindVisit *find = context;
+    if (visit->depth > 0 && fnmatch(find->pattern, visit->item->item_name, 0) == 0) {
+        add_match(find->matches, visit->item);
     }
+    return TREE_CONTINUE;
+}
 
-    fseek(source_file, 0, SEEK_END);
-    size_t source_size = ftell(source_file);
-    fseek(source_file, 0, SEEK_SET);
+// Adds the matches below dir in tree order, dir itself is not matched
+static void walk_matches(DirectoryItem *dir, const char *pattern, FindMatches *matches) {
+    FindVisit find = { pattern, matches };
+    if (tree_walk(dir, match_item, NULL, &find) == PF_ERR_NO_MEMORY) {
+        matches->failed = true;
+    }
+}
 
-    char path[256], file_name[MAX_ITEM_NAME_SIZE];
-    const char *last_slash = strrchr(destination, '/');
-    if (last_slash) {
-        strncpy(path, destination, last_slash - destination);
-        path[last_slash - destination] = '\0';
-        strncpy(file_name, last_slash + 1, sizeof(file_name) - 1);
-        file_name[sizeof(file_name) - 1] = '\0';
-    } else {
-        strcpy(path, ".");
-        strncpy(file_name, destination, sizeof(file_name) - 1);
-        file_name[sizeof(file_name) - 1] = '\0';
+// The children of top are handed out one at a time, each worker walks the subtrees it takes
+typedef struct FindWalk {
+    DirectoryItem *top;
+    const char *pattern;
+    int next;                   // Next child of top to take, shared by the workers
+    FindMatches *per_child;     // Matches in and below each child of top
+} FindWalk;
+
+static void *find_worker(void *arg) {
+    FindWalk *walk = arg;
+    int i;
+    while ((i = __atomic_fetch_add(&walk->next, 1, __ATOMIC_RELAXED)) < walk->top->child_count) {
+        DirectoryItem *child = walk->top->children[i];
+        if (!child) continue;
+        if (fnmatch(walk->pattern, child->item_name, 0) == 0) {
+            add_match(&walk->per_child[i], child);
+        }
+        if (!child->isFile) {
+            walk_matches(child, walk->pattern, &walk->per_child[i]);
+        }
     }
+    return NULL;
+}
+
+// Walks the subtree of dir with up to FIND_MAX_THREADS threads, the caller holds fs->lock
+static void walk_parallel(DirectoryItem *dir, const char *pattern, FindMatches *matches) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int threads = cpus < 1 ? 1 : cpus > FIND_MAX_THREADS ? FIND_MAX_THREADS : (int)cpus;
+    if (threads > dir->child_count) threads = dir->child_count;
 
-    DirectoryItem *dest_dir = find_item_by_path(path, &root_directory);
-    
-    if (!dest_dir || dest_dir->isFile) {
-        printf("PATH NOT FOUND: '%s' is not a directory or does not exist.\n", path);
-        fclose(source_file);
+    FindMatches *per_child = threads > 1 ? calloc((size_t)dir->child_count, sizeof(FindMatches)) : NULL;
+    if (!per_child) {
+        walk_matches(dir, pattern, matches);
         return;
     }
 
-    if (dest_dir->child_count >= MAX_CHILDREN) {
-        printf("ERROR: Directory '%s' has too many items.\n", path);
-        fclose(source_file);
-        return;
+    FindWalk walk = { dir, pattern, 0, per_child };
+    pthread_t workers[FIND_MAX_THREADS];
+    int started = 0;
+    while (started < threads - 1 && pthread_create(&workers[started], NULL, find_worker, &walk) == 0) {
+        started++;
+    }
+    find_worker(&walk);  // The calling thread takes its share too
+    for (int i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
     }
-    
 
-    DirectoryItem *existing_item = NULL;
-    for (int i = 0; i < dest_dir->child_count; i++) {
-        if (strcmp(dest_dir->children[i]->item_name, file_name) == 0) {
-            existing_item = dest_dir->children[i];
-            break;
+    for (int i = 0; i < dir->child_count; i++) {
+        for (size_t j = 0; j < per_child[i].count; j++) {
+            add_match(matches, per_child[i].items[j]);
         }
+        matches->failed |= per_child[i].failed;
+        free(per_child[i].items);
     }
+    free(per_child);
+}
 
-    if (existing_item) {
-        printf("ERROR: File '%s' already exists in '%s'.\n", file_name, path);
-        fclose(source_file);
-        return;
+// Sorts "<kind><path>" strings by the path
+static int compare_paths(const void *a, const void *b) {
+    return strcmp(*(char *const *)a + 1, *(char *const *)b + 1);
+}
+
+// Exact names come from the name index, "*.ext" from the extension index, every other pattern
+// walks the tree. Candidates are always checked with fnmatch, buckets are shared.
+PfResult pf_find(FileSystem *fs, Session *session, const char *dir_path, const char *pattern, PfFindCallback callback, void *context) {
+    DirectoryItem *dir;
+    PfResult result = lookup(fs, session, dir_path, &dir);
+    if (result != PF_OK) {
+        return result;
+    }
+    if (dir->isFile) {
+        return PF_ERR_NOT_A_DIRECTORY;
+    }
+    if (!pattern || !*pattern) {
+        return PF_ERR_INVALID_ARGUMENT;
     }
 
-    int32_t start_cluster = FAT_UNUSED;
-    int32_t previous_cluster = FAT_UNUSED;
-    size_t size_remaining = source_size;
-    char buffer[fs_description.cluster_size];
-
-    while (size_remaining > 0) {
-        int32_t free_cluster = allocate_cluster();
-        if (free_cluster == FAT_UNUSED) {
-            printf("Error: Not enough disk space.\n");
-            fclose(source_file);
-            return;
-        }
+    FindMatches matches = { NULL, 0, 0, false };
+    bool wildcard = strpbrk(pattern, "*?[\\") != NULL;
+    const char *extension = strncmp(pattern, "*.", 2) == 0 ? pattern + 2 : NULL;
+    if (extension && (!*extension || strpbrk(extension, "*?[\\.") != NULL)) {
+        extension = NULL;
+    }
 
-        if (previous_cluster != FAT_UNUSED) {
-            fat_table1[previous_cluster] = free_cluster;
+    if (fs->name_index && (!wildcard || extension)) {
+        if (!wildcard) {
+            for (DirectoryItem *item = name_index_names(fs, pattern); item; item = item->name_next) {
+                if (strcmp(item->item_name, pattern) == 0 && is_below(item, dir)) {
+                    add_match(&matches, item);
+                }
+            }
         } else {
-            start_cluster = free_cluster;
-        }
-        previous_cluster = free_cluster;
-        fat_table1[free_cluster] = FAT_FILE_END;
-
-        size_t bytes_to_copy = size_remaining < (size_t)fs_description.cluster_size ? size_remaining : (size_t)fs_description.cluster_size;
-        size_t bytes_read = fread(buffer, 1, bytes_to_copy, source_file);
-        if (bytes_read != bytes_to_copy) {
-            if (feof(source_file)) {
-                printf("End of file reached.\n");
-            } else {
-                fclose(source_file);
-                return;
+            for (DirectoryItem *item = name_index_extensions(fs, extension); item; item = item->extension_next) {
+                if (fnmatch(pattern, item->item_name, 0) == 0 && is_below(item, dir)) {
+                    add_match(&matches, item);
+                }
             }
         }
-
-        write_cluster_data(free_cluster, buffer, bytes_read);
-        increment_cluster_reference(free_cluster); // Zvýšení reference na cluster
-        size_remaining -= bytes_read;
+    } else {
+        walk_parallel(dir, pattern, &matches);
+    }
+
+    // Report in path order, whichever way the matches were found
+    char **paths = matches.count ? malloc(matches.count * sizeof(char *)) : NULL;
+    size_t path_count = 0;
+    bool complete = !matches.failed && (matches.count == 0 || paths);
+    char path[FIND_PATH_SIZE];
+    for (size_t i = 0; paths && i < matches.count; i++) {
+        if (!get_item_path(matches.items[i], path, sizeof(path))) continue;  // Too deep to print
+        char *copy = malloc(strlen(path) + 2);
+        if (!copy) {
+            complete = false;
+            break;
+        }
+        copy[0] = matches.items[i]->isFile ? 'f' : 'd';  // Kind travels in front of the path
+        strcpy(copy + 1, path);
+        paths[path_count++] = copy;
     }
+    free(matches.items);
 
-    fclose(source_file);
-
-    DirectoryItem *new_item = malloc(sizeof(DirectoryItem));
-    if (!new_item) {
-        printf("Error: Failed to allocate memory for the new file.\n");
-        return;
+    if (paths) {
+        qsort(paths, path_count, sizeof(char *), compare_paths);
+        for (size_t i = 0; i < path_count; i++) {
+            callback(paths[i] + 1, paths[i][0] == 'f', context);
+            free(paths[i]);
+        }
+        free(paths);
     }
+    return complete ? PF_OK : PF_ERR_NO_MEMORY;
+}
 
-    strncpy(new_item->item_name, file_name, MAX_ITEM_NAME_SIZE);
-    new_item->isFile = true;
-    new_item->size = source_size;
-    new_item->start_cluster = start_cluster;
-    new_item->parent = dest_dir;
-    new_item->child_count = 0;
+#define DU_PATH_SIZE 4096
+
+typedef struct DuWalk {
+    char *path;                 // Path of the item being visited, DU_PATH_SIZE bytes
+    int max_depth;
+    PfDuCallback callback;
+    void *context;
+} DuWalk;
+
+// Appends the name of a directory to the path of its parent. data holds the length of the
+// directory's path, 0 if it is too long to report.
+static TreeAction du_enter(TreeVisit *visit, void *context) {
+    DuWalk *du = context;
+    const DirectoryItem *dir = visit->item;
+    if (dir->isFile) {
+        return TREE_SKIP;
+    }
+    if (visit->depth == 0) {
+        visit->data = (void *)(uintptr_t)strlen(du->path);
+    } else {
+        size_t length = (size_t)(uintptr_t)visit->parent_data;
+        size_t name_length = strlen(dir->item_name);
+        if (length + 1 + name_length >= DU_PATH_SIZE) {
+            return TREE_SKIP;
+        }
+        if (length > 1) du->path[length++] = '/';  // The root is just "/"
+        memcpy(du->path + length, dir->item_name, name_length + 1);
+        visit->data = (void *)(uintptr_t)(length + name_length);
+    }
+    return du->max_depth < 0 || visit->depth < du->max_depth ? TREE_CONTINUE : TREE_SKIP;
+}
 
-    dest_dir->children[dest_dir->child_count++] = new_item;
-    printf("File '%s' was successfully copied to '%s'.\n", file_name, path);
+static TreeAction du_report(TreeVisit *visit, void *context) {
+    DuWalk *du = context;
+    const DirectoryItem *dir = visit->item;
+    size_t length = (size_t)(uintptr_t)visit->data;
+    if (dir->isFile || length == 0) {
+        return TREE_CONTINUE;
+    }
+    du->path[length] = '\0';  // Cut off what the children appended
+    PfDuEntry entry = { du->path, visit->depth, false, dir->totals.bytes, dir->totals.files, dir->totals.clusters };
+    du->callback(&entry, du->context);
+    return TREE_CONTINUE;
 }
 
-void outcp(const char *source_path, const char *destination_path) {
-    DirectoryItem *source_item = find_item_by_path(source_path, current_directory);
+// Reports the directories below dir deepest first. Totals are maintained by every mutation, so
+// only the directories that are printed (and their child lists) are visited.
+static void du_subtree(DirectoryItem *dir, char *path, int max_depth, PfDuCallback callback, void *context) {
+    DuWalk du = { path, max_depth, callback, context };
+    tree_walk(dir, du_enter, du_report, &du);
+}
 
-    if (!source_item) {
-        printf("FILE NOT FOUND\n");
-        return;
+PfResult pf_du(FileSystem *fs, Session *session, const char *path, int max_depth, PfDuCallback callback, void *context) {
+    DirectoryItem *item;
+    PfResult result = lookup(fs, session, path, &item);
+    if (result != PF_OK) {
+        return result;
     }
 
-    if (!source_item->isFile) {
-        printf("SOURCE IS NOT A FILE\n");
-        return;
+    char buffer[DU_PATH_SIZE];
+    if (!get_item_path(item, buffer, sizeof(buffer))) {
+        return PF_ERR_INVALID_PATH;
     }
-
-    FILE *dest_file = fopen(destination_path, "wb");
-    if (!dest_file) {
-        perror("PATH NOT FOUND");
-        return;
+    if (item->isFile) {
+        SubtreeTotals totals = item_totals(fs, item);
+        PfDuEntry entry = { buffer, 0, true, totals.bytes, totals.files, totals.clusters };
+        callback(&entry, context);
+        return PF_OK;
     }
+    du_subtree(item, buffer, max_depth, callback, context);
+    return PF_OK;
+}
 
-    int32_t cluster = source_item->start_cluster;
-    int32_t bytes_remaining = source_item->size;
-
-    while (cluster != FAT_FILE_END && bytes_remaining > 0) {
-        int32_t bytes_to_read = (bytes_remaining < fs_description.cluster_size) 
-                                ? bytes_remaining 
-                                : fs_description.cluster_size;
-
-        void *buffer = read_cluster_data(cluster, bytes_to_read);
-        if (!buffer) {
-            fprintf(stderr, "Error reading cluster %d.\n", cluster);
-            fclose(dest_file);
-            return;
-        }
+// Zeroes every freed cluster that is still waiting for it
+PfResult pf_trim(FileSystem *fs, int32_t *trimmed) {
+    if (!fs->fat_table1) {
+        return PF_ERR_NOT_FORMATTED;
+    }
 
-        size_t bytes_written = fwrite(buffer, 1, bytes_to_read, dest_file);
-        if (bytes_written != (size_t)bytes_to_read) {
-            fprintf(stderr, "Error writing to destination file.\n");
-            free(buffer);
-            fclose(dest_file);
-            return;
+    *trimmed = 0;
+    for (int32_t i = 0; i < fs->description.cluster_count && fs->zero_pending_count > 0; i++) {
+        if (fs->zero_pending[i]) {
+            zero_cluster(fs, i);
+            (*trimmed)++;
         }
+    }
+    return PF_OK;
+}
 
-        free(buffer);
-        cluster = fat_table1[cluster];
-        bytes_remaining -= bytes_to_read;
+PfResult pf_set_checksums(FileSystem *fs, bool enabled) {
+    if (!fs->fat_table1) {
+        return PF_ERR_NOT_FORMATTED;
     }
 
-    fclose(dest_file);
-    printf("OK\n");
+    if (!enabled) {
+        free(fs->cluster_checksums);
+        fs->cluster_checksums = NULL;
+        fs->description.features &= ~FS_FEATURE_CHECKSUMS;
+        return PF_OK;
+    }
+    if (fs->cluster_checksums) {
+        return PF_OK;
+    }
+    return enable_cluster_checksums(fs) ? PF_OK : PF_ERR_NO_MEMORY;
 }
 
+PfResult pf_set_inline_limit(FileSystem *fs, int32_t limit) {
+    if (limit < 0 || limit > INLINE_CAPACITY("")) {
+        return PF_ERR_INVALID_ARGUMENT;
+    }
+    fs->inline_limit = limit;
+    return PF_OK;
+}
 
+PfResult pf_checksum_status(FileSystem *fs, bool *enabled, uint64_t *mismatches) {
+    if (!fs->fat_table1) {
+        return PF_ERR_NOT_FORMATTED;
+    }
 
-void cat(const char *source_path) {
-    DirectoryItem *source_item = find_item_by_path(source_path, current_directory);
+    *enabled = fs->cluster_checksums != NULL;
+    *mismatches = __atomic_load_n(&fs->checksum_mismatches, __ATOMIC_RELAXED);
+    return PF_OK;
+}
 
-    if (!source_item) {
-        printf("FILE NOT FOUND\n");
-        return;
+// Breaks the chain of a child of the current directory, used to test check
+PfResult pf_corrupt(FileSystem *fs, Session *session, const char *name, bool *is_file, int32_t *original) {
+    if (!fs->fat_table1) {
+        return PF_ERR_NOT_FORMATTED;
     }
 
-    if (source_item->isFile == false) {
-        printf("SOURCE IS NOT A FILE\n");
-        return;
+    DirectoryItem *item = find_directory_item(session->current_directory, name);
+    if (!item) {
+        return PF_ERR_NOT_FOUND;
     }
 
-    int32_t cluster = source_item->start_cluster;
-    int32_t bytes_remaining = source_item->size;
-
-    while (cluster != FAT_FILE_END && bytes_remaining > 0) {
-        int32_t bytes_to_read = (bytes_remaining < fs_description.cluster_size) ? bytes_remaining : fs_description.cluster_size;
-
-        void *buffer = read_cluster_data(cluster, bytes_to_read);
-        if (!buffer) {
-            fprintf(stderr, "Error reading cluster %d.\n", cluster);
-            return;
+    *is_file = item->isFile;
+    if (item->is_inline) {
+        *original = item->size;
+        propagate_totals(session->current_directory, item_totals(fs, item), -1);
+        item->size = MAX_ITEM_NAME_SIZE; // More than fits behind the name
+        propagate_totals(session->current_directory, item_totals(fs, item), 1);
+    } else if (item->isFile) {
+        if (item->start_cluster < 0 || item->start_cluster >= fs->description.cluster_count) {
+            return PF_ERR_CORRUPTED; // Already broken
         }
+        *original = fs->fat_table1[item->start_cluster];
+        set_fat_entry(fs, item->start_cluster, -999); // Corrupt FAT entry, the mirror too so load cannot repair it
 
-        fwrite(buffer, 1, bytes_to_read, stdout);
-
-        free(buffer);
-
-        cluster = fat_table1[cluster];
-        bytes_remaining -= bytes_to_read;
+        item->start_cluster = -999; // Corrupt start_cluster
+    } else {
+        *original = item->start_cluster;
+        item->start_cluster = -999;
+        name_index_remove_subtree(fs, item);  // The children are lost to the tree from now on
+        item->child_count = -1; // Corrupt child count
     }
-
-    printf("\n");
+    store_directory(fs, session->current_directory);  // The broken entry reaches the image
+    return PF_OK;
 }
 
-
-
-void load(const char *filename, const char *source_path) {
-    if (!filename || !source_path) {
-        printf("Error: Invalid arguments provided to 'load'.\n");
-        return;
+// Builds a new file in path from a host file transfer or from a buffer (source == NULL)
+static PfResult create_file(FileSystem *fs, Session *session, const char *path, const char *data, Transfer *source, size_t size) {
+    DirectoryItem *dest_dir;
+    char file_name[MAX_ITEM_NAME_SIZE];
+    PfResult result = lookup_parent(fs, session, path, &dest_dir, file_name);
+    if (result != PF_OK) {
+        return result;
     }
+    return add_file(fs, dest_dir, file_name, data, source, size);
+}
 
-    FILE *file = fopen(source_path, "r");
-    if (!file) {
-        printf("FILE NOT FOUND\n");
-        return;
+PfResult pf_write_file(FileSystem *fs, Session *session, const char *path, const void *data, size_t size) {
+    if (!data && size > 0) {
+        return PF_ERR_INVALID_ARGUMENT;
     }
+    return create_file(fs, session, path, (const char *)data, NULL, size);
+}
 
-    char command_buffer[512];
-    int line_number = 0;
-    int error_count = 0;
-
-    while (fgets(command_buffer, sizeof(command_buffer), file)) {
-        // Remove trailing newline character
-        size_t len = strlen(command_buffer);
-        if (len > 0 && command_buffer[len - 1] == '\n') {
-            command_buffer[len - 1] = '\0';
-        }
+PfResult pf_import(FileSystem *fs, Session *session, const char *host_path, const char *path) {
+    if (!fs->fat_table1) {
+        return PF_ERR_NOT_FORMATTED;
+    }
 
-        line_number++;
-        process_error = false; // Reset error flag before each command
-        process_command(filename, command_buffer);
+    int source_fd = open(host_path, O_RDONLY);
+    if (source_fd < 0) {
+        return PF_ERR_NOT_FOUND;
+    }
 
-        // Check for errors
-        if (process_error) {
-            printf("Error processing command on line %d: %s\n", line_number, command_buffer);
-            error_count++;
-        }
+    struct stat source_stat;
+    if (fstat(source_fd, &source_stat) != 0 || !S_ISREG(source_stat.st_mode)) {
+        close(source_fd);
+        return PF_ERR_IO;
     }
 
-    fclose(file);
+    // The I/O queue reads ahead while the clusters are filled here
+    Transfer *source = transfer_from_host(fs_io_queue(fs), source_fd, (size_t)fs->description.cluster_size, (uint64_t)source_stat.st_size);
+    if (!source) {
+        close(source_fd);
+        return PF_ERR_NO_MEMORY;
+    }
 
-    if (error_count > 0) {
-        printf("Load completed with %d errors.\n", error_count);
-    } else {
-        printf("OK\n");
+    PfResult result = create_file(fs, session, path, NULL, source, (size_t)source_stat.st_size);
+    if (!transfer_finish(source) && result == PF_OK) {
+        result = PF_ERR_IO;
     }
+    close(source_fd);
+    return result;
 }
 
+PfResult pf_open_file(FileSystem *fs, Session *session, const char *path, PfFile *file) {
+    DirectoryItem *item;
+    PfResult result = lookup(fs, session, path, &item);
+    if (result != PF_OK) {
+        return result;
+    }
+    if (!item->isFile) {
+        return PF_ERR_NOT_A_FILE;
+    }
 
+    file->fs = fs;
+    file->item = item;
+    file->cluster = item->start_cluster;
+    file->position = 0;
+    return PF_OK;
+}
 
+// Reads the next bytes of the file, at most up to the end of the current cluster per step
+PfResult pf_read(PfFile *file, void *buffer, size_t size, size_t *bytes_read) {
+    FileSystem *fs = file->fs;
+    int32_t cluster_size = fs->description.cluster_size;
+    *bytes_read = 0;
 
+    if (file->position >= file->item->size) {
+        return PF_END;
+    }
 
+    // Inline files are read straight from the directory record, no FAT lookup
+    if (file->item->is_inline) {
+        if (file->item->size > INLINE_CAPACITY(file->item->item_name)) {
+            return PF_ERR_CORRUPTED;
+        }
+        size_t chunk = (size_t)(file->item->size - file->position);
+        if (chunk > size) chunk = size;
+        memcpy(buffer, file->item->inline_data + file->position, chunk);
+        STAT_ADD(STAT_BYTES_READ, chunk);
+        *bytes_read = chunk;
+        file->position += (int32_t)chunk;
+        return PF_OK;
+    }
+
+    while (*bytes_read < size && file->position < file->item->size) {
+        if (file->cluster < 0 || file->cluster >= fs->description.cluster_count) {
+            return *bytes_read > 0 ? PF_OK : PF_ERR_CORRUPTED;
+        }
 
+        int32_t offset = file->position % cluster_size;
+        size_t chunk = (size_t)(cluster_size - offset);
+        if (chunk > (size_t)(file->item->size - file->position)) chunk = (size_t)(file->item->size - file->position);
+        if (chunk > size - *bytes_read) chunk = size - *bytes_read;
 
+        if (!read_cluster_into(fs, file->cluster, (size_t)offset, (char *)buffer + *bytes_read, chunk)) {
+            return PF_ERR_CORRUPTED; // Checksum mismatch
+        }
 
+        *bytes_read += chunk;
+        file->position += (int32_t)chunk;
+        if (file->position % cluster_size == 0) {
+            STAT_INC(STAT_FAT_LINKS);
+            file->cluster = fs->fat_table1[file->cluster];
+        }
+    }
+    return PF_OK;
+}
 
+// Reads the beginning of a file into buffer, bytes_read tells how much of it fit
+PfResult pf_read_file(FileSystem *fs, Session *session, const char *path, void *buffer, size_t size, size_t *bytes_read) {
+    PfFile file;
+    PfResult result = pf_open_file(fs, session, path, &file);
+    *bytes_read = 0;
+    while (result == PF_OK && *bytes_read < size) {
+        size_t got;
+        result = pf_read(&file, (char *)buffer + *bytes_read, size - *bytes_read, &got);
+        *bytes_read += got;
+    }
+    return result == PF_END ? PF_OK : result;
+}
 
+PfResult pf_export(FileSystem *fs, Session *session, const char *path, const char *host_path) {
+    PfFile file;
+    PfResult result = pf_open_file(fs, session, path, &file);
+    if (result != PF_OK) {
+        return result;
+    }
 
+    int dest_fd = open(host_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (dest_fd < 0) {
+        return PF_ERR_IO;
+    }
 
+    // The chain is copied into large buffers here while the I/O queue writes the previous ones
+    Transfer *dest = transfer_to_host(fs_io_queue(fs), dest_fd, (size_t)fs->description.cluster_size, (uint64_t)file.item->size);
+    if (!dest) {
+        close(dest_fd);
+        return PF_ERR_NO_MEMORY;
+    }
 
+    char *buffer;
+    size_t capacity;
+    while (result == PF_OK && (buffer = transfer_fill(dest, &capacity)) != NULL) {
+        size_t length = 0, got;
+        while (length < capacity && (result = pf_read(&file, buffer + length, capacity - length, &got)) == PF_OK) {
+            length += got;
+        }
+        if (length > 0 && !transfer_push(dest, length)) {
+            break;
+        }
+    }
 
-
+    if (!transfer_finish(dest) && (result == PF_OK || result == PF_END)) {
+        result = PF_ERR_IO;
+    }
+    if (close(dest_fd) != 0 && result == PF_END) {
+        result = PF_ERR_IO;
+    }
+    return result == PF_END ? PF_OK : result;
+}
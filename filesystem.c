@@ -1,186 +1,923 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "ClusterCache.h"
+#include "Crc32c.h"
 #include "FatTable.h"
+#include "IoQueue.h"
+#include "NameIndex.h"
+#include "PseudoFat.h"
+#include "Stats.h"
+#include "Trace.h"
+#include "Traverse.h"
+#include "TreeVersions.h"
+
+// Sets up an empty, unformatted filesystem whose image lives in image_path
+void fs_init(FileSystem *fs, const char *image_path) {
+    memset(fs, 0, sizeof(FileSystem));
+    fs->image_path = image_path;
+    fs->inline_limit = INLINE_LIMIT_DEFAULT;
+    fs->mapping_fd = -1;
+    fs->io_depth = IO_QUEUE_DEPTH;
+    pthread_rwlock_init(&fs->lock, NULL);
+}
 
-FSDescription fs_description;
-int32_t *fat_table1 = NULL;
-int32_t *fat_table2 = NULL;
-DirectoryItem root_directory;
-DirectoryItem *current_directory = NULL; // Pointer to the current directory
-char *fs_data;  // Pointer to filesystem data (this should represent actual data on disk or memory)
+// Sessions sharing the lock may get here together, the first queue published wins
+IoQueue *fs_io_queue(FileSystem *fs) {
+    IoQueue *queue = __atomic_load_n(&fs->io, __ATOMIC_ACQUIRE);
+    if (queue) return queue;
 
-// Initializes the filesystem with the given disk size and cluster size
-void initialize_filesystem(int32_t disk_size, int32_t cluster_size) {
-    // Validate input parameters
-    if (disk_size <= 0 || cluster_size <= 0 || cluster_size > disk_size) {
-        fprintf(stderr, "Error: Invalid parameters. Disk size: %d, cluster size: %d\n", disk_size, cluster_size);
-        exit(EXIT_FAILURE);
+    IoQueue *created = io_queue_create(fs->io_depth);
+    if (created && !__atomic_compare_exchange_n(&fs->io, &queue, created, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        io_queue_release(created);
+        return queue;
     }
+    return created;
+}
 
-    // Set basic filesystem information
-    strncpy(fs_description.signature, "cacha", sizeof(fs_description.signature) - 1);
-    fs_description.signature[sizeof(fs_description.signature) - 1] = '\0'; // Ensure null termination
-    fs_description.disk_size = disk_size;
-    fs_description.cluster_size = cluster_size;
-    fs_description.cluster_count = disk_size / cluster_size;
-    fs_description.fat_count = fs_description.cluster_count;
+// Points a new session at the root of fs, output goes to stdout
+void session_init(Session *session, FileSystem *fs) {
+    session->fs = fs;
+    session->current_directory = &fs->root_directory;
+    session->out = NULL;
+    session->process_error = false;
+    session->published_root = NULL;
+    session->published_cwd = NULL;
+}
+
+// Releases the in-memory image before another one is formatted or loaded
+static void release_filesystem(FileSystem *fs) {
+    reclaim_finish(fs);
+    name_index_release(fs);
+    versions_unpublish(fs);
+    free_directory_tree(&fs->root_directory);
+    free(fs->fat_table1);
+    free(fs->fat_table2);
+    if (fs->mapping) {
+        munmap(fs->mapping, fs->mapping_size);
+        close(fs->mapping_fd);  // Other processes may write the image again
+    } else {
+        free(fs->data);
+    }
+    cache_close(fs->cache);  // Changes since the last commit are dropped, as with data
+    free(fs->cluster_checksums);
+    fs->fat_table1 = NULL;
+    fs->fat_table2 = NULL;
+    fs->data = NULL;
+    fs->cache = NULL;
+    fs->mapping = NULL;
+    fs->mapping_size = 0;
+    fs->mapping_fd = -1;
+    fs->cluster_checksums = NULL;
+    fs->checksum_mismatches = 0;
+    fs->fat_mismatches = 0;
+    fs->fat_failover = false;
+}
+
+void fs_release(FileSystem *fs) {
+    scrub_release(fs);
+    reclaim_release(fs);
+    release_filesystem(fs);
+    versions_release(fs);
+    io_queue_release(fs->io);
+    fs->io = NULL;
+    free(fs->cluster_references);
+    free(fs->zero_pending);
+    free(fs->fat_dirty);
+    free(fs->fat_unsaved);
+    free(fs->record_buffer);
+    fs->cluster_references = NULL;
+    fs->zero_pending = NULL;
+    fs->zero_pending_count = 0;
+    fs->fat_dirty = NULL;
+    fs->fat_dirty_count = 0;
+    fs->fat_unsaved = NULL;
+    fs->record_buffer = NULL;
+    pthread_rwlock_destroy(&fs->lock);
+}
 
-    // Allocate memory for the filesystem data
-    fs_data = (char *)malloc(fs_description.cluster_count * fs_description.cluster_size);
+// Where the data region of an image with this layout starts
+static off_t data_region_offset(const FSDescription *description) {
+    off_t offset = (off_t)sizeof(FSDescription) + 2 * (off_t)description->fat_count * (off_t)sizeof(int32_t);
+    if (description->features & FS_FEATURE_CHECKSUMS) {
+        offset += (off_t)description->cluster_count * (off_t)sizeof(uint32_t);
+    }
+    return offset;
+}
+
+// True if the image at path keeps its data region in the file instead of in memory
+static bool disk_backed(const FileSystem *fs, const char *path) {
+    return fs->cache_budget > 0 && fs->image_path && strcmp(path, fs->image_path) == 0;
+}
 
-    // Allocate memory for FAT tables
-    fat_table1 = (int32_t *)malloc(fs_description.fat_count * sizeof(int32_t));
-    fat_table2 = (int32_t *)malloc(fs_description.fat_count * sizeof(int32_t));
-    if (!fat_table1 || !fat_table2) {
-        fprintf(stderr, "Error: Insufficient memory for FAT tables (%d entries).\n", fs_description.fat_count);
-        exit(EXIT_FAILURE);
+// Processes sharing an image coordinate through flock() on it. A read-only mount holds a shared
+// lock for as long as it maps the file. A writer holds an exclusive one while it changes the
+// file: pf_save() for the time it writes, a disk-backed image as long as its cache is open
+// (evicted clusters are written back at any time). Nobody waits, whoever does not get the lock
+// fails with PF_ERR_BUSY, so a save never truncates the pages a reader has mapped.
+//
+// Opens path and takes lock (LOCK_SH, LOCK_EX or 0 for none). When this filesystem already
+// holds the image, the open file carrying its lock is shared, a second one would conflict.
+static PfResult open_image(FileSystem *fs, const char *path, int flags, int lock, int *fd) {
+    int held = fs->cache ? cache_fd(fs->cache) : fs->mapping_fd;
+    if (held >= 0 && fs->image_path && strcmp(path, fs->image_path) == 0) {
+        *fd = dup(held);
+        if (*fd >= 0 && lseek(*fd, 0, SEEK_SET) != 0) {
+            close(*fd);
+            *fd = -1;
+        }
+    } else {
+        *fd = open(path, flags, 0644);
+    }
+    if (*fd < 0) {
+        return PF_ERR_IO;
     }
+    if (lock && flock(*fd, lock | LOCK_NB) != 0) {
+        close(*fd);
+        *fd = -1;
+        return PF_ERR_BUSY;
+    }
+    return PF_OK;
+}
+
+// Marks the whole FAT for the next commit of a disk-backed image
+static void mark_fat_unsaved(FileSystem *fs) {
+    if (fs->fat_unsaved) {
+        memset(fs->fat_unsaved, 1, (size_t)((fs->description.fat_count + FAT_MIRROR_PAGE - 1) / FAT_MIRROR_PAGE));
+    }
+}
+
+// Creates a fresh, empty filesystem with the given disk size and cluster size in memory
+// Cluster sizes format creates and load accepts, anything else could not be handled safely
+static bool cluster_size_valid(int32_t cluster_size) {
+    return cluster_size >= PF_CLUSTER_SIZE_MIN && cluster_size <= PF_CLUSTER_SIZE_MAX && (cluster_size & (cluster_size - 1)) == 0;
+}
+
+PfResult pf_format(FileSystem *fs, int32_t disk_size, int32_t cluster_size) {
+    if (fs->read_only) {
+        return PF_ERR_READ_ONLY;
+    }
+    // Validate input parameters
+    if (disk_size <= 0 || !cluster_size_valid(cluster_size) || cluster_size > disk_size) {
+        return PF_ERR_INVALID_ARGUMENT;
+    }
+
+    // Allocate memory for the filesystem data (zeroed, free clusters must read as zeros). A
+    // disk-backed image gets a cache over its file instead.
+    int32_t cluster_count = disk_size / cluster_size;
+    bool on_disk = fs->cache_budget > 0 && fs->image_path;
+    char *data = on_disk ? NULL : (char *)calloc(cluster_count, cluster_size);
+    int32_t *fat_table1 = (int32_t *)malloc(cluster_count * sizeof(int32_t));
+    int32_t *fat_table2 = (int32_t *)malloc(cluster_count * sizeof(int32_t));
+    ClusterCache *cache = NULL;
+    off_t data_offset = (off_t)sizeof(FSDescription) + 2 * (off_t)cluster_count * (off_t)sizeof(int32_t);
+    if (on_disk) {
+        int fd;
+        PfResult opened = open_image(fs, fs->image_path, O_RDWR | O_CREAT, LOCK_EX, &fd);
+        if (opened != PF_OK) {
+            free(fat_table1);
+            free(fat_table2);
+            return opened;
+        }
+        cache = cache_open(fd, data_offset, cluster_size, cluster_count, fs->cache_budget);
+        if (!cache) {
+            close(fd);
+        }
+    }
+    if ((!on_disk && !data) || (on_disk && !cache) || !fat_table1 || !fat_table2) {
+        free(data);
+        cache_close(cache);
+        free(fat_table1);
+        free(fat_table2);
+        return PF_ERR_NO_MEMORY;
+    }
+
+    // Emptied down to a sparse file of the full length, every cluster reads as zeros
+    if (on_disk && (ftruncate(cache_fd(cache), 0) != 0 || ftruncate(cache_fd(cache), data_offset + disk_size) != 0)) {
+        cache_close(cache);
+        free(fat_table1);
+        free(fat_table2);
+        return PF_ERR_IO;
+    }
+
+    release_filesystem(fs);
+
+    // Set basic filesystem information
+    memset(&fs->description, 0, sizeof(FSDescription));
+    strncpy(fs->description.signature, "cacha", sizeof(fs->description.signature) - 1);
+    fs->description.signature[sizeof(fs->description.signature) - 1] = '\0'; // Ensure null termination
+    fs->description.disk_size = disk_size;
+    fs->description.cluster_size = cluster_size;
+    fs->description.cluster_count = cluster_count;
+    fs->description.fat_count = cluster_count;
+    fs->description.features = FS_FEATURE_DIRECTORY_CLUSTERS;
+    fs->data = data;
+    fs->cache = cache;
+    fs->fat_table1 = fat_table1;
+    fs->fat_table2 = fat_table2;
 
     // Initialize FAT tables
-    for (int32_t i = 0; i < fs_description.fat_count; i++) {
-        fat_table1[i] = FAT_UNUSED;
-        fat_table2[i] = FAT_UNUSED;
+    for (int32_t i = 0; i < fs->description.fat_count; i++) {
+        fs->fat_table1[i] = FAT_UNUSED;
+        fs->fat_table2[i] = FAT_UNUSED;
     }
 
     // Initialize root directory
-    memset(&root_directory, 0, sizeof(DirectoryItem));
-    strncpy(root_directory.item_name, "root", sizeof(root_directory.item_name) - 1);
-    root_directory.item_name[sizeof(root_directory.item_name) - 1] = '\0'; // Ensure null termination
-    root_directory.isFile = false;
-    root_directory.size = 0;
-    root_directory.start_cluster = 0;
-    root_directory.parent = NULL;
-    root_directory.child_count = 0;
-
-    // Mark root directory cluster as end of file
-    fat_table1[root_directory.start_cluster] = FAT_FILE_END;
-    fat_table2[root_directory.start_cluster] = FAT_FILE_END;
+    memset(&fs->root_directory, 0, sizeof(DirectoryItem));
+    strncpy(fs->root_directory.item_name, "root", sizeof(fs->root_directory.item_name) - 1);
+    fs->root_directory.item_name[sizeof(fs->root_directory.item_name) - 1] = '\0'; // Ensure null termination
+    fs->root_directory.isFile = false;
+    fs->root_directory.size = 0;
+    fs->root_directory.start_cluster = 0;
+    fs->root_directory.parent = NULL;
+    fs->root_directory.child_count = 0;
+
+    // Mark root directory cluster as end of file, the zeroed cluster is an empty record list
+    fs->fat_table1[fs->root_directory.start_cluster] = FAT_FILE_END;
+    fs->fat_table2[fs->root_directory.start_cluster] = FAT_FILE_END;
+
+    // Fresh reference counts and an empty zero_pending set
+    init_cluster_state(fs);
+    mark_fat_unsaved(fs);
+    name_index_rebuild(fs);
+    versions_rebuild(fs);
+    return PF_OK;
+}
 
-    // Set the current directory to root
-    current_directory = &root_directory;
+static bool write_at(int fd, const void *buffer, size_t size, off_t offset) {
+    const char *bytes = buffer;
+    while (size > 0) {
+        ssize_t written = pwrite(fd, bytes, size, offset);
+        if (written <= 0) return false;
+        bytes += written;
+        size -= (size_t)written;
+        offset += written;
+    }
+    return true;
+}
 
-    printf("Filesystem initialized:\n");
-    printf("  Disk size: %d MB\n", disk_size / (1024 * 1024));
-    printf("  Cluster size: %d B\n", cluster_size);
-    printf("  Cluster count: %d\n", fs_description.cluster_count);
+// Queues a region of the image in requests of at most IO_REQUEST_BYTES
+static void queue_write(IoQueue *io, IoBatch *batch, int fd, const char *buffer, size_t size, off_t offset) {
+    while (size > 0) {
+        size_t chunk = size < IO_REQUEST_BYTES ? size : IO_REQUEST_BYTES;
+        io_write(io, batch, fd, buffer, chunk, offset);
+        buffer += chunk;
+        size -= chunk;
+        offset += (off_t)chunk;
+    }
 }
 
-// Formats the filesystem and saves its initial state to a file
-void format_filesystem(const char *filename, int32_t disk_size, int32_t cluster_size) {
-    FILE *file = fopen(filename, "wb");
-    if (!file) {
-        perror("Failed to create filesystem file");
-        exit(EXIT_FAILURE);
+static void queue_read(IoQueue *io, IoBatch *batch, int fd, char *buffer, size_t size, off_t offset) {
+    while (size > 0) {
+        size_t chunk = size < IO_REQUEST_BYTES ? size : IO_REQUEST_BYTES;
+        io_read(io, batch, fd, buffer, chunk, offset);
+        buffer += chunk;
+        size -= chunk;
+        offset += (off_t)chunk;
     }
+}
 
-    initialize_filesystem(disk_size, cluster_size); // Initialize the filesystem
-    save_system_state(filename); // Save the initialized state
+// Writes the data region, leaving free clusters and clusters from the zero_pending set as holes
+// in the image. The file was truncated on open and is extended to its full length, so skipped
+// ranges read back as zeros. Runs of live clusters are queued straight from memory, a
+// disk-backed image copies its clusters over one at a time.
+static bool save_data_region(FileSystem *fs, IoQueue *io, IoBatch *batch, int fd, off_t data_start) {
+    size_t cluster_size = (size_t)fs->description.cluster_size;
+    int32_t run_start = 0;
+
+    for (int32_t i = 0; i <= fs->description.cluster_count; i++) {
+        if (i < fs->description.cluster_count && !fs->zero_pending[i] && fs->fat_table1[i] != FAT_UNUSED) {
+            continue;
+        }
 
-    fclose(file);
-    printf("FORMAT COMPLETE\n");
+        // Queue the run of live clusters [run_start, i) and skip over the hole
+        if (i > run_start && !fs->cache) {
+            queue_write(io, batch, fd, fs->data + (size_t)run_start * cluster_size, (size_t)(i - run_start) * cluster_size,
+                        data_start + (off_t)run_start * (off_t)cluster_size);
+        }
+        for (int32_t cluster = run_start; fs->cache && cluster < i; cluster++) {
+            const char *contents = cluster_pin(fs, cluster, true);
+            bool written = contents && write_at(fd, contents, cluster_size, data_start + (off_t)cluster * (off_t)cluster_size);
+            if (contents) {
+                cluster_unpin(fs, cluster, false);
+            }
+            if (!written) {
+                return false;
+            }
+        }
+        run_start = i + 1;
+    }
+
+    // Bytes past the last whole cluster are never used and stay zeros
+    return ftruncate(fd, data_start + fs->description.disk_size) == 0;
 }
 
-// Recursively saves a directory and its children to a file
-void save_directory(FILE *file, DirectoryItem *directory) {
-    // Save the current directory
-    fwrite(directory, sizeof(DirectoryItem), 1, file);
+// Commits a disk-backed image in place. Its clusters already live in the file, only the dirty
+// frames, the cleared clusters, the FAT pages changed since the last commit, the checksums and
+// the header still go out, the header last. The cache's file holds the exclusive lock, no
+// read-only mount can have the image mapped.
+static PfResult commit_image(FileSystem *fs) {
+    ClusterCache *cache = fs->cache;
+    int fd = cache_fd(cache);
+    sync_fat_mirror(fs);
+
+    // Turning checksums on or off (or converting an older image) moves the data region
+    off_t data_offset = data_region_offset(&fs->description);
+    if (data_offset != cache_data_offset(cache)) {
+        if (!cache_relocate(cache, data_offset, fs->description.disk_size)) {
+            return PF_ERR_IO;
+        }
+        mark_fat_unsaved(fs);
+    }
+
+    // The file is the only copy of a freed cluster, clear it there
+    bool written = true;
+    for (int32_t i = 0; i < fs->description.cluster_count && fs->zero_pending_count > 0 && written; ) {
+        if (!fs->zero_pending[i]) {
+            i++;
+            continue;
+        }
+        int32_t run_end = i;
+        while (run_end < fs->description.cluster_count && fs->zero_pending[run_end]) run_end++;
+        written = cache_zero(cache, i, run_end - i);
+        if (written) {
+            memset(fs->zero_pending + i, 0, (size_t)(run_end - i));
+            fs->zero_pending_count -= run_end - i;
+        }
+        i = run_end;
+    }
+    written = written && cache_flush(cache);
+
+    // Both FAT copies, runs of changed pages at a time
+    off_t fat_bytes = (off_t)fs->description.fat_count * (off_t)sizeof(int32_t);
+    off_t fat1_offset = (off_t)sizeof(FSDescription);
+    int32_t pages = (fs->description.fat_count + FAT_MIRROR_PAGE - 1) / FAT_MIRROR_PAGE;
+    for (int32_t page = 0; page < pages && written; page++) {
+        if (!fs->fat_unsaved[page]) continue;
+
+        int32_t run_end = page;
+        while (run_end < pages && fs->fat_unsaved[run_end]) run_end++;
+        int32_t first = page * FAT_MIRROR_PAGE;
+        int32_t last = run_end * FAT_MIRROR_PAGE < fs->description.fat_count ? run_end * FAT_MIRROR_PAGE : fs->description.fat_count;
+        size_t size = (size_t)(last - first) * sizeof(int32_t);
+        off_t offset = (off_t)first * (off_t)sizeof(int32_t);
+        written = write_at(fd, fs->fat_table1 + first, size, fat1_offset + offset) &&
+                  write_at(fd, fs->fat_table2 + first, size, fat1_offset + fat_bytes + offset);
+        if (written) {
+            memset(fs->fat_unsaved + page, 0, (size_t)(run_end - page));
+        }
+        page = run_end;
+    }
 
-    // Recursively save all child items
-    for (int i = 0; i < directory->child_count; i++) {
-        save_directory(file, directory->children[i]);
+    if (written && fs->cluster_checksums) {
+        written = write_at(fd, fs->cluster_checksums, (size_t)fs->description.cluster_count * sizeof(uint32_t),
+                           fat1_offset + 2 * fat_bytes);
     }
+    written = written && write_at(fd, &fs->description, sizeof(FSDescription), 0);
+    return written ? PF_OK : PF_ERR_IO;
 }
 
 // Saves the current state of the filesystem to a file
-void save_system_state(const char *filename) {
-    FILE *file = fopen(filename, "wb");
-    if (!file) {
-        perror("Failed to save filesystem state");
-        return;
-    }
+// Writes the whole image into fd and closes it, everything but the header is queued at once
+static PfResult write_image(FileSystem *fs, IoQueue *io, int fd) {
+    IoBatch batch = { 0, false };
 
     // Save FSDescription structure
-    fwrite(&fs_description, sizeof(FSDescription), 1, file);
+    io_write(io, &batch, fd, &fs->description, sizeof(FSDescription), 0);
+
+    // Save FAT tables, the mirror is brought up to date first
+    TRACE_BEGIN(trace_phase_ns);
+    sync_fat_mirror(fs);
+    size_t fat_bytes = (size_t)fs->description.fat_count * sizeof(int32_t);
+    off_t offset = (off_t)sizeof(FSDescription);
+    queue_write(io, &batch, fd, (const char *)fs->fat_table1, fat_bytes, offset);
+    queue_write(io, &batch, fd, (const char *)fs->fat_table2, fat_bytes, offset + (off_t)fat_bytes);
+    if (fs->cluster_checksums) {
+        queue_write(io, &batch, fd, (const char *)fs->cluster_checksums,
+                    (size_t)fs->description.cluster_count * sizeof(uint32_t), offset + 2 * (off_t)fat_bytes);
+    }
+    TRACE_END(trace_phase_ns, "save", "save FAT");
 
-    // Save FAT tables
-    fwrite(fat_table1, sizeof(int32_t), fs_description.fat_count, file);
-    fwrite(fat_table2, sizeof(int32_t), fs_description.fat_count, file);
+    // Save the filesystem data, directories included, then wait for everything queued
+    TRACE_BEGIN(trace_data_ns);
+    bool failed = !save_data_region(fs, io, &batch, fd, data_region_offset(&fs->description));
+    failed |= !io_wait(io, &batch);
+    TRACE_END(trace_data_ns, "save", "save data region");
 
-    // Save the root directory and its children
-    save_directory(file, &root_directory);
+    if (close(fd) != 0) {
+        failed = true;
+    }
+    return failed ? PF_ERR_IO : PF_OK;
+}
 
-    // Save the filesystem data
-    fwrite(fs_data, 1, fs_description.disk_size, file);
+PfResult pf_save(FileSystem *fs, const char *path) {
+    if (!fs->fat_table1) {
+        return PF_ERR_NOT_FORMATTED;
+    }
+    if (fs->read_only && fs->image_path && strcmp(path, fs->image_path) == 0) {
+        return PF_ERR_READ_ONLY;  // Other readers may have it mapped
+    }
 
-    fclose(file);
-    printf("Filesystem state saved to %s\n", filename);
+    // Failed saves are timed and traced too, every path ends below
+    STAT_TIMER(save_start);
+    TRACE_BEGIN(trace_save_ns);
+    reclaim_finish(fs);  // Clusters of removed subtrees must not be saved as allocated
+    PfResult result;
+    IoQueue *io = NULL;
+    int fd = -1;
+    if (fs->cache && disk_backed(fs, path)) {
+        result = commit_image(fs);
+    } else if (!(io = fs_io_queue(fs))) {
+        result = PF_ERR_NO_MEMORY;
+    } else if ((result = open_image(fs, path, O_WRONLY | O_CREAT, LOCK_EX, &fd)) != PF_OK) {
+        // Read-only mounts have it mapped, or it could not be opened
+    } else if (ftruncate(fd, 0) != 0) {  // Only once the lock is held
+        close(fd);
+        result = PF_ERR_IO;
+    } else {
+        result = write_image(fs, io, fd);
+    }
+    STAT_INC(STAT_SAVE_COUNT);
+    STAT_ELAPSED(STAT_SAVE_NS, save_start);
+    TRACE_END(trace_save_ns, "save", "pf_save");
+    return result;
+}
+
+PfResult pf_commit(FileSystem *fs) {
+    return pf_save(fs, fs->image_path);
 }
 
-// Recursively loads a directory and its children from a file
-void load_directory(FILE *file, DirectoryItem *directory, DirectoryItem *parent) {
-    // Load the current directory
-    fread(directory, sizeof(DirectoryItem), 1, file);
+// DirectoryItem as older images stored it, pointers included
+typedef struct LegacyDirectoryItem {
+    char item_name[MAX_ITEM_NAME_SIZE];
+    bool isFile;
+    int32_t size;
+    int32_t start_cluster;
+    struct DirectoryItem *parent;
+    struct DirectoryItem *children[MAX_CHILDREN];
+    int child_count;
+} LegacyDirectoryItem;
+
+typedef struct LoadWalk {
+    FILE *file;                          // Legacy tree, positioned at the next item
+    const FSDescription *description;
+    const int32_t *fat;
+    const char *data;
+    ClusterCache *cache;                 // Holds the data region instead of data when disk-backed
+    uint8_t *seen;                       // Directory chains already read
+    int32_t clusters;                    // Extra clusters a legacy conversion needs
+    PfResult result;
+} LoadWalk;
+
+// Loads one item of the serialized preorder tree of an image without FS_FEATURE_DIRECTORY_CLUSTERS
+// into the placeholder its parent allocated, then allocates the placeholders of its children.
+// On failure the items loaded so far stay linked below the root (child_count matches), so
+// free_directory_tree() can release them.
+static TreeAction load_item(TreeVisit *visit, void *context) {
+    LoadWalk *load = context;
+    DirectoryItem *directory = visit->item;
+    DirectoryItem *parent = directory->parent;
+
+    LegacyDirectoryItem stored;
+    memset(directory, 0, sizeof(DirectoryItem));
     directory->parent = parent;  // Restore the parent relationship
+    if (fread(&stored, sizeof(LegacyDirectoryItem), 1, load->file) != 1) {
+        load->result = PF_ERR_CORRUPTED;
+        return TREE_STOP;
+    }
+    memcpy(directory->item_name, stored.item_name, MAX_ITEM_NAME_SIZE);
+    directory->item_name[MAX_ITEM_NAME_SIZE - 1] = '\0';
+    directory->isFile = stored.isFile;
+    directory->size = stored.size;
+    directory->start_cluster = stored.start_cluster;
+    directory->child_count = stored.child_count;
+
+    // A negative count is what `bug` leaves behind, it loads as is so that check can report it
+    int child_count = directory->child_count;
+    if (child_count > MAX_CHILDREN || (directory->isFile && child_count > 0)) {
+        directory->child_count = 0;
+        load->result = PF_ERR_CORRUPTED;
+        return TREE_STOP;
+    }
 
-    // Recursively load all child items
-    for (int i = 0; i < directory->child_count; i++) {
-        directory->children[i] = (DirectoryItem *)malloc(sizeof(DirectoryItem));
+    // The children follow in the stream, each is read when the walk reaches its placeholder
+    for (int i = 0; i < child_count; i++) {
+        directory->children[i] = (DirectoryItem *)calloc(1, sizeof(DirectoryItem));
         if (!directory->children[i]) {
-            fprintf(stderr, "Memory allocation failed for child directory.\n");
-            exit(EXIT_FAILURE);
+            directory->child_count = i;
+            load->result = PF_ERR_NO_MEMORY;
+            return TREE_STOP;
         }
-        load_directory(file, directory->children[i], directory);  // Pass current directory as parent
+        directory->children[i]->parent = directory;
     }
+    return TREE_CONTINUE;
 }
 
-// Loads the filesystem state from a file
-void load_system_state(const char *filename) {
-    FILE *file = fopen(filename, "rb");
-    if (!file) {
-        printf("Filesystem file not found. Use 'format' to initialize.\n");
-        file = fopen(filename, "wb"); // Create an empty file
-        if (!file) {
-            perror("Failed to create empty filesystem file");
-            exit(EXIT_FAILURE);
+// Adds the children recorded in one cluster of a directory chain. record and filled carry a
+// record split across clusters. PF_END asks for the next cluster, PF_OK means the list ended.
+static PfResult read_records(DirectoryItem *directory, const char *base, size_t cluster_size,
+                             DirectoryRecord *record, size_t *filled) {
+    for (size_t offset = 0; offset < cluster_size; ) {
+        size_t chunk = sizeof(*record) - *filled;
+        if (chunk > cluster_size - offset) chunk = cluster_size - offset;
+        memcpy((char *)record + *filled, base + offset, chunk);
+        *filled += chunk;
+        offset += chunk;
+        if (*filled < sizeof(*record)) break;  // Continues in the next cluster
+        *filled = 0;
+
+        if (record->item_name[0] == '\0') {
+            return PF_OK;  // End of the list
+        }
+        if (directory->child_count >= MAX_CHILDREN) {
+            return PF_ERR_CORRUPTED;
+        }
+
+        DirectoryItem *child = (DirectoryItem *)calloc(1, sizeof(DirectoryItem));
+        if (!child) {
+            return PF_ERR_NO_MEMORY;
+        }
+        directory->children[directory->child_count++] = child;
+        memcpy(child->item_name, record->item_name, MAX_ITEM_NAME_SIZE);
+        child->item_name[MAX_ITEM_NAME_SIZE - 1] = '\0';
+        child->isFile = record->is_file != 0;
+        child->size = record->size;
+        child->start_cluster = record->start_cluster;
+        child->parent = directory;
+        if (child->isFile && (record->flags & RECORD_INLINE)) {
+            int32_t capacity = INLINE_CAPACITY(child->item_name);
+            child->is_inline = true;
+            memcpy(child->inline_data, record->item_name + MAX_ITEM_NAME_SIZE - capacity, (size_t)capacity);
         }
-        fclose(file);
-        return;
     }
+    return PF_END;
+}
 
-    // Load FSDescription structure
-    fread(&fs_description, sizeof(FSDescription), 1, file);
+// Builds the children of directory from the records in its cluster chain. seen marks the chains
+// already read, so a damaged image cannot make the tree loop. Same cleanup contract as load_item().
+static PfResult read_directory(LoadWalk *load, DirectoryItem *directory) {
+    const FSDescription *description = load->description;
+    directory->child_count = 0;
+    int32_t cluster = directory->start_cluster;
+    if (cluster < 0 || cluster >= description->cluster_count) {
+        return PF_OK;  // Entry broken by `bug`, loads empty so that check can report it
+    }
+    if (load->seen[cluster]) {
+        return PF_ERR_CORRUPTED;
+    }
+    load->seen[cluster] = 1;
 
-    // Allocate memory for FAT tables
-    fat_table1 = (int32_t *)malloc(fs_description.fat_count * sizeof(int32_t));
-    fat_table2 = (int32_t *)malloc(fs_description.fat_count * sizeof(int32_t));
-    if (!fat_table1 || !fat_table2) {
-        fprintf(stderr, "Memory allocation failed for FAT tables.\n");
-        fclose(file);
-        exit(EXIT_FAILURE);
+    size_t cluster_size = (size_t)description->cluster_size;
+    DirectoryRecord record;
+    size_t filled = 0;  // Bytes of record gathered so far, a record may span two clusters
+
+    for (int32_t length = 0; cluster != FAT_FILE_END; length++) {
+        if (cluster < 0 || cluster >= description->cluster_count || length >= description->cluster_count) {
+            return PF_ERR_CORRUPTED;
+        }
+
+        const char *base = load->cache ? cache_pin(load->cache, cluster, true) : load->data + (size_t)cluster * cluster_size;
+        if (!base) {
+            return PF_ERR_IO;
+        }
+        PfResult result = read_records(directory, base, cluster_size, &record, &filled);
+        if (load->cache) {
+            cache_unpin(load->cache, cluster, false);
+        }
+        if (result != PF_END) {
+            return result;
+        }
+        cluster = load->fat[cluster];
     }
+    return PF_OK;
+}
 
-    // Load FAT tables
-    fread(fat_table1, sizeof(int32_t), fs_description.fat_count, file);
-    fread(fat_table2, sizeof(int32_t), fs_description.fat_count, file);
 
-    // Allocate memory for virtual disk data
-    fs_data = malloc(fs_description.disk_size);
-    if (!fs_data) {
-        fprintf(stderr, "Memory allocation failed for fs_data.\n");
-        fclose(file);
-        exit(EXIT_FAILURE);
+// Reads the records of every directory as the walk reaches it, its children are visited next
+static TreeAction read_item(TreeVisit *visit, void *context) {
+    LoadWalk *load = context;
+    if (visit->item->isFile) {
+        return TREE_CONTINUE;
     }
+    load->result = read_directory(load, visit->item);
+    return load->result == PF_OK ? TREE_CONTINUE : TREE_STOP;
+}
 
-    // Load the root directory and its children
-    load_directory(file, &root_directory, NULL);
+// Extra clusters the directories of an older image need once their records are stored, each of
+// them owns a single cluster so far
+static TreeAction count_legacy_clusters(TreeVisit *visit, void *context) {
+    LoadWalk *load = context;
+    const DirectoryItem *directory = visit->item;
+    if (!directory->isFile && directory->child_count > 0) {
+        size_t bytes = (size_t)directory->child_count * sizeof(DirectoryRecord);
+        int32_t cluster_size = load->description->cluster_size;
+        load->clusters += (int32_t)((bytes + cluster_size - 1) / cluster_size) - 1;
+    }
+    return TREE_CONTINUE;
+}
 
-    // Load the filesystem data
-    fread(fs_data, 1, fs_description.disk_size, file);
+// Writes the records of every directory of an older image into its chain
+static TreeAction convert_item(TreeVisit *visit, void *context) {
+    FileSystem *fs = context;
+    DirectoryItem *directory = visit->item;
+    if (directory->isFile) {
+        return TREE_CONTINUE;
+    }
+    if (directory->start_cluster < 0 || directory->start_cluster >= fs->description.cluster_count) {
+        return TREE_SKIP;
+    }
+    size_t bytes = (size_t)(directory->child_count > 0 ? directory->child_count : 0) * sizeof(DirectoryRecord);
+    int clusters = (int)((bytes + fs->description.cluster_size - 1) / fs->description.cluster_size);
+    allocate_clusters_for_directory(fs, directory, clusters > 0 ? clusters : 1);  // Space was checked before
+    store_directory(fs, directory);
+    return TREE_CONTINUE;
+}
 
-    // Set the current directory to root
-    current_directory = &root_directory;
+// True if every entry is free, an end or bad marker, or a link inside the table
+static bool fat_table_valid(const int32_t *fat, int32_t count) {
+    for (int32_t i = 0; i < count; i++) {
+        if (fat[i] != FAT_UNUSED && fat[i] != FAT_FILE_END && fat[i] != FAT_BAD_CLUSTER && (fat[i] < 0 || fat[i] >= count)) {
+            return false;
+        }
+    }
+    return true;
+}
 
+// Loads the filesystem state from a file. The image is read and checked completely before
+// the current filesystem is replaced, a damaged image leaves it untouched. The data region of
+// a disk-backed image stays in the file, only the directory chains are read through the cache.
+// A read-only mount maps the file shared, every process reading the image uses the same pages.
+// It and a disk-backed image keep the image locked (see open_image()).
+PfResult pf_load(FileSystem *fs, const char *path) {
+    STAT_TIMER(load_start);
+    TRACE_BEGIN(trace_load_ns);
+    bool mapped = fs->read_only;
+    bool on_disk = !mapped && disk_backed(fs, path);
+    int image_fd;
+    PfResult opened = open_image(fs, path, on_disk ? O_RDWR : O_RDONLY, mapped ? LOCK_SH : on_disk ? LOCK_EX : 0, &image_fd);
+    if (opened != PF_OK) {
+        return opened == PF_ERR_BUSY ? opened : PF_ERR_NOT_FOUND;
+    }
+    FILE *file = fdopen(image_fd, on_disk ? "r+b" : "rb");
+    if (!file) {
+        close(image_fd);
+        return PF_ERR_NO_MEMORY;
+    }
+
+    // Load and validate the FSDescription structure
+    FSDescription description;
+    if (fread(&description, sizeof(FSDescription), 1, file) != 1) {
+        fclose(file);
+        return PF_ERR_CORRUPTED;
+    }
+    if (description.disk_size <= 0 || !cluster_size_valid(description.cluster_size) || description.cluster_size > description.disk_size ||
+        description.cluster_count != description.disk_size / description.cluster_size ||
+        description.fat_count != description.cluster_count) {
+        fclose(file);
+        return PF_ERR_CORRUPTED;
+    }
+
+    // Allocate memory for FAT tables and the virtual disk data
+    int32_t *fat_table1 = (int32_t *)malloc(description.fat_count * sizeof(int32_t));
+    int32_t *fat_table2 = (int32_t *)malloc(description.fat_count * sizeof(int32_t));
+    char *data = on_disk || mapped ? NULL : malloc(description.disk_size);
+    DirectoryItem *root = malloc(sizeof(DirectoryItem));
+    bool has_checksums = (description.features & FS_FEATURE_CHECKSUMS) != 0;
+    uint32_t *checksums = has_checksums ? malloc(description.cluster_count * sizeof(uint32_t)) : NULL;
+    IoQueue *io = fs_io_queue(fs);
+    IoBatch batch = { 0, false };
+    PfResult result = (!fat_table1 || !fat_table2 || (!on_disk && !mapped && !data) || !root || (has_checksums && !checksums) || !io) ? PF_ERR_NO_MEMORY : PF_OK;
+    if (root) {
+        memset(root, 0, sizeof(DirectoryItem));
+    }
+    LoadWalk load = { file, &description, NULL, data, NULL, NULL, 0, PF_OK };
+    void *mapping = NULL;
+    size_t mapping_size = 0;
+    int mapping_fd = -1;
+
+    // Load FAT tables, all of them in flight at once. An older image continues with its tree.
+    TRACE_BEGIN(trace_phase_ns);
+    if (result == PF_OK) {
+        size_t fat_bytes = (size_t)description.fat_count * sizeof(int32_t);
+        size_t checksum_bytes = has_checksums ? (size_t)description.cluster_count * sizeof(uint32_t) : 0;
+        off_t offset = (off_t)sizeof(FSDescription);
+        queue_read(io, &batch, fileno(file), (char *)fat_table1, fat_bytes, offset);
+        queue_read(io, &batch, fileno(file), (char *)fat_table2, fat_bytes, offset + (off_t)fat_bytes);
+        queue_read(io, &batch, fileno(file), (char *)checksums, checksum_bytes, offset + 2 * (off_t)fat_bytes);
+        if (!io_wait(io, &batch) || fseeko(file, offset + 2 * (off_t)fat_bytes + (off_t)checksum_bytes, SEEK_SET) != 0) {
+            result = PF_ERR_CORRUPTED;
+        }
+    }
+    TRACE_END(trace_phase_ns, "load", "load FAT");
+
+    // Both copies are identical after a clean save. If they are not, the one that holds only
+    // valid entries wins, fat_table1 if both do. The loser is repaired from the winner.
+    int32_t fat_mismatches = 0;
+    bool fat_failover = false;
+    if (result == PF_OK && memcmp(fat_table1, fat_table2, description.fat_count * sizeof(int32_t)) != 0) {
+        for (int32_t i = 0; i < description.fat_count; i++) {
+            if (fat_table1[i] != fat_table2[i]) fat_mismatches++;
+        }
+        if (!fat_table_valid(fat_table1, description.fat_count) && fat_table_valid(fat_table2, description.fat_count)) {
+            int32_t *damaged = fat_table1;
+            fat_table1 = fat_table2;
+            fat_table2 = damaged;
+            fat_failover = true;
+        }
+        memcpy(fat_table2, fat_table1, description.fat_count * sizeof(int32_t));
+    }
+
+    // Older images carry the whole tree between the FATs and the data
+    bool legacy = (description.features & FS_FEATURE_DIRECTORY_CLUSTERS) == 0;
+    TRACE_BEGIN(trace_tree_ns);
+    if (result == PF_OK && legacy) {
+        PfResult walked = tree_walk(root, load_item, NULL, &load);
+        result = walked == PF_ERR_NO_MEMORY ? walked : load.result;
+        if (result == PF_OK && root->isFile) {
+            result = PF_ERR_CORRUPTED;
+        }
+    }
+    TRACE_END(trace_tree_ns, "load", "load directory tree");
+
+    // Load the filesystem data, or just check that the file holds all of it
+    TRACE_BEGIN(trace_data_ns);
+    if (result == PF_OK && on_disk) {
+        struct stat status;
+        off_t data_offset = ftello(file);
+        int fd = -1;
+        if (fstat(fileno(file), &status) != 0 || status.st_size < data_offset + description.disk_size) {
+            result = PF_ERR_CORRUPTED;
+        } else if ((fd = dup(fileno(file))) < 0) {
+            result = PF_ERR_IO;
+        } else if (!(load.cache = cache_open(fd, data_offset, description.cluster_size, description.cluster_count, fs->cache_budget))) {
+            close(fd);
+            result = PF_ERR_NO_MEMORY;
+        }
+    } else if (result == PF_OK && mapped) {
+        struct stat status;
+        off_t data_offset = ftello(file);
+        mapping_size = (size_t)(data_offset + description.disk_size);
+        if (fstat(fileno(file), &status) != 0 || status.st_size < (off_t)mapping_size) {
+            result = PF_ERR_CORRUPTED;
+        } else if ((mapping_fd = dup(fileno(file))) < 0) {
+            result = PF_ERR_IO;  // Keeps the shared lock after fclose(), writers must not touch mapped pages
+        } else if ((mapping = mmap(NULL, mapping_size, PROT_READ, MAP_SHARED, fileno(file), 0)) == MAP_FAILED) {
+            mapping = NULL;
+            result = PF_ERR_IO;
+        } else {
+            data = (char *)mapping + data_offset;  // Stores would fault, commands that write are refused
+            load.data = data;
+        }
+    } else if (result == PF_OK) {
+        queue_read(io, &batch, fileno(file), data, (size_t)description.disk_size, ftello(file));
+        if (!io_wait(io, &batch)) {
+            result = PF_ERR_CORRUPTED;
+        }
+    }
+    TRACE_END(trace_data_ns, "load", "load data region");
     fclose(file);
-    printf("Filesystem state loaded from %s\n", filename);
-}
\ No newline at end of file
+
+    // Every directory is read from its own chain, starting with the root in cluster 0
+    TRACE_BEGIN(trace_records_ns);
+    if (result == PF_OK && !legacy) {
+        memset(root, 0, sizeof(DirectoryItem));
+        strcpy(root->item_name, "root");
+        load.fat = fat_table1;
+        load.seen = calloc(description.cluster_count, sizeof(uint8_t));
+        if (load.seen) {
+            PfResult walked = tree_walk(root, read_item, NULL, &load);
+            result = walked == PF_ERR_NO_MEMORY ? walked : load.result;
+        } else {
+            result = PF_ERR_NO_MEMORY;
+        }
+        free(load.seen);
+    }
+    TRACE_END(trace_records_ns, "load", "read directory records");
+
+    // Converting an older image must not run out of clusters half way
+    if (result == PF_OK && legacy) {
+        int32_t free_clusters = 0;
+        for (int32_t i = 0; i < description.cluster_count; i++) {
+            if (fat_table1[i] == FAT_UNUSED) free_clusters++;
+        }
+        if (tree_walk(root, count_legacy_clusters, NULL, &load) != PF_OK) {
+            result = PF_ERR_NO_MEMORY;
+        } else if (load.clusters > free_clusters) {
+            result = PF_ERR_NO_SPACE;
+        }
+    }
+
+    if (result != PF_OK) {
+        if (root) {
+            free_directory_tree(root);
+        }
+        free(root);
+        free(fat_table1);
+        free(fat_table2);
+        if (mapping) {
+            munmap(mapping, mapping_size);
+        } else {
+            free(data);
+        }
+        if (mapping_fd >= 0) {
+            close(mapping_fd);
+        }
+        cache_close(load.cache);
+        free(checksums);
+        return result;
+    }
+
+    // Everything is in memory, replace the current filesystem
+    release_filesystem(fs);
+    fs->description = description;
+    fs->fat_table1 = fat_table1;
+    fs->fat_table2 = fat_table2;
+    fs->data = data;
+    fs->cache = load.cache;
+    fs->mapping = mapping;
+    fs->mapping_size = mapping_size;
+    fs->mapping_fd = mapping_fd;
+    fs->root_directory = *root;
+    for (int i = 0; i < fs->root_directory.child_count; i++) {
+        fs->root_directory.children[i]->parent = &fs->root_directory;
+    }
+    free(root);
+
+    // Reference counts and the name index are not stored in the image, rebuild them from the tree
+    init_cluster_state(fs);
+    name_index_rebuild(fs);
+    if (fat_mismatches > 0 || legacy) {
+        mark_fat_unsaved(fs);  // The copies in the file differ from the ones in memory
+    }
+
+    fs->cluster_checksums = checksums;
+    fs->zero_checksum = crc32c_zeros(0, description.cluster_size);
+    fs->fat_mismatches = fat_mismatches;
+    fs->fat_failover = fat_failover;
+
+    // From now on the records in the directory chains are the tree, the next save drops the old one.
+    // A read-only mount keeps the tree it read, there is no next save.
+    if (legacy && !mapped) {
+        tree_walk(&fs->root_directory, convert_item, NULL, fs);
+        fs->description.features |= FS_FEATURE_DIRECTORY_CLUSTERS;
+    }
+    versions_rebuild(fs);
+
+    STAT_INC(STAT_LOAD_COUNT);
+    STAT_ELAPSED(STAT_LOAD_NS, load_start);
+    TRACE_END(trace_load_ns, "load", "pf_load");
+    return PF_OK;
+}
+
+// Saves the filesystem and reports the result to the session, a failure sets its process_error
+void save_system_state(FileSystem *fs, Session *session, const char *filename) {
+    PfResult result = pf_save(fs, filename);
+    if (result != PF_OK) {
+        fprintf(SESSION_ERR(session), "Failed to save filesystem state to %s: %s\n", filename, pf_strerror(result));
+        if (session) {
+            session->process_error = true;
+        }
+        return;
+    }
+    fprintf(SESSION_OUT(session), "Filesystem state saved to %s\n", filename);
+}
+
+// Loads the filesystem, a missing image is created empty and waits for `format`
+void load_system_state(FileSystem *fs, Session *session, const char *filename) {
+    PfResult result = pf_load(fs, filename);
+    if (result == PF_ERR_NOT_FOUND && fs->read_only) {
+        fprintf(SESSION_ERR(session), "Failed to load filesystem state from %s: %s\n", filename, pf_strerror(result));
+        return;
+    }
+    if (result == PF_ERR_NOT_FOUND) {
+        fprintf(SESSION_OUT(session), "Filesystem file not found. Use 'format' to initialize.\n");
+        FILE *file = fopen(filename, "wb"); // Create an empty file
+        if (!file) {
+            perror("Failed to create empty filesystem file");
+            exit(EXIT_FAILURE);
+        }
+        fclose(file);
+        return;
+    }
+    if (result != PF_OK) {
+        fprintf(SESSION_ERR(session), "Failed to load filesystem state from %s: %s\n", filename, pf_strerror(result));
+        return;
+    }
+
+    // Set the current directory to root
+    if (session) {
+        session->current_directory = &fs->root_directory;
+    }
+    fprintf(SESSION_OUT(session), "Filesystem state loaded from %s\n", filename);
+    if (fs->fat_mismatches > 0) {
+        fprintf(SESSION_ERR(session), "Warning: the FAT copies disagreed on %d entries, %s\n", fs->fat_mismatches,
+                fs->fat_failover ? "FAT1 is damaged and was restored from FAT2" : "FAT2 was restored from FAT1");
+    }
+}
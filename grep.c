@@ -0,0 +1,238 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "FatTable.h"
+#include "PseudoFat.h"
+#include "Stats.h"
+#include "Traverse.h"
+
+// File name: grep.c
+// Description: Content search behind `grep`. Files are handed out to a small pool of threads,
+//              each scans its cluster chains in place, pinned one cluster at a time. memchr() finds the first byte
+//              of the pattern, the second byte and then the rest are compared only at its hits.
+//              Contents are not verified against the checksums, check and scrub do that.
+
+#define GREP_MAX_THREADS 8
+#define GREP_PATH_SIZE 4096
+
+// Match offsets of one file
+typedef struct GrepMatches {
+    int64_t *offsets;
+    size_t count;
+    size_t capacity;
+    bool failed;                // Out of memory or a read error, later matches are missing
+} GrepMatches;
+
+typedef struct GrepJob {
+    FileSystem *fs;
+    const char *pattern;
+    size_t length;
+    DirectoryItem **files;
+    size_t file_count;
+    size_t next;                // Next file to take, shared by the workers
+    GrepMatches *matches;       // One per file
+} GrepJob;
+
+static void add_offset(GrepMatches *matches, int64_t offset) {
+    if (matches->count == matches->capacity) {
+        size_t capacity = matches->capacity ? matches->capacity * 2 : 16;
+        int64_t *offsets = realloc(matches->offsets, capacity * sizeof(int64_t));
+        if (!offsets) {
+            matches->failed = true;
+            return;
+        }
+        matches->offsets = offsets;
+        matches->capacity = capacity;
+    }
+    matches->offsets[matches->count++] = offset;
+}
+
+// Adds every match that starts in data[0, size - length] to matches, base is the stream offset of data
+static void scan_block(const char *data, size_t size, const char *pattern, size_t length, int64_t base, GrepMatches *matches) {
+    if (size < length) return;
+
+    const char *end = data + size - length + 1;  // Last possible start + 1
+    const char *p = data;
+    while (p < end && (p = memchr(p, (unsigned char)pattern[0], (size_t)(end - p))) != NULL) {
+        if ((length < 2 || p[1] == pattern[1]) && memcmp(p, pattern, length) == 0) {
+            add_offset(matches, base + (p - data));
+        }
+        p++;
+    }
+}
+
+// Scans one file. The last length - 1 bytes of the stream are kept in carry, so a match that
+// starts in earlier clusters is found once the cluster holding its last byte arrives.
+static void scan_file(GrepJob *job, const DirectoryItem *item, char *window, GrepMatches *matches) {
+    FileSystem *fs = job->fs;
+    size_t length = job->length;
+    size_t keep = length - 1;
+    size_t carry = 0;                           // Bytes of window holding the stream tail
+    int64_t position = 0;                       // Stream offset of the current chunk
+    int64_t size = item->size;
+
+    if (item->is_inline) {
+        if (size <= INLINE_CAPACITY(item->item_name)) {
+            scan_block(item->inline_data, (size_t)size, job->pattern, length, 0, matches);
+            STAT_ADD(STAT_BYTES_READ, size);
+        }
+        return;
+    }
+
+    size_t cluster_size = (size_t)fs->description.cluster_size;
+    int32_t cluster = item->start_cluster;
+    for (int32_t links = 0; position < size && links < fs->description.cluster_count; links++) {
+        if (cluster < 0 || cluster >= fs->description.cluster_count) {
+            break;  // Broken chain, check reports it
+        }
+        const char *chunk = cluster_pin(fs, cluster, true);
+        if (!chunk) {
+            matches->failed = true;
+            break;
+        }
+        size_t chunk_size = size - position < (int64_t)cluster_size ? (size_t)(size - position) : cluster_size;
+
+        // Matches that start in the carried tail and end in this chunk
+        if (carry > 0) {
+            size_t head = chunk_size < keep ? chunk_size : keep;
+            memcpy(window + carry, chunk, head);
+            size_t window_size = carry + head;
+            size_t limit = carry + length - 1;  // Starts past the carried bytes belong to the chunk scan
+            scan_block(window, window_size < limit ? window_size : limit, job->pattern, length,
+                       position - (int64_t)carry, matches);
+        }
+
+        scan_block(chunk, chunk_size, job->pattern, length, position, matches);
+
+        // Carry the last keep bytes of the stream
+        if (keep > 0) {
+            if (chunk_size >= keep) {
+                memcpy(window, chunk + chunk_size - keep, keep);
+                carry = keep;
+            } else {
+                size_t total = carry + chunk_size;
+                size_t drop = total > keep ? total - keep : 0;
+                memmove(window, window + drop, carry - drop);
+                memcpy(window + carry - drop, chunk, chunk_size);
+                carry = total - drop;
+            }
+        }
+
+        cluster_unpin(fs, cluster, false);
+        position += (int64_t)chunk_size;
+        STAT_INC(STAT_FAT_LINKS);
+        cluster = fs->fat_table1[cluster];
+    }
+    STAT_ADD(STAT_BYTES_READ, position);
+}
+
+static void *grep_worker(void *arg) {
+    GrepJob *job = arg;
+    char *window = malloc(job->length > 1 ? 2 * (job->length - 1) : 1);
+    size_t i;
+    while ((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->file_count) {
+        if (!window) {
+            job->matches[i].failed = true;
+            continue;
+        }
+        scan_file(job, job->files[i], window, &job->matches[i]);
+    }
+    free(window);
+    return NULL;
+}
+
+// Files found so far, in tree order
+typedef struct GrepFiles {
+    DirectoryItem **files;
+    size_t count;
+    size_t capacity;
+    bool recursive;
+} GrepFiles;
+
+// Collects the files to search: the files of a directory, or all below it
+static TreeAction collect_file(TreeVisit *visit, void *context) {
+    GrepFiles *found = context;
+    DirectoryItem *item = visit->item;
+    if (!item->isFile) {
+        return visit->depth == 0 || found->recursive ? TREE_CONTINUE : TREE_SKIP;
+    }
+    if (found->count == found->capacity) {
+        size_t grown = found->capacity ? found->capacity * 2 : 64;
+        DirectoryItem **resized = realloc(found->files, grown * sizeof(DirectoryItem *));
+        if (!resized) return TREE_STOP;
+        found->files = resized;
+        found->capacity = grown;
+    }
+    found->files[found->count++] = item;
+    return TREE_CONTINUE;
+}
+
+PfResult pf_grep(FileSystem *fs, Session *session, const char *pattern, const char *path, bool recursive,
+                 PfGrepCallback callback, void *context) {
+    if (!fs->fat_table1) {
+        return PF_ERR_NOT_FORMATTED;
+    }
+    if (!pattern || !*pattern) {
+        return PF_ERR_INVALID_ARGUMENT;
+    }
+    if (!path || !*path) {
+        return PF_ERR_INVALID_PATH;
+    }
+    DirectoryItem *start = session && session->current_directory ? session->current_directory : &fs->root_directory;
+    DirectoryItem *item = find_item_by_path(fs, path, start);
+    if (!item) {
+        return PF_ERR_NOT_FOUND;
+    }
+
+    GrepFiles found = { NULL, 0, 0, recursive };
+    if (tree_walk(item, collect_file, NULL, &found) != PF_OK) {
+        free(found.files);
+        return PF_ERR_NO_MEMORY;
+    }
+    DirectoryItem **files = found.files;
+    size_t file_count = found.count;
+    if (file_count == 0) {
+        free(files);
+        return PF_OK;
+    }
+
+    GrepMatches *matches = calloc(file_count, sizeof(GrepMatches));
+    if (!matches) {
+        free(files);
+        return PF_ERR_NO_MEMORY;
+    }
+    GrepJob job = { fs, pattern, strlen(pattern), files, file_count, 0, matches };
+
+    // The calling thread scans too, workers only pay off with several files
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int threads = cpus < 1 ? 1 : cpus > GREP_MAX_THREADS ? GREP_MAX_THREADS : (int)cpus;
+    if ((size_t)threads > file_count) threads = (int)file_count;
+    pthread_t workers[GREP_MAX_THREADS];
+    int started = 0;
+    while (started < threads - 1 && pthread_create(&workers[started], NULL, grep_worker, &job) == 0) {
+        started++;
+    }
+    grep_worker(&job);
+    for (int i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+
+    // Report in tree order, offsets ascending within a file
+    bool complete = true;
+    char item_path[GREP_PATH_SIZE];
+    for (size_t i = 0; i < file_count; i++) {
+        complete &= !matches[i].failed;
+        if (matches[i].count > 0 && get_item_path(files[i], item_path, sizeof(item_path))) {
+            for (size_t j = 0; j < matches[i].count; j++) {
+                callback(item_path, matches[i].offsets[j], context);
+            }
+        }
+        free(matches[i].offsets);
+    }
+    free(matches);
+    free(files);
+    return complete ? PF_OK : PF_ERR_NO_MEMORY;
+}
@@ -0,0 +1,173 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "IoQueue.h"
+#include "Stats.h"
+
+// File name: ioqueue.c
+// Description: Thread-pool backend of the I/O queue. Submitted requests wait in a ring of depth
+//              entries, the I/O threads take them oldest first and report the completion to the
+//              batch the request belongs to.
+
+typedef struct IoRequest {
+    IoBatch *batch;
+    int fd;
+    char *buffer;
+    size_t size;
+    off_t offset;
+    bool write;
+} IoRequest;
+
+struct IoQueue {
+    IoRequest *ring;                     // depth entries
+    int depth;
+    int head;                            // Next request to run
+    int count;                           // Requests waiting in the ring
+    int active;                          // Requests waiting or running, depth at most
+    bool stop;
+    pthread_t threads[IO_MAX_THREADS];
+    int thread_count;
+    pthread_mutex_t mutex;               // Protects everything above and every batch
+    pthread_cond_t submitted;            // A request arrived or stop was set
+    pthread_cond_t taken;                // A request completed, there is room for another
+    pthread_cond_t completed;            // A batch lost a pending request
+};
+
+// Runs one request to the end, a read that reaches the end of the file fails
+static bool perform(const IoRequest *request) {
+    char *buffer = request->buffer;
+    size_t size = request->size;
+    off_t offset = request->offset;
+    while (size > 0) {
+        ssize_t done = request->write ? pwrite(request->fd, buffer, size, offset)
+                                      : pread(request->fd, buffer, size, offset);
+        if (done < 0 && errno == EINTR) continue;
+        if (done <= 0) return false;
+        buffer += done;
+        size -= (size_t)done;
+        offset += done;
+    }
+    return true;
+}
+
+static void complete(IoQueue *queue, IoBatch *batch, bool ok) {
+    batch->failed |= !ok;
+    batch->pending--;
+    queue->active--;
+    pthread_cond_signal(&queue->taken);
+    pthread_cond_broadcast(&queue->completed);
+}
+
+static void *io_main(void *arg) {
+    IoQueue *queue = (IoQueue *)arg;
+
+    pthread_mutex_lock(&queue->mutex);
+    while (true) {
+        while (queue->count == 0 && !queue->stop) {
+            pthread_cond_wait(&queue->submitted, &queue->mutex);
+        }
+        if (queue->count == 0) break;  // Stopped and drained
+
+        IoRequest request = queue->ring[queue->head];
+        queue->head = (queue->head + 1) % queue->depth;
+        queue->count--;
+        pthread_mutex_unlock(&queue->mutex);
+
+        bool ok = perform(&request);
+
+        pthread_mutex_lock(&queue->mutex);
+        complete(queue, request.batch, ok);
+    }
+    pthread_mutex_unlock(&queue->mutex);
+    return NULL;
+}
+
+IoQueue *io_queue_create(int depth) {
+    IoQueue *queue = calloc(1, sizeof(IoQueue));
+    if (!queue) return NULL;
+
+    queue->depth = depth > 0 ? depth : 1;
+    queue->ring = malloc((size_t)queue->depth * sizeof(IoRequest));
+    if (!queue->ring) {
+        free(queue);
+        return NULL;
+    }
+    pthread_mutex_init(&queue->mutex, NULL);
+    pthread_cond_init(&queue->submitted, NULL);
+    pthread_cond_init(&queue->taken, NULL);
+    pthread_cond_init(&queue->completed, NULL);
+
+    int threads = queue->depth < IO_MAX_THREADS ? queue->depth : IO_MAX_THREADS;
+    while (queue->thread_count < threads &&
+           pthread_create(&queue->threads[queue->thread_count], NULL, io_main, queue) == 0) {
+        queue->thread_count++;
+    }
+    return queue;
+}
+
+void io_queue_release(IoQueue *queue) {
+    if (!queue) return;
+
+    pthread_mutex_lock(&queue->mutex);
+    queue->stop = true;
+    pthread_cond_broadcast(&queue->submitted);
+    pthread_mutex_unlock(&queue->mutex);
+    for (int i = 0; i < queue->thread_count; i++) {
+        pthread_join(queue->threads[i], NULL);
+    }
+
+    pthread_mutex_destroy(&queue->mutex);
+    pthread_cond_destroy(&queue->submitted);
+    pthread_cond_destroy(&queue->taken);
+    pthread_cond_destroy(&queue->completed);
+    free(queue->ring);
+    free(queue);
+}
+
+static void submit(IoQueue *queue, IoBatch *batch, int fd, char *buffer, size_t size, off_t offset, bool write) {
+    IoRequest request = { batch, fd, buffer, size, offset, write };
+    STAT_INC(STAT_IO_REQUESTS);
+
+    pthread_mutex_lock(&queue->mutex);
+    while (queue->active == queue->depth) {
+        pthread_cond_wait(&queue->taken, &queue->mutex);
+    }
+    batch->pending++;
+    queue->active++;
+    if (queue->thread_count == 0) {
+        pthread_mutex_unlock(&queue->mutex);
+        bool ok = perform(&request);
+        pthread_mutex_lock(&queue->mutex);
+        complete(queue, batch, ok);
+        pthread_mutex_unlock(&queue->mutex);
+        return;
+    }
+
+    queue->ring[(queue->head + queue->count) % queue->depth] = request;
+    queue->count++;
+    pthread_cond_signal(&queue->submitted);
+    pthread_mutex_unlock(&queue->mutex);
+}
+
+void io_read(IoQueue *queue, IoBatch *batch, int fd, void *buffer, size_t size, off_t offset) {
+    submit(queue, batch, fd, buffer, size, offset, false);
+}
+
+void io_write(IoQueue *queue, IoBatch *batch, int fd, const void *buffer, size_t size, off_t offset) {
+    submit(queue, batch, fd, (char *)(uintptr_t)buffer, size, offset, true);
+}
+
+bool io_wait(IoQueue *queue, IoBatch *batch) {
+    pthread_mutex_lock(&queue->mutex);
+    while (batch->pending > 0) {
+        pthread_cond_wait(&queue->completed, &queue->mutex);
+    }
+    bool ok = !batch->failed;
+    batch->failed = false;
+    pthread_mutex_unlock(&queue->mutex);
+    return ok;
+}
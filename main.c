@@ -1,25 +1,237 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include "FatTable.h"
+#include "Stats.h"
+#include "Trace.h"
+#include "Server.h"
+
+#define BATCH_MAX_COMMANDS 32   // Number of distinct command names tracked in the timing report
+
+// Timing totals of one command name in batch mode
+typedef struct BatchTiming {
+    char name[16];
+    long count;
+    double total_ms;
+    double max_ms;
+} BatchTiming;
+
+static double now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static void record_timing(BatchTiming *timings, int *timing_count, const char *command, double elapsed_ms) {
+    char name[16];
+    size_t len = strcspn(command, " \t");
+    if (len >= sizeof(name)) len = sizeof(name) - 1;
+    memcpy(name, command, len);
+    name[len] = '\0';
+
+    BatchTiming *t = NULL;
+    for (int i = 0; i < *timing_count; i++) {
+        if (strcmp(timings[i].name, name) == 0) {
+            t = &timings[i];
+            break;
+        }
+    }
+    if (!t) {
+        if (*timing_count >= BATCH_MAX_COMMANDS) return;
+        t = &timings[(*timing_count)++];
+        memset(t, 0, sizeof(*t));
+        strcpy(t->name, name);
+    }
+
+    t->count++;
+    t->total_ms += elapsed_ms;
+    if (elapsed_ms > t->max_ms) t->max_ms = elapsed_ms;
+}
+
+// Runs commands from a script (or stdin for "-") back to back without prompts.
+// The image is written once at the end, or every commit_every commands if it is > 0.
+static int run_batch(FileSystem *fs, Session *session, const char *script, long commit_every, bool verbose) {
+    FILE *input = strcmp(script, "-") == 0 ? stdin : fopen(script, "r");
+    if (!input) {
+        fprintf(stderr, "Failed to open batch script '%s'.\n", script);
+        return 1;
+    }
+
+    // Per-command output is not interesting in batch runs, the report goes to stderr
+    if (!verbose && !freopen("/dev/null", "w", stdout)) {
+        fprintf(stderr, "Failed to silence standard output.\n");
+    }
+
+    fs->defer_save = true;
+    load_system_state(fs, session, fs->image_path);
+
+    char *line = NULL;       // Reused by getline, grows to the longest line
+    size_t line_capacity = 0;
+    BatchTiming timings[BATCH_MAX_COMMANDS];
+    int timing_count = 0;
+    long executed = 0;
+    long line_number = 0;
+    long failed = 0;
+    long commits = 0;
+    long failed_commits = 0;    // Refused while read-only mounts hold the image, or an I/O error
+    double commit_ms = 0;
+    double start = now_ms();
+
+    while (getline(&line, &line_capacity, input) != -1) {
+        line[strcspn(line, "\r\n")] = '\0';
+        line_number++;
+
+        char *command = line;
+        while (*command == ' ' || *command == '\t') command++;
+        if (*command == '\0' || *command == '#') continue;   // Blank lines and comments
+        if (strcmp(command, "exit") == 0) break;
+
+        double command_start = now_ms();
+        session->process_error = false;
+        execute_command(fs, session, command);
+        record_timing(timings, &timing_count, command, now_ms() - command_start);
+        executed++;
+
+        // Standard output may be silenced, failures always reach stderr (the line holds the command name now)
+        if (session->process_error) {
+            fprintf(stderr, "Command on line %ld failed: %s\n", line_number, command);
+            failed++;
+        }
+
+        if (commit_every > 0 && executed % commit_every == 0 && fs->fat_table1 && !fs->read_only) {
+            double commit_start = now_ms();
+            session->process_error = false;
+            save_system_state(fs, session, fs->image_path);
+            commit_ms += now_ms() - commit_start;
+            commits++;
+            failed_commits += session->process_error;
+        }
+    }
+
+    free(line);
+    if (input != stdin) fclose(input);
+
+    // Final commit, other readers may share a read-only image
+    if (fs->fat_table1 && !fs->read_only) {
+        double commit_start = now_ms();
+        session->process_error = false;
+        save_system_state(fs, session, fs->image_path);
+        commit_ms += now_ms() - commit_start;
+        commits++;
+        failed_commits += session->process_error;
+    }
+
+    double total_ms = now_ms() - start;
+
+    fprintf(stderr, "Batch: %ld commands in %.3f ms (%.0f commands/s), %ld commits taking %.3f ms\n",
+            executed, total_ms, total_ms > 0 ? executed / (total_ms / 1000.0) : 0.0, commits, commit_ms);
+    fprintf(stderr, "%-12s %10s %12s %12s %12s\n", "Command", "Count", "Total ms", "Avg ms", "Max ms");
+    for (int i = 0; i < timing_count; i++) {
+        fprintf(stderr, "%-12s %10ld %12.3f %12.4f %12.4f\n", timings[i].name, timings[i].count,
+                timings[i].total_ms, timings[i].total_ms / timings[i].count, timings[i].max_ms);
+    }
+
+    if (failed > 0) {
+        fprintf(stderr, "Batch: %ld of %ld commands failed\n", failed, executed);
+    }
+    if (failed_commits > 0) {
+        fprintf(stderr, "Batch: %ld of %ld commits failed\n", failed_commits, commits);
+    }
+    if (failed > 0 || failed_commits > 0) {
+        return 1;
+    }
+    return 0;
+}
 
 int main(int argc, char *argv[]) {
-    if (argc != 2) {
-        printf("Usage: %s <filesystem_name>\n", argv[0]);
+    if (argc < 2) {
+        printf("Usage: %s <filesystem_name> [--batch <script>|- [--verbose] | --serve <socket>] [--commit-every N] [--cache <MB> | --read-only] [--io-depth N] [--stats <file>] [--trace <file>]\n", argv[0]);
+        printf("       %s --connect <socket>\n", argv[0]);
         return 1;
     }
 
+    if (strcmp(argv[1], "--connect") == 0) {
+        if (argc != 3) {
+            printf("Usage: %s --connect <socket>\n", argv[0]);
+            return 1;
+        }
+        return run_client(argv[2]);
+    }
+
     const char *filesystem_name = argv[1];
-    char command[100];
+    const char *batch_script = NULL;
+    const char *socket_path = NULL;
+    long commit_every = 0;
+    bool verbose = false;
+    long cache_mb = 0;
+    long io_depth = 0;
+    bool read_only = false;
+    const char *stats_file = NULL;
+    const char *trace_file = NULL;
+
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+            batch_script = argv[++i];
+        } else if (strcmp(argv[i], "--serve") == 0 && i + 1 < argc) {
+            socket_path = argv[++i];
+        } else if (strcmp(argv[i], "--commit-every") == 0 && i + 1 < argc) {
+            commit_every = strtol(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--cache") == 0 && i + 1 < argc) {
+            cache_mb = strtol(argv[++i], NULL, 10);  // The image stays on disk behind this much cache
+        } else if (strcmp(argv[i], "--io-depth") == 0 && i + 1 < argc) {
+            io_depth = strtol(argv[++i], NULL, 10);  // Host requests in flight during save, load, incp and outcp
+        } else if (strcmp(argv[i], "--read-only") == 0) {
+            read_only = true;  // Map the image shared, refuse changes and never save
+        } else if (strcmp(argv[i], "--verbose") == 0) {
+            verbose = true;
+        } else if (strcmp(argv[i], "--stats") == 0 && i + 1 < argc) {
+            stats_file = argv[++i];
+        } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            trace_file = argv[++i];
+        } else {
+            printf("Unknown option '%s'.\n", argv[i]);
+            return 1;
+        }
+    }
+
+    // Trace the whole session, including the initial load and the final save
+    if (trace_file && trace_start(0) != 0) {
+        return 1;
+    }
+
+    FileSystem fs;        // The filesystem of this process
+    Session shell;        // Session of the interactive shell or the batch script
+    fs_init(&fs, filesystem_name);
+    fs.cache_budget = cache_mb > 0 ? (size_t)cache_mb * 1024 * 1024 : 0;
+    if (io_depth > 0) {
+        fs.io_depth = (int)io_depth;
+    }
+    fs.read_only = read_only;
+    session_init(&shell, &fs);
+
+    if (batch_script || socket_path) {
+        int result = batch_script ? run_batch(&fs, &shell, batch_script, commit_every, verbose)
+                                  : run_server(&fs, socket_path, commit_every);
+        fs_release(&fs);
+        if (stats_file) stats_dump_file(stats_file);
+        if (trace_file) trace_stop(trace_file);
+        return result;
+    }
+
+    char *command = NULL;    // Reused by getline, no limit on the line length
+    size_t command_capacity = 0;
 
     // Načti stav souborového systému
-    load_system_state(filesystem_name);
+    load_system_state(&fs, &shell, filesystem_name);
     
 
     printf("Filesystem ready. Enter commands:\n");
     while (1) {
         printf("> ");
-        if (!fgets(command, sizeof(command), stdin)) {
+        if (getline(&command, &command_capacity, stdin) == -1) {
             printf("\n");
             break; // Konec programu
         }
@@ -32,11 +244,23 @@ int main(int argc, char *argv[]) {
             break;
         }
 
-        process_command(filesystem_name, command);
+        execute_command(&fs, &shell, command);
     }
 
+    free(command);
+
     // Uložení souborového systému při ukončení
-    save_system_state(filesystem_name);
+    if (fs.fat_table1 && !fs.read_only) {
+        save_system_state(&fs, &shell, filesystem_name);
+    }
+    fs_release(&fs);
+
+    if (stats_file) {
+        stats_dump_file(stats_file);
+    }
+    if (trace_file) {
+        trace_stop(trace_file);
+    }
 
     return 0;
 }
@@ -0,0 +1,172 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "NameIndex.h"
+#include "Traverse.h"
+
+// File name: nameindex.c
+// Description: Hash chains over the items of the tree by name and by extension. Without memory
+//              for the index fs->name_index stays NULL and `find` walks the tree instead.
+
+struct NameIndex {
+    DirectoryItem **names;               // Buckets by full name
+    DirectoryItem **extensions;          // Buckets by extension, names without one are not here
+    size_t bucket_count;                 // Power of two
+    size_t count;                        // Items in names
+};
+
+// FNV-1a
+static size_t hash_name(const char *name) {
+    uint32_t hash = 2166136261u;
+    for (const unsigned char *c = (const unsigned char *)name; *c; c++) {
+        hash = (hash ^ *c) * 16777619u;
+    }
+    return hash;
+}
+
+const char *name_extension(const char *name) {
+    const char *dot = strrchr(name, '.');
+    return dot && dot[1] ? dot + 1 : NULL;
+}
+
+static void link_item(NameIndex *index, DirectoryItem *item) {
+    size_t mask = index->bucket_count - 1;
+    DirectoryItem **bucket = &index->names[hash_name(item->item_name) & mask];
+    item->name_next = *bucket;
+    *bucket = item;
+
+    const char *extension = name_extension(item->item_name);
+    item->extension_next = NULL;
+    if (extension) {
+        bucket = &index->extensions[hash_name(extension) & mask];
+        item->extension_next = *bucket;
+        *bucket = item;
+    }
+    index->count++;
+}
+
+// Doubles the bucket count, a failed allocation keeps the old (longer) chains
+static void grow(NameIndex *index) {
+    size_t bucket_count = index->bucket_count * 2;
+    DirectoryItem **names = calloc(bucket_count, sizeof(DirectoryItem *));
+    DirectoryItem **extensions = calloc(bucket_count, sizeof(DirectoryItem *));
+    if (!names || !extensions) {
+        free(names);
+        free(extensions);
+        return;
+    }
+
+    DirectoryItem **old_names = index->names;
+    size_t old_count = index->bucket_count;
+    free(index->extensions);
+    index->names = names;
+    index->extensions = extensions;
+    index->bucket_count = bucket_count;
+    index->count = 0;
+    for (size_t i = 0; i < old_count; i++) {
+        DirectoryItem *item = old_names[i];
+        while (item) {
+            DirectoryItem *next = item->name_next;
+            link_item(index, item);
+            item = next;
+        }
+    }
+    free(old_names);
+}
+
+void name_index_add(FileSystem *fs, DirectoryItem *item) {
+    NameIndex *index = fs->name_index;
+    if (!index) return;
+
+    if (index->count >= index->bucket_count * 2) {
+        grow(index);
+    }
+    link_item(index, item);
+}
+
+void name_index_remove(FileSystem *fs, DirectoryItem *item) {
+    NameIndex *index = fs->name_index;
+    if (!index) return;
+
+    size_t mask = index->bucket_count - 1;
+    for (DirectoryItem **link = &index->names[hash_name(item->item_name) & mask]; *link; link = &(*link)->name_next) {
+        if (*link == item) {
+            *link = item->name_next;
+            index->count--;
+            break;
+        }
+    }
+
+    const char *extension = name_extension(item->item_name);
+    if (extension) {
+        for (DirectoryItem **link = &index->extensions[hash_name(extension) & mask]; *link; link = &(*link)->extension_next) {
+            if (*link == item) {
+                *link = item->extension_next;
+                break;
+            }
+        }
+    }
+    item->name_next = NULL;
+    item->extension_next = NULL;
+}
+
+static TreeAction remove_visit(TreeVisit *visit, void *context) {
+    if (visit->depth > 0) {
+        name_index_remove(context, visit->item);
+    }
+    return TREE_CONTINUE;
+}
+
+void name_index_remove_subtree(FileSystem *fs, DirectoryItem *dir) {
+    tree_walk(dir, NULL, remove_visit, fs);
+}
+
+static TreeAction add_visit(TreeVisit *visit, void *context) {
+    if (visit->depth > 0) {
+        name_index_add(context, visit->item);
+    }
+    return TREE_CONTINUE;
+}
+
+void name_index_release(FileSystem *fs) {
+    NameIndex *index = fs->name_index;
+    if (!index) return;
+
+    free(index->names);
+    free(index->extensions);
+    free(index);
+    fs->name_index = NULL;
+}
+
+void name_index_rebuild(FileSystem *fs) {
+    name_index_release(fs);
+
+    NameIndex *index = calloc(1, sizeof(NameIndex));
+    if (index) {
+        index->bucket_count = NAME_INDEX_BUCKETS;
+        index->names = calloc(index->bucket_count, sizeof(DirectoryItem *));
+        index->extensions = calloc(index->bucket_count, sizeof(DirectoryItem *));
+        if (!index->names || !index->extensions) {
+            free(index->names);
+            free(index->extensions);
+            free(index);
+            return;  // find falls back to walking the tree
+        }
+    }
+    fs->name_index = index;
+    if (index) {
+        tree_walk(&fs->root_directory, add_visit, NULL, fs);
+    }
+}
+
+DirectoryItem *name_index_names(FileSystem *fs, const char *name) {
+    NameIndex *index = fs->name_index;
+    return index ? index->names[hash_name(name) & (index->bucket_count - 1)] : NULL;
+}
+
+DirectoryItem *name_index_extensions(FileSystem *fs, const char *extension) {
+    NameIndex *index = fs->name_index;
+    return index ? index->extensions[hash_name(extension) & (index->bucket_count - 1)] : NULL;
+}
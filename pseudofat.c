@@ -0,0 +1,52 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include "FatTable.h"
+#include "PseudoFat.h"
+
+// File name: pseudofat.c
+// Description: Lifecycle and error reporting of libpseudofat, the operations live in
+//              filesystem.c (image) and directory.c (namespace and file data).
+
+const char *pf_strerror(PfResult result) {
+    switch (result) {
+        case PF_OK:                   return "OK";
+        case PF_END:                  return "END";
+        case PF_ERR_NOT_FORMATTED:    return "NOT FORMATTED";
+        case PF_ERR_INVALID_ARGUMENT: return "INVALID ARGUMENT";
+        case PF_ERR_INVALID_PATH:     return "INVALID PATH";
+        case PF_ERR_NOT_FOUND:        return "FILE NOT FOUND";
+        case PF_ERR_PATH_NOT_FOUND:   return "PATH NOT FOUND";
+        case PF_ERR_NOT_A_DIRECTORY:  return "NOT A DIRECTORY";
+        case PF_ERR_NOT_A_FILE:       return "NOT A FILE";
+        case PF_ERR_EXISTS:           return "EXIST";
+        case PF_ERR_NOT_EMPTY:        return "NOT EMPTY";
+        case PF_ERR_DIRECTORY_FULL:   return "DIRECTORY FULL";
+        case PF_ERR_NO_SPACE:         return "NO SPACE LEFT";
+        case PF_ERR_NO_MEMORY:        return "OUT OF MEMORY";
+        case PF_ERR_IO:               return "I/O ERROR";
+        case PF_ERR_CORRUPTED:        return "CORRUPTED";
+        case PF_ERR_READ_ONLY:        return "READ-ONLY FILESYSTEM";
+        case PF_ERR_BUSY:             return "IMAGE IN USE";
+    }
+    return "UNKNOWN ERROR";
+}
+
+// A missing image is not an error, the filesystem just stays unformatted
+PfResult pf_open(FileSystem *fs, const char *image_path) {
+    fs_init(fs, image_path);
+
+    PfResult result = pf_load(fs, image_path);
+    return result == PF_ERR_NOT_FOUND ? PF_OK : result;
+}
+
+// The image must exist, there is nothing to format
+PfResult pf_open_read_only(FileSystem *fs, const char *image_path) {
+    fs_init(fs, image_path);
+    fs->read_only = true;
+    return pf_load(fs, image_path);
+}
+
+void pf_close(FileSystem *fs) {
+    fs_release(fs);
+}
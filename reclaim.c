@@ -0,0 +1,285 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+#include "FatTable.h"
+#include "NameIndex.h"
+#include "PseudoFat.h"
+#include "Stats.h"
+#include "Traverse.h"
+
+// File name: reclaim.c
+// Description: Reclamation of removed subtrees behind `rm -r`. A detached subtree is flattened
+//              into one batch of items, then all of their chains are released in a single pass
+//              over the reference counts and the FAT. A background thread can take over both
+//              steps, only the release needs the filesystem lock. Save, format, load and release
+//              finish whatever is still pending first.
+
+#define RECLAIM_RETRY_MS 1              // Wait when a command holds the lock
+
+// One detached subtree
+typedef struct ReclaimJob {
+    DirectoryItem *root;
+    DirectoryItem **items;              // Every item of the subtree, children before their parent
+    size_t item_count;
+    size_t item_capacity;
+    bool collected;                     // items is filled in
+    bool failed;                        // Out of memory while collecting, released by a tree walk
+    struct ReclaimJob *next;
+} ReclaimJob;
+
+typedef struct Reclaimer {
+    FileSystem *fs;
+    pthread_t thread;
+    pthread_mutex_t mutex;              // Protects everything below
+    pthread_cond_t wake;                // New job, end of a busy turn or stop request
+    bool running;
+    bool stop;
+    bool busy;                          // A job is being collected or released, one turn at a time
+    ReclaimJob *jobs;                   // Pending, oldest first
+    ReclaimJob **tail;
+} Reclaimer;
+
+static TreeAction collect_item(TreeVisit *visit, void *context) {
+    ReclaimJob *job = context;
+    if (job->item_count == job->item_capacity) {
+        size_t capacity = job->item_capacity ? job->item_capacity * 2 : 64;
+        DirectoryItem **items = realloc(job->items, capacity * sizeof(DirectoryItem *));
+        if (!items) return TREE_STOP;
+        job->items = items;
+        job->item_capacity = capacity;
+    }
+    job->items[job->item_count++] = visit->item;
+    return TREE_CONTINUE;
+}
+
+// Flattens the subtree, it is detached so no lock is needed
+static void collect_job(ReclaimJob *job) {
+    job->failed = tree_walk(job->root, NULL, collect_item, job) != PF_OK;
+    job->collected = true;
+}
+
+// Drops the chain of one item: file clusters lose a reference and are freed at zero, the chain
+// of a directory belongs to it alone. A damaged chain is followed no further than the disk is long.
+static void release_item(FileSystem *fs, DirectoryItem *item) {
+    if (item->isFile && item->is_inline) return;
+
+    int32_t cluster = item->start_cluster;
+    for (int32_t links = 0; cluster >= 0 && cluster < fs->description.cluster_count &&
+                            links < fs->description.cluster_count; links++) {
+        STAT_INC(STAT_FAT_LINKS);
+        int32_t next_cluster = fs->fat_table1[cluster];
+        if (item->isFile) {
+            int32_t *references = &fs->cluster_references[cluster];  // The loop keeps cluster in range
+            if (*references > 0) (*references)--;
+            if (*references == 0) {
+                free_cluster(fs, cluster);
+            }
+        } else {
+            free_cluster(fs, cluster);
+        }
+        cluster = next_cluster;
+    }
+}
+
+static TreeAction release_visit(TreeVisit *visit, void *context) {
+    FileSystem *fs = context;
+    release_item(fs, visit->item);
+    name_index_remove(fs, visit->item);
+    free(visit->item);
+    return TREE_CONTINUE;
+}
+
+// Releases the chains and index entries of a collected job and frees its items, the caller has
+// exclusive access to the filesystem
+static void release_job(FileSystem *fs, ReclaimJob *job) {
+    if (!job->collected) {
+        collect_job(job);
+    }
+    if (job->failed) {
+        tree_walk(job->root, NULL, release_visit, fs);  // Post-order, needs no memory once the stack fits
+    } else {
+        for (size_t i = 0; i < job->item_count; i++) {
+            if (i + 4 < job->item_count) {
+                __builtin_prefetch(job->items[i + 4]);
+            }
+            release_item(fs, job->items[i]);
+            name_index_remove(fs, job->items[i]);
+        }
+        for (size_t i = 0; i < job->item_count; i++) {
+            free(job->items[i]);
+        }
+    }
+    free(job->items);
+    job->items = NULL;
+}
+
+// Frees a detached subtree and its clusters right away
+void rm_recursive(FileSystem *fs, DirectoryItem *target) {
+    if (!target) return;
+
+    ReclaimJob job = { target, NULL, 0, 0, false, false, NULL };
+    release_job(fs, &job);
+}
+
+static void release_jobs(FileSystem *fs, ReclaimJob *jobs) {
+    while (jobs) {
+        ReclaimJob *next = jobs->next;
+        release_job(fs, jobs);
+        free(jobs);
+        jobs = next;
+    }
+}
+
+// Waits until the deadline or a signal, the reclaimer mutex must be held
+static void wait_ms(Reclaimer *reclaimer, double ms) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    long long ns = deadline.tv_nsec + (long long)(ms * 1e6);
+    deadline.tv_sec += ns / 1000000000;
+    deadline.tv_nsec = ns % 1000000000;
+    pthread_cond_timedwait(&reclaimer->wake, &reclaimer->mutex, &deadline);
+}
+
+static void *reclaim_main(void *arg) {
+    Reclaimer *reclaimer = (Reclaimer *)arg;
+    FileSystem *fs = reclaimer->fs;
+
+    pthread_mutex_lock(&reclaimer->mutex);
+    while (!reclaimer->stop) {
+        if (reclaimer->busy || !reclaimer->jobs) {
+            pthread_cond_wait(&reclaimer->wake, &reclaimer->mutex);
+            continue;
+        }
+
+        // Flatten the next subtree outside the filesystem lock
+        ReclaimJob *job = reclaimer->jobs;
+        while (job && job->collected) job = job->next;
+        if (job) {
+            reclaimer->busy = true;
+            pthread_mutex_unlock(&reclaimer->mutex);
+            collect_job(job);
+            pthread_mutex_lock(&reclaimer->mutex);
+            reclaimer->busy = false;
+            pthread_cond_broadcast(&reclaimer->wake);
+            continue;
+        }
+
+        // Release everything collected, never queue behind (or in front of) a command. The
+        // turn is only taken while holding the lock, so whoever waits for it never needs the lock.
+        pthread_mutex_unlock(&reclaimer->mutex);
+        if (pthread_rwlock_trywrlock(&fs->lock) != 0) {
+            pthread_mutex_lock(&reclaimer->mutex);
+            wait_ms(reclaimer, RECLAIM_RETRY_MS);
+            continue;
+        }
+        pthread_mutex_lock(&reclaimer->mutex);
+        if (reclaimer->busy || reclaimer->stop) {
+            pthread_rwlock_unlock(&fs->lock);
+            continue;
+        }
+        ReclaimJob *jobs = reclaimer->jobs;
+        reclaimer->jobs = NULL;
+        reclaimer->tail = &reclaimer->jobs;
+        reclaimer->busy = true;
+        pthread_mutex_unlock(&reclaimer->mutex);
+
+        release_jobs(fs, jobs);
+        pthread_rwlock_unlock(&fs->lock);
+
+        pthread_mutex_lock(&reclaimer->mutex);
+        reclaimer->busy = false;
+        pthread_cond_broadcast(&reclaimer->wake);
+    }
+
+    reclaimer->running = false;
+    pthread_mutex_unlock(&reclaimer->mutex);
+    return NULL;
+}
+
+// Queues a detached subtree for the background thread, which is started on first use
+bool reclaim_later(FileSystem *fs, DirectoryItem *target) {
+    Reclaimer *reclaimer = fs->reclaimer;
+    if (!reclaimer) {
+        reclaimer = calloc(1, sizeof(Reclaimer));
+        if (!reclaimer) {
+            return false;
+        }
+        reclaimer->fs = fs;
+        reclaimer->tail = &reclaimer->jobs;
+        pthread_mutex_init(&reclaimer->mutex, NULL);
+        pthread_cond_init(&reclaimer->wake, NULL);
+        fs->reclaimer = reclaimer;
+    }
+
+    ReclaimJob *job = calloc(1, sizeof(ReclaimJob));
+    if (!job) {
+        return false;
+    }
+    job->root = target;
+
+    pthread_mutex_lock(&reclaimer->mutex);
+    if (!reclaimer->running) {
+        reclaimer->stop = false;
+        reclaimer->running = pthread_create(&reclaimer->thread, NULL, reclaim_main, reclaimer) == 0;
+    }
+    if (!reclaimer->running) {
+        pthread_mutex_unlock(&reclaimer->mutex);
+        free(job);
+        return false;
+    }
+    *reclaimer->tail = job;
+    reclaimer->tail = &job->next;
+    STAT_INC(STAT_RECLAIM_DEFERRED);
+    pthread_cond_broadcast(&reclaimer->wake);
+    pthread_mutex_unlock(&reclaimer->mutex);
+    return true;
+}
+
+// Releases every pending subtree. The caller holds fs->lock exclusively or is the only thread
+// besides the reclaimer.
+void reclaim_finish(FileSystem *fs) {
+    Reclaimer *reclaimer = fs->reclaimer;
+    if (!reclaimer) return;
+
+    pthread_mutex_lock(&reclaimer->mutex);
+    while (reclaimer->busy) {
+        pthread_cond_wait(&reclaimer->wake, &reclaimer->mutex);
+    }
+    ReclaimJob *jobs = reclaimer->jobs;
+    reclaimer->jobs = NULL;
+    reclaimer->tail = &reclaimer->jobs;
+    reclaimer->busy = jobs != NULL;
+    pthread_mutex_unlock(&reclaimer->mutex);
+    if (!jobs) return;
+
+    release_jobs(fs, jobs);
+
+    pthread_mutex_lock(&reclaimer->mutex);
+    reclaimer->busy = false;
+    pthread_cond_broadcast(&reclaimer->wake);
+    pthread_mutex_unlock(&reclaimer->mutex);
+}
+
+// Finishes the pending work, stops the thread and frees the reclaimer
+void reclaim_release(FileSystem *fs) {
+    Reclaimer *reclaimer = fs->reclaimer;
+    if (!reclaimer) return;
+
+    reclaim_finish(fs);
+    pthread_mutex_lock(&reclaimer->mutex);
+    bool running = reclaimer->running;
+    reclaimer->stop = true;
+    pthread_cond_broadcast(&reclaimer->wake);
+    pthread_mutex_unlock(&reclaimer->mutex);
+    if (running) {
+        pthread_join(reclaimer->thread, NULL);
+    }
+    release_jobs(fs, reclaimer->jobs);  // Queued after the finish above, the thread is gone now
+
+    pthread_mutex_destroy(&reclaimer->mutex);
+    pthread_cond_destroy(&reclaimer->wake);
+    free(reclaimer);
+    fs->reclaimer = NULL;
+}
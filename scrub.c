@@ -0,0 +1,296 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include "FatTable.h"
+#include "PseudoFat.h"
+
+// File name: scrub.c
+// Description: Background scrubber. Walks the allocated clusters in FAT order, verifies their
+//              checksums and cross-checks the synced parts of both FAT copies, throttled to a fixed data rate.
+//              Progress is kept in <image>.scrub so the next session continues where this one stopped.
+
+#define SCRUB_BATCH_BYTES (256 * 1024)  // Cluster data verified per hold of the filesystem lock
+#define SCRUB_BATCH_ENTRIES 4096        // FAT entries inspected per hold at most
+#define SCRUB_BATCH_FINDINGS 16         // Findings logged per batch, further ones are only counted
+#define SCRUB_PERSIST_BATCHES 64        // The cursor is written every this many batches
+#define SCRUB_RETRY_MS 1                // Wait when a mutation holds the lock
+#define SCRUB_IDLE_MS 200               // Wait while no filesystem is formatted or loaded
+#define SCRUB_PASS_PAUSE_MS 1000        // Minimum wait after a complete pass
+#define SCRUB_STATE_PATH_SIZE 4096
+
+typedef struct Scrubber {
+    FileSystem *fs;
+    pthread_t thread;
+    pthread_mutex_t mutex;              // Protects everything below
+    pthread_cond_t wake;                // Signalled when the thread should stop
+    bool running;
+    bool stop;
+    double rate_mb_s;
+    int32_t cursor;
+    int32_t cluster_count;
+    uint64_t passes;
+    uint64_t clusters_checked;
+    uint64_t bytes_checked;
+    uint64_t findings;
+    PfScrubFinding log[PF_SCRUB_LOG_SIZE]; // Ring buffer, log_start is the oldest entry
+    int log_start;
+    int log_count;
+    char state_path[SCRUB_STATE_PATH_SIZE]; // Empty when the filesystem has no image
+} Scrubber;
+
+static void state_path(const FileSystem *fs, char *path) {
+    path[0] = '\0';
+    if (fs->image_path && snprintf(path, SCRUB_STATE_PATH_SIZE, "%s.scrub", fs->image_path) >= SCRUB_STATE_PATH_SIZE) {
+        path[0] = '\0';
+    }
+}
+
+// Reads the persisted cursor, pass and finding counts, missing or damaged state starts from zero
+static void load_state(const char *path, int32_t *cursor, uint64_t *passes, uint64_t *findings) {
+    *cursor = 0;
+    *passes = 0;
+    *findings = 0;
+
+    FILE *file = path[0] ? fopen(path, "r") : NULL;
+    if (!file) return;
+
+    unsigned long long p, f;
+    if (fscanf(file, "cursor %d passes %llu findings %llu", cursor, &p, &f) == 3 && *cursor >= 0) {
+        *passes = p;
+        *findings = f;
+    } else {
+        *cursor = 0;
+    }
+    fclose(file);
+}
+
+static void save_state(Scrubber *scrubber) {
+    FILE *file = scrubber->state_path[0] ? fopen(scrubber->state_path, "w") : NULL;
+    if (!file) return;
+
+    fprintf(file, "cursor %d passes %llu findings %llu\n", scrubber->cursor,
+            (unsigned long long)scrubber->passes, (unsigned long long)scrubber->findings);
+    fclose(file);
+}
+
+static void add_finding(PfScrubFinding *found, int *found_count, int64_t now, int32_t cluster, PfScrubIssue issue, int32_t fat1, int32_t fat2) {
+    if (*found_count < SCRUB_BATCH_FINDINGS) {
+        found[*found_count] = (PfScrubFinding){ now, cluster, issue, fat1, fat2 };
+    }
+    (*found_count)++;
+}
+
+// Waits until the deadline or a stop request, the scrubber mutex must be held
+static void wait_ms(Scrubber *scrubber, double ms) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    long long ns = deadline.tv_nsec + (long long)(ms * 1e6);
+    deadline.tv_sec += ns / 1000000000;
+    deadline.tv_nsec = ns % 1000000000;
+
+    while (!scrubber->stop && pthread_cond_timedwait(&scrubber->wake, &scrubber->mutex, &deadline) == 0) {
+    }
+}
+
+static void *scrub_main(void *arg) {
+    Scrubber *scrubber = (Scrubber *)arg;
+    FileSystem *fs = scrubber->fs;
+    int batches = 0;
+
+    // Lowest CPU priority, on Linux setpriority() with who = 0 affects the calling thread only
+    setpriority(PRIO_PROCESS, 0, 19);
+
+    pthread_mutex_lock(&scrubber->mutex);
+    while (!scrubber->stop) {
+        int32_t cursor = scrubber->cursor;
+        pthread_mutex_unlock(&scrubber->mutex);
+
+        // Never queue behind (or in front of) a mutation, just try again shortly
+        if (pthread_rwlock_tryrdlock(&fs->lock) != 0) {
+            pthread_mutex_lock(&scrubber->mutex);
+            wait_ms(scrubber, SCRUB_RETRY_MS);
+            continue;
+        }
+
+        PfScrubFinding found[SCRUB_BATCH_FINDINGS];
+        int found_count = 0;
+        uint64_t checked = 0;
+        size_t bytes = 0;
+        bool formatted = fs->fat_table1 != NULL;
+        bool wrapped = false;
+        int32_t cluster_count = formatted ? fs->description.cluster_count : 0;
+        int64_t now = (int64_t)time(NULL);
+
+        if (formatted) {
+            if (cursor >= cluster_count) {
+                cursor = 0;  // The image was formatted smaller in the meantime
+            }
+
+            for (int entries = 0; entries < SCRUB_BATCH_ENTRIES && bytes < SCRUB_BATCH_BYTES; entries++) {
+                int32_t fat1 = fs->fat_table1[cursor];
+                int32_t fat2 = fs->fat_table2[cursor];
+                bytes += 2 * sizeof(int32_t);
+
+                if (fat1 != FAT_UNUSED || fat2 != FAT_UNUSED) {
+                    checked++;
+                    if (fat1 != fat2 && !fs->fat_dirty[cursor / FAT_MIRROR_PAGE]) {  // Dirty pages are synced at the next save
+                        add_finding(found, &found_count, now, cursor, PF_SCRUB_FAT_MISMATCH, fat1, fat2);
+                    }
+                    if (fat1 != FAT_UNUSED && fat1 != FAT_FILE_END && fat1 != FAT_BAD_CLUSTER &&
+                        (fat1 < 0 || fat1 >= cluster_count)) {
+                        add_finding(found, &found_count, now, cursor, PF_SCRUB_BAD_LINK, fat1, fat2);
+                    }
+                    if (fat1 != FAT_UNUSED && fs->cluster_checksums) {
+                        bytes += (size_t)fs->description.cluster_size;
+                        if (!verify_cluster_checksum(fs, cursor)) {
+                            add_finding(found, &found_count, now, cursor, PF_SCRUB_CHECKSUM, fat1, fat2);
+                        }
+                    }
+                }
+
+                if (++cursor >= cluster_count) {
+                    cursor = 0;
+                    wrapped = true;
+                    break;
+                }
+            }
+        }
+        pthread_rwlock_unlock(&fs->lock);
+
+        pthread_mutex_lock(&scrubber->mutex);
+        scrubber->cursor = cursor;
+        scrubber->cluster_count = cluster_count;
+        scrubber->clusters_checked += checked;
+        scrubber->bytes_checked += bytes;
+        scrubber->findings += (uint64_t)found_count;
+        for (int i = 0; i < found_count && i < SCRUB_BATCH_FINDINGS; i++) {
+            int slot = (scrubber->log_start + scrubber->log_count) % PF_SCRUB_LOG_SIZE;
+            scrubber->log[slot] = found[i];
+            if (scrubber->log_count < PF_SCRUB_LOG_SIZE) {
+                scrubber->log_count++;
+            } else {
+                scrubber->log_start = (scrubber->log_start + 1) % PF_SCRUB_LOG_SIZE;
+            }
+        }
+        if (wrapped) {
+            scrubber->passes++;
+        }
+        if (wrapped || found_count > 0 || ++batches % SCRUB_PERSIST_BATCHES == 0) {
+            save_state(scrubber);
+        }
+
+        // Sleep off the time the batch is worth at the configured rate
+        double pause_ms = formatted ? bytes / (scrubber->rate_mb_s * 1024.0 * 1024.0) * 1000.0 : SCRUB_IDLE_MS;
+        if (wrapped && pause_ms < SCRUB_PASS_PAUSE_MS) {
+            pause_ms = SCRUB_PASS_PAUSE_MS;
+        }
+        wait_ms(scrubber, pause_ms);
+    }
+
+    save_state(scrubber);
+    scrubber->running = false;
+    pthread_mutex_unlock(&scrubber->mutex);
+    return NULL;
+}
+
+PfResult pf_scrub_start(FileSystem *fs, double rate_mb_s) {
+    if (!(rate_mb_s > 0)) {
+        return PF_ERR_INVALID_ARGUMENT;
+    }
+
+    Scrubber *scrubber = fs->scrubber;
+    if (!scrubber) {
+        scrubber = calloc(1, sizeof(Scrubber));
+        if (!scrubber) {
+            return PF_ERR_NO_MEMORY;
+        }
+        scrubber->fs = fs;
+        pthread_mutex_init(&scrubber->mutex, NULL);
+        pthread_cond_init(&scrubber->wake, NULL);
+        state_path(fs, scrubber->state_path);
+        load_state(scrubber->state_path, &scrubber->cursor, &scrubber->passes, &scrubber->findings);
+        fs->scrubber = scrubber;
+    }
+
+    pthread_mutex_lock(&scrubber->mutex);
+    scrubber->rate_mb_s = rate_mb_s;  // A running scrubber just changes its rate
+    if (scrubber->running) {
+        pthread_mutex_unlock(&scrubber->mutex);
+        return PF_OK;
+    }
+    scrubber->stop = false;
+    scrubber->cluster_count = fs->fat_table1 ? fs->description.cluster_count : 0;
+    scrubber->clusters_checked = 0;
+    scrubber->bytes_checked = 0;
+    scrubber->running = pthread_create(&scrubber->thread, NULL, scrub_main, scrubber) == 0;
+    bool running = scrubber->running;
+    pthread_mutex_unlock(&scrubber->mutex);
+
+    return running ? PF_OK : PF_ERR_NO_MEMORY;
+}
+
+// Safe while holding fs->lock, the thread never blocks on it
+PfResult pf_scrub_stop(FileSystem *fs) {
+    Scrubber *scrubber = fs->scrubber;
+    if (!scrubber) {
+        return PF_OK;
+    }
+
+    pthread_mutex_lock(&scrubber->mutex);
+    bool running = scrubber->running;
+    scrubber->stop = true;
+    pthread_cond_signal(&scrubber->wake);
+    pthread_mutex_unlock(&scrubber->mutex);
+
+    if (running) {
+        pthread_join(scrubber->thread, NULL);
+    }
+    return PF_OK;
+}
+
+PfResult pf_scrub_status(FileSystem *fs, PfScrubStatus *status) {
+    memset(status, 0, sizeof(*status));
+
+    Scrubber *scrubber = fs->scrubber;
+    if (!scrubber) {
+        // Never started in this session, report what the previous ones left behind
+        char path[SCRUB_STATE_PATH_SIZE];
+        state_path(fs, path);
+        load_state(path, &status->cursor, &status->passes, &status->findings);
+        status->cluster_count = fs->fat_table1 ? fs->description.cluster_count : 0;
+        return PF_OK;
+    }
+
+    pthread_mutex_lock(&scrubber->mutex);
+    status->running = scrubber->running;
+    status->rate_mb_s = scrubber->rate_mb_s;
+    status->cursor = scrubber->cursor;
+    status->cluster_count = scrubber->cluster_count;
+    status->passes = scrubber->passes;
+    status->clusters_checked = scrubber->clusters_checked;
+    status->bytes_checked = scrubber->bytes_checked;
+    status->findings = scrubber->findings;
+    status->log_count = scrubber->log_count;
+    for (int i = 0; i < scrubber->log_count; i++) {
+        status->log[i] = scrubber->log[(scrubber->log_start + i) % PF_SCRUB_LOG_SIZE];
+    }
+    pthread_mutex_unlock(&scrubber->mutex);
+    return PF_OK;
+}
+
+// Stops the thread and frees the scrubber, called when the filesystem is released
+void scrub_release(FileSystem *fs) {
+    Scrubber *scrubber = fs->scrubber;
+    if (!scrubber) return;
+
+    pf_scrub_stop(fs);
+    pthread_mutex_destroy(&scrubber->mutex);
+    pthread_cond_destroy(&scrubber->wake);
+    free(scrubber);
+    fs->scrubber = NULL;
+}
@@ -0,0 +1,359 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "FatTable.h"
+#include "Server.h"
+#include "Stats.h"
+#include "TreeVersions.h"
+
+#define SERVER_BACKLOG 64
+#define SESSION_PATH_SIZE 4096
+
+// One connected client. The accepting thread owns it, the session thread only marks it done.
+typedef struct Client {
+    int fd;                       // Closed by reap_clients() only, so shutdown can never hit a reused fd
+    char cwd[SESSION_PATH_SIZE];  // Working directory, re-resolved before every command
+    Session session;              // Filesystem session the client's commands run in
+    pthread_t thread;
+    bool done;                    // The session thread returned and can be joined
+    struct Client *next;
+} Client;
+
+static FileSystem *served_fs = NULL;
+static long commit_interval = 0;   // Save after every N mutations, 0 = only on shutdown
+static long mutation_count = 0;    // Protected by the write side of the filesystem lock
+static volatile sig_atomic_t stop_requested = 0;
+static Client *clients = NULL;     // Every session thread not joined yet
+static pthread_mutex_t clients_mutex = PTHREAD_MUTEX_INITIALIZER; // Protects clients and their done flags
+
+static void request_stop(int signal_number) {
+    (void)signal_number;
+    stop_requested = 1;
+}
+
+static int send_all(int fd, const char *data, size_t size) {
+    while (size > 0) {
+        ssize_t sent = send(fd, data, size, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        data += sent;
+        size -= (size_t)sent;
+    }
+    return 0;
+}
+
+static int send_frame(int fd, const char *data, size_t size) {
+    char header[32];
+    int header_size = snprintf(header, sizeof(header), "%zu\n", size);
+    if (send_all(fd, header, (size_t)header_size) != 0) return -1;
+    return send_all(fd, data, size);
+}
+
+// Runs a command that only needs the published tree without the lock, so it never waits behind
+// a writer. False when nothing is published or the working directory is not in the published
+// tree, the caller takes the lock then.
+static bool execute_published(Client *client, char *line) {
+    if (!served_fs->versions) {
+        return false;
+    }
+
+    int slot;
+    const DirectoryVersion *root = versions_enter(served_fs, &slot);
+    const DirectoryVersion *cwd;
+    bool published = root && versions_opendir(root, "/", client->cwd, &cwd) == PF_OK;
+    if (published) {
+        Session *session = &client->session;
+        session->published_root = root;
+        session->published_cwd = client->cwd;
+        STAT_INC(STAT_LOCK_FREE_READS);
+        process_command(served_fs, session, line);
+        session->published_root = NULL;
+        session->published_cwd = NULL;
+    }
+    versions_leave(served_fs, slot);
+    return published;
+}
+
+// Runs one command line of a session and returns its output in a malloc'ed buffer
+static char *execute(Client *client, char *line, size_t *output_size) {
+    char *output = NULL;
+    FILE *out = open_memstream(&output, output_size);
+    if (!out) {
+        return NULL;
+    }
+
+    Session *session = &client->session;
+    session->out = out;
+    CommandAccess access = command_access(line);
+    if (access == COMMAND_PUBLISHED && execute_published(client, line)) {
+        session->out = NULL;
+        fclose(out);
+        return output;
+    }
+
+    if (access == COMMAND_WRITE) {
+        pthread_rwlock_wrlock(&served_fs->lock);
+    } else {
+        pthread_rwlock_rdlock(&served_fs->lock);
+    }
+
+    session_enter(session, client->cwd);
+    process_command(served_fs, session, line);
+    session_leave(session, client->cwd, sizeof(client->cwd));
+
+    if (access == COMMAND_WRITE && served_fs->fat_table1 && !served_fs->read_only && commit_interval > 0 && ++mutation_count % commit_interval == 0) {
+        save_system_state(served_fs, session, served_fs->image_path);
+    }
+    session->out = NULL;
+
+    pthread_rwlock_unlock(&served_fs->lock);
+    if (access == COMMAND_WRITE) {
+        versions_reclaim(served_fs);  // Waits for readers of the replaced versions, not for the lock
+    }
+
+    fclose(out);
+    return output;
+}
+
+static void *session_main(void *arg) {
+    Client *client = (Client *)arg;
+    FILE *in = fdopen(dup(client->fd), "r");
+    if (!in) {
+        pthread_mutex_lock(&clients_mutex);
+        client->done = true;
+        pthread_mutex_unlock(&clients_mutex);
+        return NULL;
+    }
+
+    char *line = NULL;
+    size_t line_capacity = 0;
+    while (getline(&line, &line_capacity, in) != -1) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (strcmp(line, "exit") == 0) {
+            break;
+        }
+
+        size_t output_size = 0;
+        char *output = execute(client, line, &output_size);
+        int sent = send_frame(client->fd, output ? output : "", output ? output_size : 0);
+        free(output);
+        if (sent != 0) {
+            break;  // Client went away
+        }
+    }
+
+    free(line);
+    fclose(in);
+    pthread_mutex_lock(&clients_mutex);
+    client->done = true;
+    pthread_mutex_unlock(&clients_mutex);
+    return NULL;
+}
+
+// Joins and frees the finished sessions, or all of them when everything stops
+static void reap_clients(bool all) {
+    pthread_mutex_lock(&clients_mutex);
+    Client **link = &clients;
+    while (*link) {
+        Client *client = *link;
+        if (!all && !client->done) {
+            link = &client->next;
+            continue;
+        }
+        *link = client->next;
+        pthread_mutex_unlock(&clients_mutex);
+        pthread_join(client->thread, NULL);
+        close(client->fd);
+        free(client);
+        pthread_mutex_lock(&clients_mutex);
+    }
+    pthread_mutex_unlock(&clients_mutex);
+}
+
+// Ends every session: reads see the end of the stream once the current command is answered
+static void disconnect_clients() {
+    pthread_mutex_lock(&clients_mutex);
+    for (Client *client = clients; client; client = client->next) {
+        shutdown(client->fd, SHUT_RDWR);
+    }
+    pthread_mutex_unlock(&clients_mutex);
+    reap_clients(true);
+}
+
+static int open_socket(const char *socket_path, struct sockaddr_un *address) {
+    if (strlen(socket_path) >= sizeof(address->sun_path)) {
+        fprintf(stderr, "Socket path '%s' is too long.\n", socket_path);
+        return -1;
+    }
+
+    memset(address, 0, sizeof(*address));
+    address->sun_family = AF_UNIX;
+    strcpy(address->sun_path, socket_path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("socket");
+    }
+    return fd;
+}
+
+int run_server(FileSystem *fs, const char *socket_path, long commit_every) {
+    served_fs = fs;
+    commit_interval = commit_every;
+    fs->defer_save = true;  // Commits happen under the write lock, never from inside a command
+
+    // Every thread of the server (I/O queue, scrubber, reclaimer, sessions and their workers) is
+    // started with the stop signals blocked, only the thread blocked in accept() takes them. A
+    // signal that arrives earlier stays pending until the accept loop starts.
+    sigset_t stop_signals, server_mask;
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGINT);
+    sigaddset(&stop_signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stop_signals, &server_mask);
+
+    load_system_state(fs, NULL, fs->image_path);
+    init_command_table();
+    versions_start(fs);  // ls and pwd read the published tree from now on
+
+    struct sockaddr_un address;
+    int listen_fd = open_socket(socket_path, &address);
+    if (listen_fd < 0) {
+        pthread_sigmask(SIG_SETMASK, &server_mask, NULL);
+        return 1;
+    }
+
+    unlink(socket_path);  // Stale socket of a previous run
+    if (bind(listen_fd, (struct sockaddr *)&address, sizeof(address)) != 0 || listen(listen_fd, SERVER_BACKLOG) != 0) {
+        perror("Failed to listen on socket");
+        pthread_sigmask(SIG_SETMASK, &server_mask, NULL);
+        return 1;
+    }
+
+    // No SA_RESTART: the signal has to interrupt accept()
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = request_stop;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    printf("Serving %s on %s\n", fs->image_path, socket_path);
+    fflush(stdout);
+
+    pthread_sigmask(SIG_SETMASK, &server_mask, NULL);
+
+    while (!stop_requested) {
+        int client_fd = accept(listen_fd, NULL, NULL);
+        reap_clients(false);
+        if (client_fd < 0) {
+            if (errno == EINTR) continue;
+            perror("accept");
+            break;
+        }
+
+        Client *client = (Client *)calloc(1, sizeof(Client));
+        if (!client) {
+            close(client_fd);
+            continue;
+        }
+        client->fd = client_fd;
+        strcpy(client->cwd, "/");
+        session_init(&client->session, fs);
+
+        pthread_sigmask(SIG_BLOCK, &stop_signals, NULL);
+        int created = pthread_create(&client->thread, NULL, session_main, client);
+        pthread_sigmask(SIG_SETMASK, &server_mask, NULL);
+        if (created != 0) {
+            fprintf(stderr, "Failed to start session thread.\n");
+            close(client_fd);
+            free(client);
+            continue;
+        }
+        pthread_mutex_lock(&clients_mutex);
+        client->next = clients;
+        clients = client;
+        pthread_mutex_unlock(&clients_mutex);
+    }
+
+    // Running commands finish and are answered, then every session ends. Nothing reads the
+    // published tree any more, the background threads still share the lock until fs_release().
+    close(listen_fd);
+    disconnect_clients();
+    pthread_rwlock_wrlock(&served_fs->lock);
+    versions_unpublish(fs);
+    versions_reclaim(fs);
+    if (fs->fat_table1 && !fs->read_only) {
+        save_system_state(fs, NULL, fs->image_path);
+    }
+    pthread_rwlock_unlock(&served_fs->lock);
+    unlink(socket_path);
+    return 0;
+}
+
+int run_client(const char *socket_path) {
+    struct sockaddr_un address;
+    int fd = open_socket(socket_path, &address);
+    if (fd < 0) {
+        return 1;
+    }
+    if (connect(fd, (struct sockaddr *)&address, sizeof(address)) != 0) {
+        perror("Failed to connect to server");
+        close(fd);
+        return 1;
+    }
+
+    FILE *in = fdopen(fd, "r");
+    char *line = NULL;
+    size_t line_capacity = 0;
+    char buffer[65536];
+
+    printf("Connected to %s. Enter commands:\n", socket_path);
+    while (1) {
+        printf("> ");
+        fflush(stdout);
+        if (getline(&line, &line_capacity, stdin) == -1) {
+            printf("\n");
+            break;
+        }
+        line[strcspn(line, "\r\n")] = '\0';
+
+        size_t length = strlen(line);
+        line[length] = '\n';
+        if (send_all(fd, line, length + 1) != 0) {
+            fprintf(stderr, "Connection lost.\n");
+            break;
+        }
+        line[length] = '\0';
+        if (strcmp(line, "exit") == 0) {
+            printf("Exiting...\n");
+            break;
+        }
+
+        size_t size;
+        if (fscanf(in, "%zu", &size) != 1 || fgetc(in) != '\n') {
+            fprintf(stderr, "Connection lost.\n");
+            break;
+        }
+        while (size > 0) {
+            size_t chunk = size < sizeof(buffer) ? size : sizeof(buffer);
+            size_t got = fread(buffer, 1, chunk, in);
+            if (got == 0) break;
+            fwrite(buffer, 1, got, stdout);
+            size -= got;
+        }
+    }
+
+    free(line);
+    fclose(in);
+    return 0;
+}
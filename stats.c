@@ -0,0 +1,140 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <time.h>
+#include "Stats.h"
+
+#ifdef FS_STATS
+
+FsStats fs_stats;
+
+static const char *counter_names[STAT_COUNTER_COUNT] = {
+    "clusters allocated",
+    "clusters freed",
+    "allocator FAT entries scanned",
+    "FAT links followed",
+    "bytes read",
+    "bytes written",
+    "read buffers allocated",
+    "path lookups",
+    "path components resolved",
+    "cache hits",
+    "cache misses",
+    "clusters read ahead",
+    "clusters written back",
+    "checksums verified",
+    "checksum mismatches",
+    "FAT entries mirrored",
+    "subtrees reclaimed in background",
+    "host I/O requests queued",
+    "directory versions published",
+    "commands run without the lock",
+    "saves",
+    "save time (ns)",
+    "loads",
+    "load time (ns)",
+};
+
+uint64_t stats_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+// Adds one execution of a command table entry to its latency histogram
+void stats_record_command(int index, const char *name, uint64_t elapsed_ns) {
+    if (index < 0 || index >= STATS_MAX_COMMANDS) return;
+
+    CommandStats *command = &fs_stats.commands[index];
+    __atomic_store_n(&command->name, name, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&command->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&command->total_ns, elapsed_ns, __ATOMIC_RELAXED);
+
+    uint64_t max_ns = __atomic_load_n(&command->max_ns, __ATOMIC_RELAXED);
+    while (elapsed_ns > max_ns &&
+           !__atomic_compare_exchange_n(&command->max_ns, &max_ns, elapsed_ns, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+
+    // Bucket b holds latencies in [2^(b-1), 2^b) microseconds, bucket 0 everything below 1 us
+    uint64_t us = elapsed_ns / 1000;
+    int bucket = 0;
+    while (us > 0 && bucket < STATS_HISTOGRAM_BUCKETS - 1) {
+        us >>= 1;
+        bucket++;
+    }
+    __atomic_fetch_add(&command->buckets[bucket], 1, __ATOMIC_RELAXED);
+}
+
+void stats_print(FILE *out) {
+    fprintf(out, "Counters:\n");
+    for (int i = 0; i < STAT_COUNTER_COUNT; i++) {
+        fprintf(out, "  %-32s %llu\n", counter_names[i], (unsigned long long)fs_stats.counters[i]);
+    }
+
+    uint64_t lookups = fs_stats.counters[STAT_CACHE_HITS] + fs_stats.counters[STAT_CACHE_MISSES];
+    if (lookups > 0) {
+        fprintf(out, "  %-32s %.2f %%\n", "cache hit rate", 100.0 * fs_stats.counters[STAT_CACHE_HITS] / lookups);
+    }
+    if (fs_stats.counters[STAT_PATH_LOOKUPS] > 0) {
+        fprintf(out, "  %-32s %.2f\n", "components per lookup",
+                (double)fs_stats.counters[STAT_PATH_COMPONENTS] / fs_stats.counters[STAT_PATH_LOOKUPS]);
+    }
+
+    fprintf(out, "Command latency:\n");
+    fprintf(out, "  %-10s %10s %12s %12s  %s\n", "Command", "Count", "Avg us", "Max us", "Histogram (us upper bound: count)");
+    for (int i = 0; i < STATS_MAX_COMMANDS; i++) {
+        const CommandStats *command = &fs_stats.commands[i];
+        uint64_t count = __atomic_load_n(&command->count, __ATOMIC_RELAXED);  // A reset may clear it meanwhile
+        if (count == 0) continue;
+
+        fprintf(out, "  %-10s %10llu %12.2f %12.2f ", command->name, (unsigned long long)count,
+                command->total_ns / 1000.0 / count, command->max_ns / 1000.0);
+        for (int b = 0; b < STATS_HISTOGRAM_BUCKETS; b++) {
+            if (command->buckets[b] == 0) continue;
+            if (b == STATS_HISTOGRAM_BUCKETS - 1) {
+                fprintf(out, " inf:%llu", (unsigned long long)command->buckets[b]);
+            } else {
+                fprintf(out, " %llu:%llu", 1ull << b, (unsigned long long)command->buckets[b]);
+            }
+        }
+        fprintf(out, "\n");
+    }
+}
+
+// Server sessions keep counting while another one resets, every field is cleared atomically
+void stats_reset() {
+    for (int i = 0; i < STAT_COUNTER_COUNT; i++) {
+        __atomic_store_n(&fs_stats.counters[i], 0, __ATOMIC_RELAXED);
+    }
+    for (int i = 0; i < STATS_MAX_COMMANDS; i++) {
+        CommandStats *command = &fs_stats.commands[i];
+        __atomic_store_n(&command->count, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&command->total_ns, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&command->max_ns, 0, __ATOMIC_RELAXED);
+        for (int b = 0; b < STATS_HISTOGRAM_BUCKETS; b++) {
+            __atomic_store_n(&command->buckets[b], 0, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+#else
+
+void stats_print(FILE *out) {
+    fprintf(out, "Statistics are disabled in this build (compile with FS_STATS).\n");
+}
+
+void stats_reset() {
+}
+
+#endif // FS_STATS
+
+int stats_dump_file(const char *path) {
+    FILE *file = fopen(path, "w");
+    if (!file) {
+        perror("Failed to write statistics");
+        return -1;
+    }
+    stats_print(file);
+    fclose(file);
+    return 0;
+}
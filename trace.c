@@ -0,0 +1,100 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "Trace.h"
+
+// One finished span. Names and categories are string literals, so only pointers are stored.
+typedef struct TraceSpan {
+    const char *category;
+    const char *name;
+    uint64_t start_ns;
+    uint64_t duration_ns;
+    uint32_t thread;         // Small per-thread number, one timeline row per server session
+} TraceSpan;
+
+bool trace_enabled = false;
+
+static TraceSpan *trace_buffer = NULL;
+static int32_t trace_capacity = 0;
+static uint64_t trace_written = 0;   // Total spans recorded, the ring holds the last trace_capacity
+static uint64_t trace_origin_ns = 0; // Timestamps in the JSON are relative to trace_start()
+static uint32_t trace_next_thread = 0;
+static __thread uint32_t trace_thread = 0; // 0 until the thread records its first span
+
+uint64_t trace_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+void trace_span(const char *category, const char *name, uint64_t start_ns) {
+    if (!trace_enabled) return;
+
+    // Server sessions record spans concurrently, each one claims its own slot
+    uint64_t slot = __atomic_fetch_add(&trace_written, 1, __ATOMIC_RELAXED);
+    TraceSpan *span = &trace_buffer[slot % trace_capacity];
+    span->category = category;
+    span->name = name;
+    span->start_ns = start_ns;
+    span->duration_ns = trace_now_ns() - start_ns;
+    if (trace_thread == 0) {
+        trace_thread = __atomic_add_fetch(&trace_next_thread, 1, __ATOMIC_RELAXED);
+    }
+    span->thread = trace_thread;
+}
+
+int trace_start(int32_t capacity) {
+    if (capacity <= 0) capacity = TRACE_DEFAULT_CAPACITY;
+
+    free(trace_buffer);
+    trace_buffer = (TraceSpan *)malloc((size_t)capacity * sizeof(TraceSpan));
+    if (!trace_buffer) {
+        fprintf(stderr, "Error: Cannot allocate trace buffer for %d spans.\n", capacity);
+        trace_capacity = 0;
+        trace_enabled = false;
+        return -1;
+    }
+
+    trace_capacity = capacity;
+    trace_written = 0;
+    trace_origin_ns = trace_now_ns();
+    trace_enabled = true;
+    return 0;
+}
+
+int trace_stop(const char *path) {
+    if (!trace_buffer) {
+        fprintf(stderr, "Error: Tracing was not started.\n");
+        return -1;
+    }
+    trace_enabled = false;
+
+    FILE *file = fopen(path, "w");
+    if (!file) {
+        perror("Failed to write trace");
+        return -1;
+    }
+
+    uint64_t first = trace_written > (uint64_t)trace_capacity ? trace_written - trace_capacity : 0;
+
+    fprintf(file, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n");
+    for (uint64_t i = first; i < trace_written; i++) {
+        const TraceSpan *span = &trace_buffer[i % trace_capacity];
+        fprintf(file, "{\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"X\", \"ts\": %.3f, \"dur\": %.3f, \"pid\": 1, \"tid\": %u}%s\n",
+                span->name, span->category, (span->start_ns - trace_origin_ns) / 1000.0,
+                span->duration_ns / 1000.0, span->thread, i + 1 < trace_written ? "," : "");
+    }
+    fprintf(file, "]}\n");
+    fclose(file);
+
+    if (first > 0) {
+        fprintf(stderr, "Trace buffer wrapped, %llu oldest spans were dropped.\n", (unsigned long long)first);
+    }
+
+    free(trace_buffer);
+    trace_buffer = NULL;
+    trace_capacity = 0;
+    return 0;
+}
@@ -0,0 +1,185 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "IoQueue.h"
+#include "Transfer.h"
+
+// File name: transfer.c
+// Description: Ring of buffers between the thread that holds the filesystem and the host file.
+//              Each slot covers the next buffer_size bytes of the file and is read or written by
+//              one request on the I/O queue, so all slots can be in flight at once.
+
+struct Transfer {
+    IoQueue *io;                    // NULL: a single buffer, read or written by the caller
+    int fd;
+    bool to_host;
+    size_t buffer_size;
+    uint64_t size;                  // Host bytes of the whole transfer
+    off_t offset;                   // Host offset of the next slot requested or pushed
+    char *buffers[TRANSFER_SLOTS];
+    size_t lengths[TRANSFER_SLOTS];
+    IoBatch batches[TRANSFER_SLOTS]; // The request of each slot
+    int slot_count;
+    int head;                       // Next slot to request (from_host) or fill (to_host)
+    int tail;                       // Next slot handed to the caller (from_host)
+    int requested;                  // Slots read or being read and not released yet (from_host)
+    bool held;                      // The caller still holds the slot at tail (transfer_pull)
+    bool failed;                    // Host read or write failed
+};
+
+static bool write_all(int fd, const char *data, size_t size) {
+    while (size > 0) {
+        ssize_t written = write(fd, data, size);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        data += written;
+        size -= (size_t)written;
+    }
+    return true;
+}
+
+// Reads until size bytes or the end of the file, -1 on error
+static ssize_t read_full(int fd, char *data, size_t size) {
+    size_t total = 0;
+    while (total < size) {
+        ssize_t got = read(fd, data + total, size - total);
+        if (got < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (got == 0) break;
+        total += (size_t)got;
+    }
+    return (ssize_t)total;
+}
+
+// Puts a read on every free slot until the end of the file
+static void request_reads(Transfer *transfer) {
+    while (transfer->requested < transfer->slot_count && (uint64_t)transfer->offset < transfer->size) {
+        uint64_t left = transfer->size - (uint64_t)transfer->offset;
+        size_t length = left < transfer->buffer_size ? (size_t)left : transfer->buffer_size;
+        int slot = transfer->head;
+        io_read(transfer->io, &transfer->batches[slot], transfer->fd, transfer->buffers[slot], length, transfer->offset);
+        transfer->lengths[slot] = length;
+        transfer->offset += (off_t)length;
+        transfer->head = (slot + 1) % transfer->slot_count;
+        transfer->requested++;
+    }
+}
+
+static Transfer *transfer_create(IoQueue *io, int fd, bool to_host, size_t unit, uint64_t size) {
+    Transfer *transfer = calloc(1, sizeof(Transfer));
+    if (!transfer) return NULL;
+
+    // Positional requests need a regular file, anything else is copied in order by the caller
+    struct stat status;
+    size_t buffer_size = unit * (TRANSFER_BUFFER_SIZE / unit > 0 ? TRANSFER_BUFFER_SIZE / unit : 1);
+    bool queued = io && size > buffer_size && fstat(fd, &status) == 0 && S_ISREG(status.st_mode);
+    transfer->io = queued ? io : NULL;
+    transfer->fd = fd;
+    transfer->to_host = to_host;
+    transfer->size = size;
+    transfer->slot_count = queued ? TRANSFER_SLOTS : 1;
+    if (size <= buffer_size) {
+        // A single buffer only needs to hold the file, rounded up to whole units
+        buffer_size = size > 0 ? (size_t)((size + unit - 1) / unit * unit) : unit;
+    }
+    transfer->buffer_size = buffer_size;
+
+    for (int i = 0; i < transfer->slot_count; i++) {
+        transfer->buffers[i] = malloc(buffer_size);
+        if (!transfer->buffers[i]) {
+            for (int j = 0; j < i; j++) free(transfer->buffers[j]);
+            free(transfer);
+            return NULL;
+        }
+    }
+    return transfer;
+}
+
+Transfer *transfer_to_host(IoQueue *io, int fd, size_t unit, uint64_t size) {
+    return transfer_create(io, fd, true, unit, size);
+}
+
+Transfer *transfer_from_host(IoQueue *io, int fd, size_t unit, uint64_t size) {
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    return transfer_create(io, fd, false, unit, size);
+}
+
+char *transfer_fill(Transfer *transfer, size_t *capacity) {
+    *capacity = transfer->buffer_size;
+    int slot = transfer->head;
+    if (transfer->io && !io_wait(transfer->io, &transfer->batches[slot])) {
+        transfer->failed = true;  // The write that last used this slot
+    }
+    return transfer->failed ? NULL : transfer->buffers[slot];
+}
+
+bool transfer_push(Transfer *transfer, size_t length) {
+    int slot = transfer->head;
+    if (!transfer->io) {
+        if (!write_all(transfer->fd, transfer->buffers[slot], length)) {
+            transfer->failed = true;
+        }
+        return !transfer->failed;
+    }
+
+    io_write(transfer->io, &transfer->batches[slot], transfer->fd, transfer->buffers[slot], length, transfer->offset);
+    transfer->offset += (off_t)length;
+    transfer->head = (slot + 1) % transfer->slot_count;
+    return true;  // Write errors show up in transfer_fill() and transfer_finish()
+}
+
+const char *transfer_pull(Transfer *transfer, size_t *length) {
+    if (!transfer->io) {
+        uint64_t left = transfer->size - (uint64_t)transfer->offset;
+        if (left == 0 || transfer->failed) return NULL;
+        ssize_t got = read_full(transfer->fd, transfer->buffers[0], left < transfer->buffer_size ? (size_t)left : transfer->buffer_size);
+        if (got <= 0) {
+            transfer->failed = got < 0;  // Or the file shrank, the caller notices the missing bytes
+            return NULL;
+        }
+        transfer->offset += (off_t)got;
+        *length = (size_t)got;
+        return transfer->buffers[0];
+    }
+
+    if (transfer->held) {
+        transfer->tail = (transfer->tail + 1) % transfer->slot_count;
+        transfer->requested--;
+        transfer->held = false;
+    }
+    request_reads(transfer);
+    if (transfer->requested == 0 || transfer->failed) return NULL;
+
+    int slot = transfer->tail;
+    if (!io_wait(transfer->io, &transfer->batches[slot])) {
+        transfer->failed = true;  // Also when the file shrank under the read
+        return NULL;
+    }
+    *length = transfer->lengths[slot];
+    transfer->held = true;
+    return transfer->buffers[slot];
+}
+
+bool transfer_finish(Transfer *transfer) {
+    // Writes drain, reads the caller stopped pulling are waited out before the buffers go
+    for (int i = 0; transfer->io && i < transfer->slot_count; i++) {
+        if (!io_wait(transfer->io, &transfer->batches[i]) && transfer->to_host) {
+            transfer->failed = true;
+        }
+    }
+
+    bool ok = !transfer->failed;
+    for (int i = 0; i < transfer->slot_count; i++) {
+        free(transfer->buffers[i]);
+    }
+    free(transfer);
+    return ok;
+}
@@ -0,0 +1,92 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include "Traverse.h"
+
+// File name: traverse.c
+// Description: Explicit-stack depth-first traversal shared by load, free, rm, check and the
+//              other whole-tree operations.
+
+#define TREE_STACK_INITIAL 64            // Frames before the stack grows, doubled as needed
+
+// A directory whose children are being visited
+typedef struct TreeFrame {
+    DirectoryItem *dir;
+    int next;                            // Next child to visit
+    int depth;
+    void *data;                          // TreeVisit.data of dir
+    void *parent_data;                   // TreeVisit.parent_data of dir
+} TreeFrame;
+
+PfResult tree_walk(DirectoryItem *root, TreeCallback pre, TreeCallback post, void *context) {
+    TreeVisit visit = { root, 0, NULL, NULL };
+    TreeAction action = pre ? pre(&visit, context) : TREE_CONTINUE;
+    if (action == TREE_STOP) {
+        return PF_END;
+    }
+    if (root->isFile || action == TREE_SKIP) {
+        return post && post(&visit, context) == TREE_STOP ? PF_END : PF_OK;
+    }
+
+    size_t capacity = TREE_STACK_INITIAL;
+    TreeFrame *stack = malloc(capacity * sizeof(TreeFrame));
+    if (!stack) {
+        return PF_ERR_NO_MEMORY;
+    }
+    size_t count = 0;
+    stack[count++] = (TreeFrame){ root, 0, 0, visit.data, NULL };
+
+    PfResult result = PF_OK;
+    while (count > 0) {
+        TreeFrame *frame = &stack[count - 1];
+        DirectoryItem *dir = frame->dir;
+
+        // All children done, the directory itself is finished (post may free it)
+        if (frame->next >= dir->child_count) {
+            TreeVisit done = { dir, frame->depth, frame->parent_data, frame->data };
+            count--;
+            if (post && post(&done, context) == TREE_STOP) {
+                result = PF_END;
+                break;
+            }
+            continue;
+        }
+
+        int i = frame->next++;
+        if (i + TREE_PREFETCH_DISTANCE < dir->child_count && dir->children[i + TREE_PREFETCH_DISTANCE]) {
+            __builtin_prefetch(dir->children[i + TREE_PREFETCH_DISTANCE]);
+        }
+        DirectoryItem *child = dir->children[i];
+        if (!child) continue;
+
+        TreeVisit child_visit = { child, frame->depth + 1, frame->data, NULL };
+        action = pre ? pre(&child_visit, context) : TREE_CONTINUE;
+        if (action == TREE_STOP) {
+            result = PF_END;
+            break;
+        }
+
+        if (!child->isFile && action == TREE_CONTINUE) {
+            if (count == capacity) {
+                TreeFrame *grown = realloc(stack, capacity * 2 * sizeof(TreeFrame));
+                if (!grown) {
+                    result = PF_ERR_NO_MEMORY;
+                    break;
+                }
+                stack = grown;
+                capacity *= 2;
+            }
+            stack[count] = (TreeFrame){ child, 0, child_visit.depth, child_visit.data, child_visit.parent_data };
+            count++;
+            continue;
+        }
+
+        if (post && post(&child_visit, context) == TREE_STOP) {
+            result = PF_END;
+            break;
+        }
+    }
+
+    free(stack);
+    return result;
+}
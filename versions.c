@@ -0,0 +1,459 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "Stats.h"
+#include "Traverse.h"
+#include "TreeVersions.h"
+
+// File name: versions.c
+// Description: Published directory versions and their epoch based reclamation. Readers count
+//              themselves in one of two counters, picked by the parity of the epoch. A grace
+//              period flips the epoch twice and waits for the old counter to drain each time,
+//              after that no reader can still hold a version that was unpublished before it.
+
+#define GRACE_POLL_NS 20000              // Pause between two looks at a draining reader counter
+
+// One child as it was when its directory was published
+typedef struct VersionEntry {
+    const char *name;
+    bool is_file;
+    bool is_inline;
+    int32_t size;
+    int32_t start_cluster;
+    int32_t cluster_count;               // Chain length at publication, -1 if it was broken
+    const DirectoryVersion *directory;   // Subdirectories: their version, NULL for files
+    const DirectoryItem *item;           // Writer side identity of the child, readers never follow it
+} VersionEntry;
+
+struct DirectoryVersion {
+    DirectoryVersion *next;              // Writer side: built and not published yet, or retired
+    bool subtree;                        // Retired together with every version below it
+    VersionEntry self;                   // The directory itself, what a stat of the root shows
+    int count;
+    VersionEntry entries[];              // The names follow the entries in the same allocation
+};
+
+struct TreeVersions {
+    DirectoryVersion *root;              // Published tree, NULL while readers have to take the lock
+    bool live;                           // Item versions match the items, every change is published
+    unsigned epoch;                      // Its parity picks the counter arriving readers use
+    int readers[2];                      // Readers inside the tree, by the parity they arrived with
+    pthread_mutex_t mutex;               // Protects retired
+    pthread_mutex_t grace;               // One grace period at a time
+    DirectoryVersion *retired;           // Unpublished, waiting for readers that may still see them
+};
+
+static void free_subtree(DirectoryVersion *root) {
+    // The next links of a retired subtree are free, they make the stack
+    root->next = NULL;
+    DirectoryVersion *stack = root;
+    while (stack) {
+        DirectoryVersion *version = stack;
+        stack = version->next;
+        for (int i = 0; i < version->count; i++) {
+            DirectoryVersion *child = (DirectoryVersion *)version->entries[i].directory;
+            if (child) {
+                child->next = stack;
+                stack = child;
+            }
+        }
+        free(version);
+    }
+}
+
+static void free_list(DirectoryVersion *list, bool subtrees) {
+    while (list) {
+        DirectoryVersion *next = list->next;
+        if (subtrees && list->subtree) {
+            free_subtree(list);
+        } else {
+            free(list);
+        }
+        list = next;
+    }
+}
+
+// The version must already be unreachable from the published root
+static void retire(TreeVersions *versions, DirectoryVersion *version, bool subtree) {
+    version->subtree = subtree;
+    pthread_mutex_lock(&versions->mutex);
+    version->next = versions->retired;
+    versions->retired = version;
+    pthread_mutex_unlock(&versions->mutex);
+}
+
+static void publish_root(TreeVersions *versions, DirectoryVersion *root) {
+    __atomic_store_n(&versions->root, root, __ATOMIC_SEQ_CST);
+}
+
+// Entry of child in an older version of its directory, usually at the same position
+static const VersionEntry *previous_entry(const DirectoryVersion *old, int position, const DirectoryItem *child) {
+    if (position < old->count && old->entries[position].item == child) {
+        return &old->entries[position];
+    }
+    for (int i = 0; i < old->count; i++) {
+        if (old->entries[i].item == child) return &old->entries[i];
+    }
+    return NULL;
+}
+
+static void fill_entry(VersionEntry *entry, const DirectoryItem *item, char **names) {
+    size_t length = strlen(item->item_name) + 1;
+    memcpy(*names, item->item_name, length);
+    entry->name = *names;
+    *names += length;
+    entry->is_file = item->isFile;
+    entry->is_inline = item->is_inline;
+    entry->size = item->size;
+    entry->start_cluster = item->start_cluster;
+    entry->directory = NULL;
+    entry->item = item;
+}
+
+// Copies dir as it is now. Subdirectories point to their current versions, except changed,
+// whose new version is not in the item yet. Chain lengths of files that kept their chain are
+// taken over from the previous version unless fresh. NULL if out of memory or a subdirectory
+// has no version.
+static DirectoryVersion *build_version(FileSystem *fs, const DirectoryItem *dir, const DirectoryItem *changed,
+                                       const DirectoryVersion *changed_version, bool fresh) {
+    size_t names = strlen(dir->item_name) + 1;
+    int count = 0;
+    for (int i = 0; i < dir->child_count; i++) {
+        if (dir->children[i]) {
+            names += strlen(dir->children[i]->item_name) + 1;
+            count++;
+        }
+    }
+
+    DirectoryVersion *version = malloc(sizeof(DirectoryVersion) + (size_t)count * sizeof(VersionEntry) + names);
+    if (!version) return NULL;
+    char *name = (char *)&version->entries[count];
+    version->next = NULL;
+    version->subtree = false;
+    version->count = count;
+    fill_entry(&version->self, dir, &name);
+    version->self.cluster_count = chain_length(fs, dir->start_cluster);
+
+    const DirectoryVersion *old = fresh ? NULL : dir->version;
+    int position = 0;
+    for (int i = 0; i < dir->child_count; i++) {
+        const DirectoryItem *child = dir->children[i];
+        if (!child) continue;
+
+        VersionEntry *entry = &version->entries[position];
+        fill_entry(entry, child, &name);
+        if (!child->isFile) {
+            entry->directory = child == changed ? changed_version : child->version;
+            if (!entry->directory) {
+                free(version);
+                return NULL;
+            }
+            entry->cluster_count = entry->directory->self.cluster_count;
+        } else if (child->is_inline) {
+            entry->cluster_count = 0;
+        } else {
+            const VersionEntry *before = old ? previous_entry(old, position, child) : NULL;
+            bool same_chain = before && !before->is_inline && before->start_cluster == child->start_cluster && before->size == child->size;
+            entry->cluster_count = same_chain ? before->cluster_count : chain_length(fs, child->start_cluster);
+        }
+        position++;
+    }
+    return version;
+}
+
+void versions_unpublish(FileSystem *fs) {
+    TreeVersions *versions = fs->versions;
+    if (!versions) return;
+
+    DirectoryVersion *root = versions->root;
+    publish_root(versions, NULL);
+    if (root) {
+        retire(versions, root, true);
+    }
+    versions->live = false;  // The item versions are retired with the tree, nothing reads them again
+}
+
+typedef struct BuildWalk {
+    FileSystem *fs;
+    DirectoryVersion *built;             // Every version of this rebuild, for the cleanup
+} BuildWalk;
+
+// Children come before their directory, so their versions are ready when it is copied
+static TreeAction build_item(TreeVisit *visit, void *context) {
+    BuildWalk *build = context;
+    DirectoryItem *item = visit->item;
+    if (item->isFile) {
+        return TREE_CONTINUE;
+    }
+
+    DirectoryVersion *version = build_version(build->fs, item, NULL, NULL, true);
+    if (!version) {
+        return TREE_STOP;
+    }
+    version->next = build->built;
+    build->built = version;
+    item->version = version;
+    STAT_INC(STAT_VERSIONS_PUBLISHED);
+    return TREE_CONTINUE;
+}
+
+void versions_rebuild(FileSystem *fs) {
+    TreeVersions *versions = fs->versions;
+    if (!versions) return;
+
+    versions_unpublish(fs);
+    if (!fs->fat_table1) {
+        return;  // Nothing to read before format, readers take the lock and are told so
+    }
+
+    BuildWalk build = { fs, NULL };
+    if (tree_walk(&fs->root_directory, NULL, build_item, &build) != PF_OK) {
+        free_list(build.built, false);  // Never published, the lock keeps serving the readers
+        return;
+    }
+    publish_root(versions, fs->root_directory.version);
+    versions->live = true;
+}
+
+void versions_publish(FileSystem *fs, DirectoryItem *dir) {
+    TreeVersions *versions = fs->versions;
+    if (!versions || !versions->live) return;
+
+    // Copy dir and every directory above it, lowest first, each copy points to the one below
+    DirectoryVersion *built = NULL;
+    DirectoryVersion **tail = &built;
+    const DirectoryItem *changed = NULL;
+    DirectoryVersion *changed_version = NULL;
+    int depth = 0;
+    for (const DirectoryItem *current = dir; current; current = current->parent) {
+        DirectoryVersion *version = build_version(fs, current, changed, changed_version, false);
+        if (!version) {
+            free_list(built, false);
+            versions_unpublish(fs);
+            return;
+        }
+        *tail = version;
+        tail = &version->next;
+        changed = current;
+        changed_version = version;
+        depth++;
+    }
+    if (changed != &fs->root_directory) {
+        free_list(built, false);  // dir is not in the tree (yet), nobody can see it
+        return;
+    }
+
+    // Readers arriving from now on see the new root, the replaced versions wait in the retired
+    // list for those still inside the old one
+    STAT_ADD(STAT_VERSIONS_PUBLISHED, depth);
+    publish_root(versions, changed_version);
+    DirectoryVersion *version = built;
+    for (DirectoryItem *current = dir; current; current = current->parent) {
+        DirectoryVersion *next = version->next;
+        if (current->version) {
+            retire(versions, current->version, false);
+        }
+        current->version = version;
+        version = next;
+    }
+}
+
+void versions_retire_subtree(FileSystem *fs, DirectoryItem *dir) {
+    TreeVersions *versions = fs->versions;
+    if (!versions || !versions->live || !dir->version) return;
+
+    retire(versions, dir->version, true);
+    dir->version = NULL;
+}
+
+static void wait_for_readers(TreeVersions *versions) {
+    // A reader may read the epoch before the first flip and count itself after it, it is
+    // waited for by the second one
+    for (int flip = 0; flip < 2; flip++) {
+        unsigned before = __atomic_fetch_add(&versions->epoch, 1, __ATOMIC_SEQ_CST);
+        while (__atomic_load_n(&versions->readers[before & 1], __ATOMIC_SEQ_CST) > 0) {
+            struct timespec pause = { 0, GRACE_POLL_NS };
+            nanosleep(&pause, NULL);
+        }
+    }
+}
+
+void versions_reclaim(FileSystem *fs) {
+    TreeVersions *versions = fs->versions;
+    if (!versions) return;
+
+    pthread_mutex_lock(&versions->mutex);
+    DirectoryVersion *retired = versions->retired;
+    versions->retired = NULL;
+    pthread_mutex_unlock(&versions->mutex);
+    if (!retired) return;
+
+    pthread_mutex_lock(&versions->grace);
+    wait_for_readers(versions);
+    pthread_mutex_unlock(&versions->grace);
+    free_list(retired, true);
+}
+
+void versions_start(FileSystem *fs) {
+    if (fs->versions) return;
+
+    TreeVersions *versions = calloc(1, sizeof(TreeVersions));
+    if (!versions) return;  // Every command keeps taking the lock
+    pthread_mutex_init(&versions->mutex, NULL);
+    pthread_mutex_init(&versions->grace, NULL);
+    fs->versions = versions;
+    versions_rebuild(fs);
+}
+
+void versions_release(FileSystem *fs) {
+    TreeVersions *versions = fs->versions;
+    if (!versions) return;
+
+    versions_unpublish(fs);
+    free_list(versions->retired, true);
+    pthread_mutex_destroy(&versions->mutex);
+    pthread_mutex_destroy(&versions->grace);
+    free(versions);
+    fs->versions = NULL;
+}
+
+const DirectoryVersion *versions_enter(FileSystem *fs, int *slot) {
+    TreeVersions *versions = fs->versions;
+    *slot = (int)(__atomic_load_n(&versions->epoch, __ATOMIC_SEQ_CST) & 1);
+    __atomic_fetch_add(&versions->readers[*slot], 1, __ATOMIC_SEQ_CST);
+    return __atomic_load_n(&versions->root, __ATOMIC_SEQ_CST);
+}
+
+void versions_leave(FileSystem *fs, int slot) {
+    __atomic_fetch_sub(&fs->versions->readers[slot], 1, __ATOMIC_RELEASE);
+}
+
+static const VersionEntry *find_entry(const DirectoryVersion *dir, const char *name, size_t length) {
+    for (int i = 0; i < dir->count; i++) {
+        const char *candidate = dir->entries[i].name;
+        if (strncmp(candidate, name, length) == 0 && candidate[length] == '\0') {
+            return &dir->entries[i];
+        }
+    }
+    return NULL;
+}
+
+static size_t count_parts(const char *path) {
+    size_t count = 1;
+    for (; *path; path++) {
+        if (*path == '/') count++;
+    }
+    return count;
+}
+
+// Follows the components of path from the top of the stack of entries (the root when depth is 0),
+// with the same results as resolve_path(). The working directory counts as a path on the way.
+static PfResult walk_path(const DirectoryVersion *root, const char *path, bool on_the_way,
+                          const VersionEntry **stack, size_t *depth) {
+    int part_count = 0;
+    const char *start = path;
+    while (*start) {
+        while (*start == '/') start++;
+        if (!*start) break;
+
+        size_t length = strcspn(start, "/");
+        const char *rest = start + length;
+        if (length >= MAX_ITEM_NAME_SIZE || part_count++ >= MAX_CHILDREN) {
+            return PF_ERR_INVALID_PATH;
+        }
+        while (*rest == '/') rest++;
+        bool last = !on_the_way && !*rest;
+
+        STAT_INC(STAT_PATH_COMPONENTS);
+        if (length == 1 && start[0] == '.') {
+            // Stays where it is
+        } else if (length == 2 && start[0] == '.' && start[1] == '.') {
+            if (*depth == 0) {
+                return PF_ERR_INVALID_PATH;  // No parent directory available
+            }
+            (*depth)--;
+        } else {
+            const DirectoryVersion *current = *depth == 0 ? root : stack[*depth - 1]->directory;
+            const VersionEntry *next = current ? find_entry(current, start, length) : NULL;
+            if (!next) {
+                return last ? PF_ERR_NOT_FOUND : PF_ERR_PATH_NOT_FOUND;
+            }
+            stack[(*depth)++] = next;
+        }
+        start = rest;
+    }
+    return PF_OK;
+}
+
+// Entry the path leads to, NULL for the root. Entries of a ".." go back along a stack, the
+// versions have no parent links because the unchanged ones are shared between trees.
+static PfResult resolve(const DirectoryVersion *root, const char *cwd, const char *path, const VersionEntry **entry) {
+    *entry = NULL;
+    if (!path || !*path) {
+        return PF_ERR_INVALID_PATH;
+    }
+
+    STAT_INC(STAT_PATH_LOOKUPS);
+    const VersionEntry **stack = malloc((count_parts(cwd) + count_parts(path)) * sizeof(*stack));
+    if (!stack) {
+        return PF_ERR_NO_MEMORY;
+    }
+    size_t depth = 0;
+    PfResult result = path[0] == '/' ? PF_OK : walk_path(root, cwd, true, stack, &depth);
+    if (result == PF_OK) {
+        result = walk_path(root, path, false, stack, &depth);
+    }
+    if (result == PF_OK && depth > 0) {
+        *entry = stack[depth - 1];
+    }
+    free(stack);
+    return result;
+}
+
+static void fill_stat(const VersionEntry *entry, PfStat *stat) {
+    strncpy(stat->name, entry->name, MAX_ITEM_NAME_SIZE - 1);
+    stat->name[MAX_ITEM_NAME_SIZE - 1] = '\0';
+    stat->is_file = entry->is_file;
+    stat->size = entry->size;
+    stat->start_cluster = entry->start_cluster;
+    stat->is_inline = entry->is_inline;
+    stat->cluster_count = entry->cluster_count;
+}
+
+PfResult versions_stat(const DirectoryVersion *root, const char *cwd, const char *path, PfStat *stat) {
+    const VersionEntry *entry;
+    PfResult result = resolve(root, cwd, path, &entry);
+    if (result != PF_OK) {
+        return result;
+    }
+    if (!entry) {
+        entry = &root->self;
+    }
+
+    fill_stat(entry, stat);
+    return PF_OK;
+}
+
+PfResult versions_opendir(const DirectoryVersion *root, const char *cwd, const char *path, const DirectoryVersion **dir) {
+    const VersionEntry *entry;
+    PfResult result = resolve(root, cwd, path, &entry);
+    if (result != PF_OK) {
+        return result;
+    }
+    if (entry && entry->is_file) {
+        return PF_ERR_NOT_A_DIRECTORY;
+    }
+    *dir = entry ? entry->directory : root;
+    return PF_OK;
+}
+
+PfResult versions_readdir(const DirectoryVersion *dir, int *index, PfStat *entry) {
+    if (*index >= dir->count) {
+        return PF_END;
+    }
+    fill_stat(&dir->entries[(*index)++], entry);
+    return PF_OK;
+}